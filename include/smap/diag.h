@@ -26,6 +26,10 @@ extern smap_stream_t smap_trace_str;
 void smap_verror(const char *fmt, va_list ap);
 void smap_error(const char *fmt, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
 
+void smap_diag_set_lock(void (*lock)(void), void (*unlock)(void));
+void smap_diag_lock(void);
+void smap_diag_unlock(void);
+
 extern char *smap_progname;
 
 void smap_set_program_name(char *name);
@@ -20,23 +20,50 @@
 #define __smap_s_cat3__(a,b,c) a ## b ## c
 #define SMAP_EXPORT(module,name) __smap_s_cat3__(module,_LTX_,name)
 
-#define SMAP_MODULE_VERSION 2
+#define SMAP_MODULE_VERSION 3
 #define SMAP_CAPA_NONE 0
 #define SMAP_CAPA_QUERY 0x0001
 #define SMAP_CAPA_XFORM 0x0002
+/* Different databases of the module can be used from different
+   threads at the same time */
+#define SMAP_CAPA_THREADSAFE 0x0004
+/* The module implements asynchronous queries (version 3) */
+#define SMAP_CAPA_ASYNC 0x0008
+/* The module can look up several keys at once (version 3) */
+#define SMAP_CAPA_BATCH 0x0010
+/* Databases opened by the master process remain usable in its
+   subprocesses, i.e. their handles do not hold descriptors or other
+   per-process resources (version 3) */
+#define SMAP_CAPA_FORKSAFE 0x0020
+/* The module reports keys changed in its databases (version 3) */
+#define SMAP_CAPA_NOTIFY 0x0040
 #define SMAP_CAPA_DEFAULT SMAP_CAPA_QUERY
 
 typedef struct smap_database *smap_database_t;
+typedef struct smap_query *smap_query_t;
+
+/* Return value of smap_query_complete: the query is still in progress */
+#define SMAP_QUERY_PENDING (-1)
 
 struct sockaddr;
+struct timeval;
 
 struct smap_conninfo {
 	struct sockaddr const *src;
 	int srclen;
 	struct sockaddr const *dst;
 	int dstlen;
+	/* Time by which the reply must be sent, NULL if unlimited */
+	struct timeval const *deadline;
 };
 
+long smap_deadline_left(struct smap_conninfo const *conninfo);
+
+/* Non-zero if smapd serves all sessions in the process that opened
+   the databases (single-process mode) */
+int smap_single_process(void);
+void smap_set_single_process(int val);
+
 struct smap_module {
 	unsigned smap_version;
 	unsigned smap_capabilities;
@@ -54,6 +81,70 @@ struct smap_module {
 			  struct smap_conninfo const *conninfo,
 			  const char *input,
 			  char **output);
+	/* Asynchronous queries (version 3, SMAP_CAPA_ASYNC).
+
+	   smap_query_submit starts the query and returns its handle, or
+	   NULL if the query cannot be started asynchronously.
+	   smap_query_fd returns the descriptor to wait on and stores in
+	   *EVENTS the poll(2) events to wait for, or 0 if there is no
+	   need to wait.  smap_query_complete
+	   is called with the events that occurred.  It returns
+	   SMAP_QUERY_PENDING if the query is still in progress.
+	   Otherwise, it frees the handle and returns the same value as
+	   smap_query would, having sent the reply to OSTR.
+	   smap_query_cancel aborts the query and frees the handle. */
+	smap_query_t (*smap_query_submit)(smap_database_t dbp,
+					  const char *map, const char *key,
+					  struct smap_conninfo const *conninfo);
+	int (*smap_query_fd)(smap_query_t qp, int *events);
+	int (*smap_query_complete)(smap_query_t qp, int revents,
+				   smap_stream_t ostr);
+	void (*smap_query_cancel)(smap_query_t qp);
+	/* Batch queries (version 3, SMAP_CAPA_BATCH).
+
+	   Look up N keys in MAP and send exactly N reply lines to OSTR,
+	   one per key, in the order of KEYS.  Return 0 on success.  On
+	   error, return non-zero: the output is then discarded and the
+	   keys are looked up one by one using smap_query. */
+	int (*smap_query_batch)(smap_database_t dbp,
+				smap_stream_t ostr,
+				const char *map, const char **keys, size_t n,
+				struct smap_conninfo const *conninfo);
+	/* Connection check (version 3).
+
+	   Called before a persistent database left open by a previous
+	   session is reused.  Return 0 if the database is still usable.
+	   Otherwise, it is closed and opened again.  May be NULL. */
+	int (*smap_ping)(smap_database_t dbp);
+	/* Change notifications (version 3, SMAP_CAPA_NOTIFY).
+
+	   smap_notify_fd is called by the master process.  It returns
+	   the descriptor on which notifications about changed keys
+	   arrive, establishing the connection if necessary, or -1 if
+	   notifications are not configured or cannot be received.  When
+	   the descriptor becomes readable, smap_notify_read is called.
+	   It calls FUN for each changed key and returns 0, or non-zero
+	   if the connection has been lost. */
+	int (*smap_notify_fd)(smap_database_t dbp);
+	int (*smap_notify_read)(smap_database_t dbp,
+				void (*fun)(const char *key, void *data),
+				void *data);
+	/* Client address dependency (version 3).
+
+	   Return 0 if the replies of DBP and the results of its
+	   transformations never depend on the client addresses (the src
+	   and dst members of the conninfo), and 1 if they may.  smapd
+	   uses this to decide whether such results can be shared between
+	   clients.  If NULL, the dependency is assumed. */
+	int (*smap_uses_conninfo)(smap_database_t dbp);
+	/* Thread hooks (version 3, SMAP_CAPA_THREADSAFE).
+
+	   smap_thread_init is called by each thread smapd starts to
+	   query a database of the module, before the query, and
+	   smap_thread_end when the query is done, before the thread
+	   terminates.  Either may be NULL. */
+	void (*smap_thread_init)(void);
+	void (*smap_thread_end)(void);
 };
 
 #endif
@@ -52,6 +52,7 @@ typedef off_t smap_off_t;
 #define SMAP_IOCTL_SET_DEBUG_IDX   3
 #define SMAP_IOCTL_SET_DEBUG_PFX   4
 #define SMAP_IOCTL_SET_ARGS        5
+#define SMAP_IOCTL_GET_BUFFER      6
 
 void smap_stream_ref(smap_stream_t stream);
 void smap_stream_unref(smap_stream_t stream);
@@ -112,6 +113,8 @@ int smap_fileout_stream_create (smap_stream_t *pstream, FILE *file,
 int smap_syslog_stream_create (smap_stream_t *pstream, int prio,
 			       const char *pfx);
 
+int smap_memory_stream_create(smap_stream_t *pstream);
+
 int smap_sockmap_stream_create(smap_stream_t *pstream, int fd, int flags);
 int smap_sockmap_stream_create2(smap_stream_t *pstream, int fd[], int flags);
 
@@ -0,0 +1,40 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <sys/time.h>
+#include <smap/stream.h>
+#include <smap/module.h>
+
+/* Return the number of milliseconds left until the query deadline
+   from CONNINFO, 0 if it has expired, and -1 if there is no
+   deadline. */
+long
+smap_deadline_left(struct smap_conninfo const *conninfo)
+{
+	struct timeval now;
+	long left;
+
+	if (!conninfo || !conninfo->deadline)
+		return -1;
+	gettimeofday(&now, NULL);
+	left = (conninfo->deadline->tv_sec - now.tv_sec) * 1000
+		+ (conninfo->deadline->tv_usec - now.tv_usec) / 1000;
+	return left > 0 ? left : 0;
+}
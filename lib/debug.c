@@ -108,8 +108,10 @@ smap_debug_printf(const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
+	smap_diag_lock();
 	smap_stream_vprintf(smap_debug_str, fmt, ap);
 	smap_stream_write(smap_debug_str, "\n", 1, NULL);
+	smap_diag_unlock();
 	va_end(ap);
 }
 
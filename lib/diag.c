@@ -26,9 +26,36 @@ smap_stream_t smap_error_str;
 smap_stream_t smap_debug_str;
 smap_stream_t smap_trace_str;
 
+/* Functions serializing access to the diagnostic streams.  They are
+   set when diagnostics can be issued by several threads. */
+static void (*diag_lock)(void);
+static void (*diag_unlock)(void);
+
+void
+smap_diag_set_lock(void (*lock)(void), void (*unlock)(void))
+{
+	diag_lock = lock;
+	diag_unlock = unlock;
+}
+
+void
+smap_diag_lock()
+{
+	if (diag_lock)
+		diag_lock();
+}
+
+void
+smap_diag_unlock()
+{
+	if (diag_unlock)
+		diag_unlock();
+}
+
 void
 smap_verror(const char *fmt, va_list ap)
 {
+	smap_diag_lock();
 	if (smap_stream_vprintf(smap_error_str, fmt, ap) < 0) {
 		vfprintf(stderr, fmt, ap);
 		fputc('\n', stderr);
@@ -39,6 +66,7 @@ smap_verror(const char *fmt, va_list ap)
 	}
 	smap_stream_write(smap_error_str, "\n", 1, NULL);
 	smap_stream_flush(smap_error_str);
+	smap_diag_unlock();
 }
 
 void
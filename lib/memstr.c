@@ -0,0 +1,128 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "smap/diag.h"
+#include "smap/stream.h"
+#include "smap/streamdef.h"
+
+/* Memory output stream: accumulates everything written to it in
+   a contiguous buffer. */
+
+#define MEMORY_STREAM_INITIAL_SIZE 512
+
+struct memory_stream {
+	struct _smap_stream base;
+	char *buf;
+	size_t bufsize;
+	size_t level;
+};
+
+static int
+_memory_stream_write(struct _smap_stream *stream, const char *buf,
+		     size_t size, size_t *pret)
+{
+	struct memory_stream *str = (struct memory_stream *)stream;
+
+	if (str->level + size + 1 > str->bufsize) {
+		size_t n = str->bufsize ? str->bufsize
+			                : MEMORY_STREAM_INITIAL_SIZE;
+		char *p;
+
+		while (str->level + size + 1 > n)
+			n *= 2;
+		p = realloc(str->buf, n);
+		if (!p)
+			return ENOMEM;
+		str->buf = p;
+		str->bufsize = n;
+	}
+	memcpy(str->buf + str->level, buf, size);
+	str->level += size;
+	str->buf[str->level] = 0;
+	*pret = size;
+	return 0;
+}
+
+static int
+_memory_stream_size(struct _smap_stream *stream, smap_off_t *psize)
+{
+	struct memory_stream *str = (struct memory_stream *)stream;
+	*psize = str->level;
+	return 0;
+}
+
+static int
+_memory_stream_truncate(struct _smap_stream *stream, smap_off_t size)
+{
+	struct memory_stream *str = (struct memory_stream *)stream;
+	if (size > str->level)
+		return EINVAL;
+	str->level = size;
+	if (str->buf)
+		str->buf[size] = 0;
+	return 0;
+}
+
+static int
+_memory_stream_ioctl(struct _smap_stream *stream, int code, void *ptr)
+{
+	struct memory_stream *str = (struct memory_stream *)stream;
+
+	switch (code) {
+	case SMAP_IOCTL_GET_BUFFER:
+		if (!ptr)
+			return EINVAL;
+		*(const char **)ptr = str->buf ? str->buf : "";
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+static void
+_memory_stream_destroy(struct _smap_stream *stream)
+{
+	struct memory_stream *str = (struct memory_stream *)stream;
+	free(str->buf);
+}
+
+int
+smap_memory_stream_create(smap_stream_t *pstream)
+{
+	struct memory_stream *str =
+		(struct memory_stream *)
+		  _smap_stream_create(sizeof(*str), SMAP_STREAM_WRITE);
+	if (!str)
+		return ENOMEM;
+	str->buf = NULL;
+	str->bufsize = 0;
+	str->level = 0;
+	str->base.write = _memory_stream_write;
+	str->base.size = _memory_stream_size;
+	str->base.truncate = _memory_stream_truncate;
+	str->base.ctl = _memory_stream_ioctl;
+	str->base.done = _memory_stream_destroy;
+	*pstream = (smap_stream_t) str;
+	return 0;
+}
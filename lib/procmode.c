@@ -0,0 +1,41 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <smap/stream.h>
+#include <smap/module.h>
+
+static int single_process;
+
+/* Record whether the process that opens the databases serves all the
+   sessions itself.  Called by smapd before initializing modules. */
+void
+smap_set_single_process(int val)
+{
+	single_process = val;
+}
+
+/* Return 1 if databases are opened and queried by a single process
+   for the whole lifetime of smapd, and 0 if sessions are served by
+   subprocesses. */
+int
+smap_single_process(void)
+{
+	return single_process;
+}
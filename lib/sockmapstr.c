@@ -20,6 +20,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <limits.h>
 #include <string.h>
 #include <errno.h>
@@ -217,7 +218,11 @@ read_payload_length(struct sockmap_input_stream *sp)
 		ssize_t n;
 		char *p;
 
-		n = recv(sp->fd, sp->nbuf + len, SIZE_T_STRLEN_BOUND - len, 0);
+		/* Peek at the input first, so as not to consume any
+		   data past the colon: the client may have sent
+		   several requests at once. */
+		n = recv(sp->fd, sp->nbuf + len, SIZE_T_STRLEN_BOUND - len,
+			 MSG_PEEK);
 		if (n < 0) {
 			smap_debug(sp->debug_idx, 1,
 				   ("error reading from fd #%d: %s", sp->fd,
@@ -226,8 +231,14 @@ read_payload_length(struct sockmap_input_stream *sp)
 		}
 		if (n == 0)
 			return EOF;
+		p = memchr(sp->nbuf + len, ':', n);
+		if (p)
+			n = p - (sp->nbuf + len) + 1;
+		n = recv(sp->fd, sp->nbuf + len, n, 0);
+		if (n < 0)
+			return errno;
 		len += n;
-		if (p = memchr(sp->nbuf, ':', len)) {
+		if (p) {
 			sp->cp = p - sp->nbuf;
 			sp->nbuf[len] = 0;
 			sp->nlen = len;
@@ -335,6 +346,33 @@ _sockmap_input_stream_read(struct _smap_stream *stream, char *buf,
 	return 0;
 }
 
+static int
+_sockmap_input_stream_wait(struct _smap_stream *stream, int *pflags,
+			   struct timeval *tvp)
+{
+	struct sockmap_input_stream *sp =
+		(struct sockmap_input_stream *) stream;
+	fd_set rdset;
+	int rc;
+
+	if (!(*pflags & SMAP_STREAM_READY_RD)) {
+		*pflags = 0;
+		return 0;
+	}
+	/* A partially read request counts as available input */
+	if (sp->nlen) {
+		*pflags = SMAP_STREAM_READY_RD;
+		return 0;
+	}
+	FD_ZERO(&rdset);
+	FD_SET(sp->fd, &rdset);
+	rc = select(sp->fd + 1, &rdset, NULL, NULL, tvp);
+	if (rc < 0)
+		return errno;
+	*pflags = rc ? SMAP_STREAM_READY_RD : 0;
+	return 0;
+}
+
 static int
 _sockmap_input_stream_close(struct _smap_stream *stream)
 {
@@ -396,6 +434,7 @@ smap_sockmap_input_stream_create(smap_stream_t *pstream, int fd, int flags)
 	/* FIXME: Implement readdelim */
 	str->base.close = _sockmap_input_stream_close;
 	str->base.ctl = _sockmap_input_stream_ioctl;
+	str->base.wait = _sockmap_input_stream_wait;
 	str->base.done = _sockmap_input_stream_destroy;
 	*pstream = (smap_stream_t) str;
 	return 0;
@@ -424,6 +463,21 @@ _sockmap_stream_read(struct _smap_stream *stream, char *buf,
 	return smap_stream_read(sp->in, buf, size, pret);
 }
 
+static int
+_sockmap_stream_wait(struct _smap_stream *stream, int *pflags,
+		     struct timeval *tvp)
+{
+	struct sockmap_stream *sp = (struct sockmap_stream *) stream;
+	int flags = *pflags & SMAP_STREAM_READY_RD;
+	int rc;
+
+	/* Only input readiness is supported */
+	rc = smap_stream_wait(sp->in, &flags, tvp);
+	if (rc == 0)
+		*pflags = flags;
+	return rc;
+}
+
 static int
 _sockmap_stream_close(struct _smap_stream *stream)
 {
@@ -511,6 +565,7 @@ smap_sockmap_stream_create2(smap_stream_t *pstream, int fd[], int flags)
 	str->base.write = _sockmap_stream_write;
 	str->base.close = _sockmap_stream_close;
 	str->base.ctl = _sockmap_stream_ioctl;
+	str->base.wait = _sockmap_stream_wait;
 	str->base.done = _sockmap_stream_done;
 	str->fd = fd[0] == fd[1] ? fd[0] : -1;
 
@@ -67,14 +67,43 @@ echo_query(smap_database_t dbp,
 	return 0;
 }
 
+static int
+echo_query_batch(smap_database_t dbp,
+		 smap_stream_t ostr,
+		 const char *map, const char **keys, size_t n,
+		 struct smap_conninfo const *conninfo)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		echo_query(dbp, ostr, map, keys[i], conninfo);
+	return 0;
+}
+
+static int
+echo_uses_conninfo(smap_database_t dbp)
+{
+	return 0;
+}
+
 struct smap_module SMAP_EXPORT(echo, module) = {
 	SMAP_MODULE_VERSION,
-	SMAP_CAPA_DEFAULT,
+	SMAP_CAPA_DEFAULT|SMAP_CAPA_THREADSAFE|SMAP_CAPA_BATCH|
+	SMAP_CAPA_FORKSAFE,
 	NULL, /* smap_init */
 	echo_init_db,
 	echo_free_db,
 	NULL, /* smap_open */
 	NULL, /* smap_close */
 	echo_query,
-	NULL  /* smap_xform */
+	NULL, /* smap_xform */
+	NULL, /* smap_query_submit */
+	NULL, /* smap_query_fd */
+	NULL, /* smap_query_complete */
+	NULL, /* smap_query_cancel */
+	echo_query_batch,
+	NULL, /* smap_ping */
+	NULL, /* smap_notify_fd */
+	NULL, /* smap_notify_read */
+	echo_uses_conninfo
 };
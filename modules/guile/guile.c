@@ -20,6 +20,9 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 
 #include <smap/stream.h>
 #include <smap/diag.h>
@@ -33,6 +36,63 @@
 typedef off_t scm_t_off;
 #endif
 
+/* Query deadline support.  When the query has a deadline, SIGALRM is
+   delivered when it expires.  The Scheme handler of that signal
+   throws the smap-deadline exception, which aborts the running
+   procedure. */
+static int deadline_armed;      /* SIGALRM handler is installed */
+static int deadline_expired;    /* The deadline has expired */
+static SCM deadline_handler_proc;
+
+static SCM
+deadline_handler(SCM sig)
+{
+	if (deadline_armed) {
+		deadline_expired = 1;
+		scm_throw(scm_from_locale_symbol("smap-deadline"), SCM_EOL);
+	}
+	return SCM_UNSPECIFIED;
+}
+
+/* Arm the deadline timer for the query with CONNINFO.  Return 1 and
+   set deadline_expired if the deadline has already expired. */
+static int
+deadline_start(struct smap_conninfo const *conninfo)
+{
+	long left = smap_deadline_left(conninfo);
+	struct itimerval itv;
+
+	deadline_expired = 0;
+	if (left < 0)
+		return 0;
+	if (left == 0) {
+		deadline_expired = 1;
+		return 1;
+	}
+	scm_sigaction(scm_from_int(SIGALRM), deadline_handler_proc,
+		      SCM_UNDEFINED);
+	memset(&itv, 0, sizeof(itv));
+	itv.it_value.tv_sec = left / 1000;
+	itv.it_value.tv_usec = (left % 1000) * 1000;
+	deadline_armed = 1;
+	setitimer(ITIMER_REAL, &itv, NULL);
+	return 0;
+}
+
+static void
+deadline_stop()
+{
+	struct itimerval itv;
+
+	if (!deadline_armed)
+		return;
+	deadline_armed = 0;
+	memset(&itv, 0, sizeof(itv));
+	setitimer(ITIMER_REAL, &itv, NULL);
+	/* Restore the original handler */
+	scm_sigaction(scm_from_int(SIGALRM), SCM_BOOL_F, SCM_UNDEFINED);
+}
+
 static SCM
 eval_catch_body(void *list)
 {
@@ -40,10 +100,33 @@ eval_catch_body(void *list)
 	return scm_apply_0(SCM_CAR(pair), SCM_CDR(pair));
 }
 
+struct call_closure {
+	SCM proc;
+	SCM *argv;
+	size_t argc;
+};
+
+static SCM
+call_catch_body(void *data)
+{
+	struct call_closure *cp = data;
+#if SCM_MAJOR_VERSION >= 2
+	return scm_call_n(cp->proc, cp->argv, cp->argc);
+#else
+	SCM list = SCM_EOL;
+	size_t i;
+
+	for (i = cp->argc; i > 0; i--)
+		list = scm_cons(cp->argv[i-1], list);
+	return scm_apply_0(cp->proc, list);
+#endif
+}
+
 static SCM
 eval_catch_handler(void *data, SCM tag, SCM throw_args)
 {
-	scm_handle_by_message_noexit("idest", tag, throw_args);
+	if (!deadline_expired)
+		scm_handle_by_message_noexit("idest", tag, throw_args);
 	longjmp(*(jmp_buf*)data, 1);
 }
 
@@ -94,24 +177,48 @@ str_rettype_error(const char *name)
 }
 
 
+/* Call PROC by running BODY with DATA, catching any exceptions.
+   Store the returned value in *RESULT. */
 static int
-guile_call_proc(SCM *result, SCM proc, SCM arglist)
+guile_call(SCM *result, SCM proc, scm_t_catch_body body, void *data)
 {
 	jmp_buf jmp_env;
 
 	if (setjmp(jmp_env)) {
-		char *name = proc_name(proc);
-		smap_error("procedure `%s' failed", name);
-		free(name);
+		if (!deadline_expired) {
+			char *name = proc_name(proc);
+			smap_error("procedure `%s' failed", name);
+			free(name);
+		}
 		return 1;
 	}
 
 	*result = scm_c_catch(SCM_BOOL_T,
-			      eval_catch_body, scm_cons(proc, arglist),
+			      body, data,
 			      eval_catch_handler, &jmp_env,
 			      NULL, NULL);
 	return 0;
 }
+
+static int
+guile_call_proc(SCM *result, SCM proc, SCM arglist)
+{
+	return guile_call(result, proc, eval_catch_body,
+			  (void*) scm_cons(proc, arglist));
+}
+
+/* Call PROC with the ARGC arguments in ARGV.  Unlike guile_call_proc,
+   this allocates no argument list. */
+static int
+guile_call_argv(SCM *result, SCM proc, SCM *argv, size_t argc)
+{
+	struct call_closure cl;
+
+	cl.proc = proc;
+	cl.argv = argv;
+	cl.argc = argc;
+	return guile_call(result, proc, call_catch_body, &cl);
+}
 
 struct load_closure {
 	char *filename;
@@ -318,6 +425,8 @@ set_load_path(const char *val)
 
 
 static int guile_debug;
+static int guile_auto_compile;
+static char *guile_compile_cache;
 static char *guile_init_script;
 static char *guile_init_args;
 static char *guile_init_fun = "init";
@@ -349,7 +458,7 @@ struct _guile_database {
 	const char *dbname;
 	int argc;
 	char **argv;
-	int oport_inited;
+	smap_stream_t oport_str;
 	SCM handle;
 };
 
@@ -432,6 +541,9 @@ static struct smap_option init_option[] = {
 	{ SMAP_OPTSTR(init-args), smap_opt_string, &guile_init_args },
 	{ SMAP_OPTSTR(load-path), smap_opt_string, &guile_load_path },
 	{ SMAP_OPTSTR(init-fun), smap_opt_string, &guile_init_fun },
+	{ SMAP_OPTSTR(auto-compile), smap_opt_bool, &guile_auto_compile },
+	{ SMAP_OPTSTR(compile-cache), smap_opt_string,
+	  &guile_compile_cache },
 	{ NULL }
 };
 
@@ -457,6 +569,10 @@ guile_init(int argc, char **argv)
 	}
 
 	_init_smap_output_port();
+	deadline_handler_proc =
+		scm_c_make_gsubr("smap-deadline-handler", 1, 0, 0,
+				 (scm_t_subr) deadline_handler);
+	scm_gc_protect_object(deadline_handler_proc);
 
 	port = _make_smap_output_port(smap_error_str);
 	if (port == SCM_BOOL_F) {
@@ -473,6 +589,23 @@ guile_init(int argc, char **argv)
 	if (guile_load_path)
 		set_load_path(guile_load_path);
 
+	/* Embedded Guile does not compile the files it loads, unless
+	   told to do so.  The compiled files are kept in the cache
+	   directory and reused as long as they are up to date. */
+	if (guile_auto_compile) {
+#if SCM_MAJOR_VERSION >= 2
+		SCM_VARIABLE_SET(scm_c_lookup("%load-should-auto-compile"),
+				 SCM_BOOL_T);
+		if (guile_compile_cache)
+			SCM_VARIABLE_SET(
+				scm_c_lookup("%compile-fallback-path"),
+				scm_from_locale_string(guile_compile_cache));
+#else
+		smap_error("guile: auto-compile requires Guile 2.0 "
+			   "or later");
+#endif
+	}
+
 	if (guile_init_script) {
 		if (guile_load_file(guile_init_script, guile_init_args)) {
 			smap_error("guile: cannot load init script %s",
@@ -522,7 +655,7 @@ guile_init_db(const char *dbname, int argc, char **argv)
 	db->dbname = dbname;
 	db->argc = argc;
 	db->argv = argv;
-	db->oport_inited = 0;
+	db->oport_str = NULL;
 	db->handle = SCM_UNSPECIFIED;
 	memcpy(db->vtab, global_vtab, sizeof(db->vtab));
 	if (init_fun && init_vtab(init_fun, dbname, db->vtab)) {
@@ -584,11 +717,57 @@ guile_close(smap_database_t hp)
 }
 
 
-static SCM
-scm_from_smap_conninfo(struct smap_conninfo const *conninfo)
+/* Source and destination addresses of the current session and their
+   Scheme representations.  All queries of a session share the same
+   addresses, so they are converted once. */
+static struct {
+	int valid;
+	struct sockaddr_storage src;
+	int srclen;
+	struct sockaddr_storage dst;
+	int dstlen;
+	SCM scm_src;
+	SCM scm_dst;
+} conninfo_cache;
+
+static int
+sockaddr_cached(struct sockaddr_storage *ss, int sslen,
+		struct sockaddr const *sa, int salen)
 {
-	return scm_list_2(scm_from_sockaddr(conninfo->src, conninfo->srclen),
-			  scm_from_sockaddr(conninfo->dst, conninfo->dstlen));
+	return sslen == salen && memcmp(ss, sa, salen) == 0;
+}
+
+/* Store in ARGV[0] and ARGV[1] the source and destination addresses
+   from CONNINFO */
+static void
+scm_from_smap_conninfo(struct smap_conninfo const *conninfo, SCM *argv)
+{
+	if (!(conninfo_cache.valid
+	      && sockaddr_cached(&conninfo_cache.src, conninfo_cache.srclen,
+				 conninfo->src, conninfo->srclen)
+	      && sockaddr_cached(&conninfo_cache.dst, conninfo_cache.dstlen,
+				 conninfo->dst, conninfo->dstlen))) {
+		if (conninfo_cache.valid) {
+			scm_gc_unprotect_object(conninfo_cache.scm_src);
+			scm_gc_unprotect_object(conninfo_cache.scm_dst);
+			conninfo_cache.valid = 0;
+		}
+		argv[0] = scm_from_sockaddr(conninfo->src, conninfo->srclen);
+		argv[1] = scm_from_sockaddr(conninfo->dst, conninfo->dstlen);
+		if ((size_t) conninfo->srclen > sizeof(conninfo_cache.src)
+		    || (size_t) conninfo->dstlen > sizeof(conninfo_cache.dst))
+			return;
+		memcpy(&conninfo_cache.src, conninfo->src, conninfo->srclen);
+		conninfo_cache.srclen = conninfo->srclen;
+		memcpy(&conninfo_cache.dst, conninfo->dst, conninfo->dstlen);
+		conninfo_cache.dstlen = conninfo->dstlen;
+		conninfo_cache.scm_src = scm_gc_protect_object(argv[0]);
+		conninfo_cache.scm_dst = scm_gc_protect_object(argv[1]);
+		conninfo_cache.valid = 1;
+		return;
+	}
+	argv[0] = conninfo_cache.scm_src;
+	argv[1] = conninfo_cache.scm_dst;
 }
 
 static int
@@ -598,22 +777,33 @@ guile_query(smap_database_t dbp,
 	    struct smap_conninfo const *conninfo)
 {
 	struct _guile_database *db = (struct _guile_database *)dbp;
-	SCM res, arg;
+	SCM res, argv[5];
+	int rc = 1;
 
-	if (!db->oport_inited) {
+	/* The output stream may change between queries (e.g. when the
+	   reply is captured for coalescing), so the port follows it. */
+	if (db->oport_str != ostr) {
 		SCM port = _make_smap_output_port(ostr);
 		if (port == SCM_BOOL_F) {
 			smap_error("guile: cannot initialize output port");
 			return 1;
 		}
 		scm_set_current_output_port(port);
-		db->oport_inited = 1;
+		db->oport_str = ostr;
+	}
+	argv[0] = db->handle;
+	argv[1] = scm_from_locale_string(map);
+	argv[2] = scm_from_locale_string(key);
+	scm_from_smap_conninfo(conninfo, argv + 3);
+	if (deadline_start(conninfo) == 0) {
+		rc = guile_call_argv(&res, db->vtab[query_proc], argv, 5);
+		deadline_stop();
+	}
+	if (deadline_expired) {
+		smap_stream_printf(ostr, "TEMP query deadline expired\n");
+		return 0;
 	}
-	arg = scm_append(scm_list_2(scm_list_3(db->handle,
-					       scm_from_locale_string(map),
-					       scm_from_locale_string(key)),
-				    scm_from_smap_conninfo(conninfo)));
-	if (guile_call_proc(&res, db->vtab[query_proc], arg))
+	if (rc)
 		return 1;
 	return res == SCM_BOOL_F;
 }
@@ -625,15 +815,15 @@ guile_xform(smap_database_t dbp,
 	    char **output)
 {
 	struct _guile_database *db = (struct _guile_database *)dbp;
-	SCM res, arg;
+	SCM res, argv[4];
 	
 	if (!db->vtab[xform_proc])
 		return 1;
 	
-	arg = scm_append(scm_list_2(scm_list_2(db->handle,
-					       scm_from_locale_string(input)),
-				    scm_from_smap_conninfo(conninfo)));
-	if (guile_call_proc(&res, db->vtab[xform_proc], arg))
+	argv[0] = db->handle;
+	argv[1] = scm_from_locale_string(input);
+	scm_from_smap_conninfo(conninfo, argv + 2);
+	if (guile_call_argv(&res, db->vtab[xform_proc], argv, 4))
 		return 1;
 	if (!scm_is_string(res))
 		return 1;
@@ -23,12 +23,21 @@
 #include <unistd.h>
 #include <ldap.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <smap/stream.h>
 #include <smap/diag.h>
 #include <smap/module.h>
 #include <smap/parseopt.h>
 #include <smap/wordsplit.h>
 
+/* Content synchronization (RFC 4533) is used to maintain replicas.
+   Without it, they are periodically reloaded. */
+#ifdef LDAP_SYNC_REFRESH_AND_PERSIST
+# define MOD_LDAP_SYNC 1
+#endif
+
 static int dbgid;
 static int ldap_debug_level; //FIXME
 
@@ -45,6 +54,12 @@ enum tls_state {
 		    bindpw=PASS
 		    bindpwfile=FILE
                     filter=FILTER
+		    key-attribute=ATTR
+		    size-limit=N
+		    timeout=SECONDS
+		    replica=BOOL
+		    replica-filter=FILTER
+		    replica-refresh=SECONDS
 		    positive-reply=EXPR
 		    negative-reply=EXPR
 		    onerror-reply=EXPR
@@ -59,6 +74,12 @@ struct ldap_conf {
 	char *cacert;
 	char *filter;
 	char **attrs;
+	char *keyattr;
+	long size_limit;
+	long timeout;
+	int replica;
+	char *replica_filter;
+	long replica_refresh;
 	
 	char *binddn;
 	char *bindpw;
@@ -71,9 +92,45 @@ struct ldap_conf {
 	char *joinstr;
 };
 
+/* Reply templates are compiled into arrays of segments */
+enum reply_segm_type {
+	segm_literal,   /* Literal text */
+	segm_map,       /* Map name */
+	segm_key,       /* Lookup key */
+	segm_dn,        /* DN of the entry */
+	segm_attr       /* Attribute value */
+};
+
+struct reply_segm {
+	enum reply_segm_type type;
+	union {
+		struct {
+			const char *ptr;
+			size_t size;
+		} literal;        /* type == segm_literal */
+		size_t attr;      /* type == segm_attr: index in attrv */
+	} v;
+};
+
+struct reply_template {
+	struct reply_segm *segv;
+	size_t segc;
+	char **attrv;             /* Names of the referred attributes */
+	size_t attrc;
+};
+
+struct ldap_conn;
+struct ldap_replica;
+
 struct ldap_db {
 	struct ldap_conf conf;
-	LDAP *ldap;
+	struct reply_template positive_reply;
+	struct reply_template negative_reply;
+	struct reply_template onerror_reply;
+	struct ldap_conn *conn;   /* Connection used by this database */
+	LDAP *ldap;               /* Session handle in use */
+	unsigned gen;             /* Connection generation it belongs to */
+	struct ldap_replica *replica; /* Local replica or NULL */
 };
 
 static struct ldap_conf dfl_conf;
@@ -81,6 +138,15 @@ static char dfl_config_file[] = "/etc/ldap.conf";
 static char dfl_positive_reply[] = "OK";
 static char dfl_negative_reply[] = "NOTFOUND";
 static char dfl_onerror_reply[] = "NOTFOUND";
+static char dfl_deadline_reply[] = "TEMP query deadline expired";
+static struct reply_segm deadline_segm = {
+	segm_literal,
+	{ { dfl_deadline_reply, sizeof(dfl_deadline_reply) - 1 } }
+};
+static struct reply_template deadline_reply = { &deadline_segm, 1 };
+
+static void replica_start(struct ldap_db *db);
+static void replica_stop(struct ldap_db *db);
 
 static void
 argz_free(char **a)
@@ -94,6 +160,28 @@ argz_free(char **a)
 	free(a);
 }
 
+/* Add S to the array *PA, unless it is already there */
+static int
+argz_add(char ***pa, const char *s)
+{
+	char **a = *pa;
+	size_t n = 0;
+
+	if (a)
+		for (; a[n]; n++)
+			if (strcasecmp(a[n], s) == 0)
+				return 0;
+	a = realloc(a, (n + 2) * sizeof(a[0]));
+	if (!a)
+		return 1;
+	*pa = a;
+	a[n] = strdup(s);
+	if (!a[n])
+		return 1;
+	a[n + 1] = NULL;
+	return 0;
+}
+
 static int
 argz_copy(char ***dst, char **a)
 {
@@ -129,6 +217,8 @@ ldap_conf_free(struct ldap_conf *cp)
 	free(cp->cacert);
 	free(cp->filter); 
 	argz_free(cp->attrs);
+	free(cp->keyattr);
+	free(cp->replica_filter);
 	
 	free(cp->binddn);
 	free(cp->bindpw);
@@ -168,6 +258,12 @@ ldap_conf_cpy(struct ldap_conf *dst, struct ldap_conf *src)
 		ldap_conf_free(dst);
 		return NULL;
 	}
+	STRCPY(keyattr);
+	dst->size_limit = src->size_limit;
+	dst->timeout = src->timeout;
+	dst->replica = src->replica;
+	STRCPY(replica_filter);
+	dst->replica_refresh = src->replica_refresh;
 		
 	STRCPY(binddn);
 	STRCPY(bindpw);
@@ -200,7 +296,7 @@ parse_ldap_conf(const char *name, struct smap_option const *opt)
 	}
 
 	line = 0;
-	while (p = fgets(buf, sizeof(buf), fp)) {
+	while ((p = fgets(buf, sizeof(buf), fp))) {
 		size_t len;
 		char *errmsg;
 		
@@ -285,6 +381,18 @@ make_options(struct ldap_conf *conf, int flags,
 		
 		{ SMAP_OPTSTR(filter), smap_opt_string,
 		  (void*)offsetof(struct ldap_conf, filter) },
+		{ SMAP_OPTSTR(key-attribute), smap_opt_string,
+		  (void*)offsetof(struct ldap_conf, keyattr) },
+		{ SMAP_OPTSTR(size-limit), smap_opt_long,
+		  (void*)offsetof(struct ldap_conf, size_limit) },
+		{ SMAP_OPTSTR(timeout), smap_opt_long,
+		  (void*)offsetof(struct ldap_conf, timeout) },
+		{ SMAP_OPTSTR(replica), smap_opt_bool,
+		  (void*)offsetof(struct ldap_conf, replica) },
+		{ SMAP_OPTSTR(replica-filter), smap_opt_string,
+		  (void*)offsetof(struct ldap_conf, replica_filter) },
+		{ SMAP_OPTSTR(replica-refresh), smap_opt_long,
+		  (void*)offsetof(struct ldap_conf, replica_refresh) },
 		
 		{ SMAP_OPTSTR(binddn), smap_opt_string,
 		  (void*)offsetof(struct ldap_conf, binddn) },
@@ -340,6 +448,8 @@ mod_ldap_init(int argc, char **argv)
 	int rc;
 	
 	dbgid = smap_debug_alloc("ldap");
+	dfl_conf.size_limit = 1;
+	dfl_conf.replica_refresh = 3600;
 
 	if (make_options(&dfl_conf, MKOPT_DEFAULT, &opt)) {
 		smap_error("not enough memory");
@@ -348,6 +458,10 @@ mod_ldap_init(int argc, char **argv)
 
 	rc = smap_parseopt(opt, argc, argv, 0, NULL);
 	free(opt);
+	if (rc == 0 && dfl_conf.cacert
+	    && ldap_set_option(NULL, LDAP_OPT_X_TLS_CACERTFILE,
+			       dfl_conf.cacert) != LDAP_OPT_SUCCESS)
+		smap_error("setting of LDAP_OPT_X_TLS_CACERTFILE failed");
 	return rc;
 }
 
@@ -496,14 +610,72 @@ parse_ldap_uri(const char *uri)
 	return ldapuri;
 }
 
+/* Session handle replaced after its server went down */
+struct ldap_retired {
+	LDAP *ld;
+	unsigned refcnt;          /* Number of references to it */
+};
+
+/* Connections to LDAP servers.  Databases having the same connection
+   settings share a single connection, which is bound once, when it is
+   established.  If the server goes down, the connection is established
+   anew, using the next server URL from the list.  The initial URL is
+   chosen by the process ID, so that subprocesses spread their
+   connections over all the servers. */
+
+struct ldap_conn {
+	struct ldap_conn *next;
+	unsigned refcnt;          /* Number of databases using it */
+	pthread_mutex_t mutex;
+	/* Connection settings */
+	enum tls_state tls;
+	long protocol;
+	long timeout;
+	char *uri;
+	char *cacert;
+	char *binddn;
+	char *bindpw;
+	/* Server URLs */
+	struct wordsplit urlws;
+	size_t cur;               /* Index of the URL in use */
+	LDAP *ld;                 /* Session handle or NULL if disconnected */
+	unsigned ldref;           /* Number of references to LD */
+	unsigned gen;             /* Incremented each time LD changes */
+	/* Handles replaced after their servers went down.  They may still
+	   be in use by databases and pending asynchronous queries, so each
+	   one is unbound when the last reference to it is dropped. */
+	struct ldap_retired *oldv;
+	size_t oldc;
+};
+
+static struct ldap_conn *conn_head;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+strsame(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static size_t
+conn_urlc(struct ldap_conn *conn)
+{
+	return conn->uri ? conn->urlws.ws_wordc : 1;
+}
+
+static char *
+conn_url(struct ldap_conn *conn, size_t i)
+{
+	return conn->uri ? conn->urlws.ws_wordv[i] : NULL;
+}
+
 static LDAP *
-ldap_connect(struct ldap_conf *conf)
+ldap_connect(struct ldap_conn *conn, const char *ldapuri, long timeout)
 {
 	int rc;
-	char *ldapuri = NULL;
 	LDAP *ld = NULL;
-	char *val;
-	unsigned long lval;
 
 	if (ldap_debug_level) {
 		if (ber_set_option(NULL, LBER_OPT_DEBUG_LEVEL,
@@ -519,13 +691,7 @@ ldap_connect(struct ldap_conf *conf)
 				   ldap_debug_level);
 	}
 
-	if (conf->uri) {
-		ldapuri = parse_ldap_uri(conf->uri);
-		if (!ldapuri)
-			return NULL;
-	}
-
-	smap_debug(dbgid, 1, ("constructed LDAP URI: %s",
+	smap_debug(dbgid, 1, ("connecting to %s",
 			      ldapuri ? ldapuri : "<DEFAULT>"));
 
 	rc = ldap_initialize(&ld, ldapuri);
@@ -533,17 +699,44 @@ ldap_connect(struct ldap_conf *conf)
 		smap_error("cannot create LDAP session handle for "
 			   "URI=%s (%d): %s",
 			   ldapuri, rc, ldap_err2string(rc));
-		free(ldapuri);
 		return NULL;
 	}
-	free(ldapuri);
 
-	if (conf->protocol) {
-		int pn = (int) conf->protocol;
+	if (conn->protocol) {
+		int pn = (int) conn->protocol;
 		ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &pn);
 	}
-	
-	if (conf->tls != tls_no) {
+
+	if (timeout) {
+		struct timeval tv;
+
+		tv.tv_sec = timeout;
+		tv.tv_usec = 0;
+		ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+		/* Bounds the synchronous operations, e.g. StartTLS */
+		ldap_set_option(ld, LDAP_OPT_TIMEOUT, &tv);
+	}
+
+	/* The CA certificate must be set before the TLS handshake.  The
+	   module-wide one is installed in the global TLS context, shared
+	   by all session handles.  A database-specific certificate
+	   requires a separate context. */
+	if (conn->cacert && !strsame(conn->cacert, dfl_conf.cacert)) {
+		int newctx = 0;
+
+		if (ldap_set_option(ld, LDAP_OPT_X_TLS_CACERTFILE,
+				    conn->cacert) != LDAP_OPT_SUCCESS
+		    || ldap_set_option(ld, LDAP_OPT_X_TLS_NEWCTX, &newctx)
+		    != LDAP_OPT_SUCCESS) {
+			smap_error("setting of LDAP_OPT_X_TLS_CACERTFILE failed");
+			if (conn->tls == tls_only) {
+				ldap_unbind_ext(ld, NULL, NULL);
+				return NULL;
+			}
+		}
+	}
+
+	if (conn->tls != tls_no) {
 		rc = ldap_start_tls_s(ld, NULL, NULL);
 		if (rc != LDAP_SUCCESS) {
 			char *msg = NULL;
@@ -555,22 +748,11 @@ ldap_connect(struct ldap_conf *conf)
 			smap_error("TLS diagnostics: %s", msg);
 			ldap_memfree(msg);
 			
-			if (conf->tls == tls_only) {
+			if (conn->tls == tls_only) {
 				ldap_unbind_ext(ld, NULL, NULL);
 				return NULL;
 			}
 			/* try to continue anyway */
-		} else if (conf->cacert) {
-			rc = ldap_set_option(ld,
-					     LDAP_OPT_X_TLS_CACERTFILE,
-					     conf->cacert);
-			if (rc != LDAP_SUCCESS) {
-				smap_error("setting of LDAP_OPT_X_TLS_CACERTFILE failed");
-				if (conf->tls == tls_only) {
-					ldap_unbind_ext(ld, NULL, NULL);
-					return NULL;
-				}
-			}
 		}
 	}
 	
@@ -602,53 +784,56 @@ full_read(int fd, char *file, char *buf, size_t size)
 	return 0;
 }
 
+/* Read the bind password from the bindpwfile, if it is set, and store
+   it in CONF->bindpw.  This is done once, when the database is
+   initialized, so that reconnections do not need to access the
+   file. */
 static int
-get_passwd(struct ldap_conf *conf, struct berval *pwd, char **palloc)
+get_passwd(struct ldap_conf *conf)
 {
-	char *file;
+	char *file = conf->bindpwfile;
+	struct stat st;
+	int fd, rc;
+	char *mem, *p;
 
-	if (conf->bindpwfile) {
-		struct stat st;
-		int fd, rc;
-		char *mem, *p;
-		
-		fd = open(file, O_RDONLY);
-		if (fd == -1) {
-			smap_error("can't open password file %s: %s",
-				   file, strerror(errno));
-			return -1;
-		}
-		if (fstat(fd, &st)) {
-			smap_error("can't stat password file %s: %s",
-				   file, strerror(errno));
-			close(fd);
-			return -1;
-		}
-		mem = malloc(st.st_size + 1);
-		if (!mem) {
-			smap_error("can't allocate memory (%lu bytes)",
-				   (unsigned long) st.st_size+1);
-			close(fd);
-			return -1;
-		}
-		rc = full_read(fd, file, mem, st.st_size);
+	if (!file)
+		return 0;
+	fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		smap_error("can't open password file %s: %s",
+			   file, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		smap_error("can't stat password file %s: %s",
+			   file, strerror(errno));
 		close(fd);
-		if (rc)
-			return rc;
-		mem[st.st_size] = 0;
-		p = strchr(mem, '\n');
-		if (p)
-			*p = 0;
-		*palloc = mem;
-		pwd->bv_val = mem;
-	} else
-		pwd->bv_val = conf->bindpw;
-	pwd->bv_len = pwd->bv_val ? strlen(pwd->bv_val) : 0;
+		return -1;
+	}
+	mem = malloc(st.st_size + 1);
+	if (!mem) {
+		smap_error("can't allocate memory (%lu bytes)",
+			   (unsigned long) st.st_size+1);
+		close(fd);
+		return -1;
+	}
+	rc = full_read(fd, file, mem, st.st_size);
+	close(fd);
+	if (rc) {
+		free(mem);
+		return rc;
+	}
+	mem[st.st_size] = 0;
+	p = strchr(mem, '\n');
+	if (p)
+		*p = 0;
+	free(conf->bindpw);
+	conf->bindpw = mem;
 	return 0;
 }
 
 static int
-ldap_bind(LDAP *ld, struct ldap_conf *conf)
+ldap_bind(LDAP *ld, struct ldap_conn *conn, long timeout)
 {
 	int msgid, err, rc;
 	LDAPMessage *result;
@@ -658,25 +843,33 @@ ldap_bind(LDAP *ld, struct ldap_conf *conf)
 	char *info = NULL;
 	char **refs = NULL;
 	struct berval passwd;
-	char *alloc_ptr = NULL;
+	struct timeval tv, *tvp = NULL;
 	
-	if (get_passwd(conf, &passwd, &alloc_ptr))
-		return 1;
+	passwd.bv_val = conn->bindpw;
+	passwd.bv_len = passwd.bv_val ? strlen(passwd.bv_val) : 0;
 
 	msgbuf[0] = 0;
 	
-	rc = ldap_sasl_bind(ld, conf->binddn, LDAP_SASL_SIMPLE, &passwd,
+	rc = ldap_sasl_bind(ld, conn->binddn, LDAP_SASL_SIMPLE, &passwd,
 			    NULL, NULL, &msgid);
 	if (msgid == -1) {
 		smap_error("ldap_sasl_bind(SIMPLE) failed: %s",
 			   ldap_err2string(rc));
-		free(alloc_ptr);
 		return 1;
 	}
 
-	if (ldap_result(ld, msgid, LDAP_MSG_ALL, NULL, &result ) == -1) {
+	if (timeout) {
+		tv.tv_sec = timeout;
+		tv.tv_usec = 0;
+		tvp = &tv;
+	}
+	switch (ldap_result(ld, msgid, LDAP_MSG_ALL, tvp, &result)) {
+	case -1:
 		smap_error("ldap_result failed");
-		free(alloc_ptr);
+		return 1;
+	case 0:
+		smap_error("LDAP bind timed out");
+		ldap_abandon_ext(ld, msgid, NULL, NULL);
 		return 1;
 	}
 
@@ -685,7 +878,6 @@ ldap_bind(LDAP *ld, struct ldap_conf *conf)
 	if (rc != LDAP_SUCCESS) {
 		smap_error("ldap_parse_result failed: %s",
 			   ldap_err2string(rc));
-		free(alloc_ptr);
 		return 1;
 	}
 
@@ -722,19 +914,497 @@ ldap_bind(LDAP *ld, struct ldap_conf *conf)
 	if (refs)
 		ber_memvfree((void **)refs);
 
-	free(alloc_ptr);
-
 	return !(err == LDAP_SUCCESS);
 }
 
+static int
+conn_matches(struct ldap_conn *conn, struct ldap_conf *conf)
+{
+	return conn->tls == conf->tls
+		&& conn->protocol == conf->protocol
+		&& conn->timeout == conf->timeout
+		&& strsame(conn->uri, conf->uri)
+		&& strsame(conn->cacert, conf->cacert)
+		&& strsame(conn->binddn, conf->binddn)
+		&& strsame(conn->bindpw, conf->bindpw);
+}
+
+static void
+conn_free(struct ldap_conn *conn)
+{
+	size_t i;
+
+	if (conn->ld)
+		ldap_unbind_ext(conn->ld, NULL, NULL);
+	for (i = 0; i < conn->oldc; i++)
+		ldap_unbind_ext(conn->oldv[i].ld, NULL, NULL);
+	free(conn->oldv);
+	if (conn->uri)
+		wordsplit_free(&conn->urlws);
+	free(conn->uri);
+	free(conn->cacert);
+	free(conn->binddn);
+	free(conn->bindpw);
+	pthread_mutex_destroy(&conn->mutex);
+	free(conn);
+}
+
+static struct ldap_conn *
+conn_create(struct ldap_conf *conf)
+{
+	struct ldap_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		smap_error("not enough memory");
+		return NULL;
+	}
+	pthread_mutex_init(&conn->mutex, NULL);
+	conn->tls = conf->tls;
+	conn->protocol = conf->protocol;
+	conn->timeout = conf->timeout;
+#define CONNSTR(a) do {						\
+	if (conf->a && (conn->a = strdup(conf->a)) == NULL) {	\
+		smap_error("not enough memory");		\
+		conn_free(conn);				\
+		return NULL;					\
+	}							\
+} while (0)
+	CONNSTR(cacert);
+	CONNSTR(binddn);
+	CONNSTR(bindpw);
+	if (conf->uri) {
+		char *ldapuri = parse_ldap_uri(conf->uri);
+
+		if (!ldapuri) {
+			conn_free(conn);
+			return NULL;
+		}
+		smap_debug(dbgid, 1, ("constructed LDAP URI: %s", ldapuri));
+		if (wordsplit(ldapuri, &conn->urlws, WRDSF_DEFFLAGS)) {
+			smap_error("cannot split LDAP URI \"%s\": %s",
+				   ldapuri, wordsplit_strerror(&conn->urlws));
+			free(ldapuri);
+			wordsplit_free(&conn->urlws);
+			conn_free(conn);
+			return NULL;
+		}
+		free(ldapuri);
+		conn->uri = strdup(conf->uri);
+		if (!conn->uri) {
+			smap_error("not enough memory");
+			wordsplit_free(&conn->urlws);
+			conn_free(conn);
+			return NULL;
+		}
+	}
+	conn->cur = getpid() % conn_urlc(conn);
+	return conn;
+}
+
+/* Return a connection for the database configuration CONF, creating
+   it if there is none yet.  The connection is not established. */
+static struct ldap_conn *
+conn_get(struct ldap_conf *conf)
+{
+	struct ldap_conn *conn;
+
+	pthread_mutex_lock(&conn_mutex);
+	for (conn = conn_head; conn; conn = conn->next)
+		if (conn_matches(conn, conf))
+			break;
+	if (!conn) {
+		conn = conn_create(conf);
+		if (conn) {
+			conn->next = conn_head;
+			conn_head = conn;
+		}
+	} else
+		smap_debug(dbgid, 2, ("reusing LDAP connection"));
+	if (conn)
+		conn->refcnt++;
+	pthread_mutex_unlock(&conn_mutex);
+	return conn;
+}
+
+/* Release the connection CONN.  Close it if it is no longer used. */
+static void
+conn_release(struct ldap_conn *conn)
+{
+	struct ldap_conn **pp;
+
+	pthread_mutex_lock(&conn_mutex);
+	if (--conn->refcnt == 0) {
+		for (pp = &conn_head; *pp != conn; pp = &(*pp)->next)
+			;
+		*pp = conn->next;
+		conn_free(conn);
+	}
+	pthread_mutex_unlock(&conn_mutex);
+}
+
+/* Create a session handle for the connection CONN and bind it, each
+   step taking at most TIMEOUT seconds, unless it is 0.  Try the URLs in
+   turn, starting from the one with index *IDX, and store in *IDX the
+   index of the URL connected to.  Return NULL if none of them
+   succeeds. */
+static LDAP *
+conn_open(struct ldap_conn *conn, size_t *idx, long timeout)
+{
+	size_t i, n = conn_urlc(conn);
+
+	for (i = 0; i < n; i++) {
+		size_t k = (*idx + i) % n;
+		char *url = conn_url(conn, k);
+		LDAP *ld = ldap_connect(conn, url, timeout);
+		if (!ld)
+			continue;
+		if (ldap_bind(ld, conn, timeout)) {
+			smap_error("cannot bind to %s",
+				   url ? url : "the default LDAP server");
+			ldap_unbind_ext(ld, NULL, NULL);
+			continue;
+		}
+		*idx = k;
+		return ld;
+	}
+	return NULL;
+}
+
+/* Establish the connection CONN, if it is not established yet.  Must
+   be called with CONN->mutex locked. */
+static int
+conn_connect(struct ldap_conn *conn)
+{
+	if (conn->ld)
+		return 0;
+	conn->ld = conn_open(conn, &conn->cur, conn->timeout);
+	if (!conn->ld)
+		return 1;
+	conn->gen++;
+	return 0;
+}
+
+/* Mark the connection CONN as lost, unless it has been re-established
+   since generation GEN.  The next attempt to connect starts from the
+   next URL. */
+static void
+conn_invalidate(struct ldap_conn *conn, unsigned gen)
+{
+	pthread_mutex_lock(&conn->mutex);
+	if (conn->ld && conn->gen == gen) {
+		if (conn->ldref == 0)
+			ldap_unbind_ext(conn->ld, NULL, NULL);
+		else {
+			struct ldap_retired *p;
+
+			p = realloc(conn->oldv,
+				    (conn->oldc + 1) * sizeof(conn->oldv[0]));
+			if (!p) {
+				/* Keep using it */
+				smap_error("not enough memory");
+				pthread_mutex_unlock(&conn->mutex);
+				return;
+			}
+			conn->oldv = p;
+			conn->oldv[conn->oldc].ld = conn->ld;
+			conn->oldv[conn->oldc].refcnt = conn->ldref;
+			conn->oldc++;
+		}
+		conn->ld = NULL;
+		conn->ldref = 0;
+		conn->gen++;
+		conn->cur = (conn->cur + 1) % conn_urlc(conn);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Take a reference to the session handle LD of the connection CONN */
+static void
+conn_ref(struct ldap_conn *conn, LDAP *ld)
+{
+	size_t i;
+
+	pthread_mutex_lock(&conn->mutex);
+	if (ld == conn->ld)
+		conn->ldref++;
+	else
+		for (i = 0; i < conn->oldc; i++)
+			if (conn->oldv[i].ld == ld) {
+				conn->oldv[i].refcnt++;
+				break;
+			}
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Drop a reference to the session handle LD of the connection CONN.
+   Unbind the handle if it has been replaced and is no longer used.
+   Must be called with CONN->mutex locked. */
+static void
+conn_unref_locked(struct ldap_conn *conn, LDAP *ld)
+{
+	size_t i;
+
+	if (ld == conn->ld) {
+		conn->ldref--;
+		return;
+	}
+	for (i = 0; i < conn->oldc; i++)
+		if (conn->oldv[i].ld == ld) {
+			if (--conn->oldv[i].refcnt == 0) {
+				smap_debug(dbgid, 2,
+					   ("unbinding replaced LDAP handle"));
+				ldap_unbind_ext(ld, NULL, NULL);
+				conn->oldv[i] = conn->oldv[--conn->oldc];
+			}
+			break;
+		}
+}
+
+static void
+conn_unref(struct ldap_conn *conn, LDAP *ld)
+{
+	pthread_mutex_lock(&conn->mutex);
+	conn_unref_locked(conn, ld);
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Get the session handle for the database DB, (re)establishing its
+   connection if necessary.  Return NULL if it is not possible.  The
+   database keeps a reference to the handle until it gets another one
+   or is closed. */
+static LDAP *
+db_handle(struct ldap_db *db)
+{
+	struct ldap_conn *conn = db->conn;
+
+	pthread_mutex_lock(&conn->mutex);
+	conn_connect(conn);
+	if (db->ldap != conn->ld) {
+		if (db->ldap)
+			conn_unref_locked(conn, db->ldap);
+		if (conn->ld)
+			conn->ldref++;
+		db->ldap = conn->ld;
+	}
+	db->gen = conn->gen;
+	pthread_mutex_unlock(&conn->mutex);
+	return db->ldap;
+}
+
+/* Drop the reference of the database DB to its session handle */
+static void
+db_release(struct ldap_db *db)
+{
+	if (db->ldap) {
+		conn_unref(db->conn, db->ldap);
+		db->ldap = NULL;
+	}
+}
+
+/* Return 1 if RC indicates that the connection to the server is
+   lost. */
+static int
+server_down(int rc)
+{
+	return rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR;
+}
+
+/* Handle the loss of connection of the database DB.  Return its new
+   session handle or NULL if it cannot be reconnected. */
+static LDAP *
+db_reconnect(struct ldap_db *db)
+{
+	smap_error("LDAP server is down, reconnecting");
+	conn_invalidate(db->conn, db->gen);
+	return db_handle(db);
+}
+
+/* Return the result code of the last failed operation on LD. */
+static int
+ldap_errcode(LDAP *ld)
+{
+	int rc;
+
+	if (ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &rc)
+	    != LDAP_OPT_SUCCESS)
+		rc = LDAP_OTHER;
+	return rc;
+}
+
+
+/* Reply templates */
+
+static void
+reply_template_free(struct reply_template *tp)
+{
+	size_t i;
+
+	for (i = 0; i < tp->attrc; i++)
+		free(tp->attrv[i]);
+	free(tp->attrv);
+	free(tp->segv);
+	memset(tp, 0, sizeof(*tp));
+}
+
+static struct reply_segm *
+add_segment(struct reply_template *tp, enum reply_segm_type type)
+{
+	struct reply_segm *p;
+
+	p = realloc(tp->segv, (tp->segc + 1) * sizeof(tp->segv[0]));
+	if (!p)
+		return NULL;
+	tp->segv = p;
+	p += tp->segc++;
+	p->type = type;
+	return p;
+}
+
+static int
+add_literal_segment(struct reply_template *tp, const char *str,
+		    const char *end)
+{
+	if (end > str) {
+		struct reply_segm *segm = add_segment(tp, segm_literal);
+		if (!segm)
+			return 1;
+		segm->v.literal.ptr = str;
+		segm->v.literal.size = end - str;
+	}
+	return 0;
+}
+
+static int
+add_var_segment(struct reply_template *tp, const char *name, size_t len)
+{
+	struct reply_segm *segm;
+	size_t i;
+
+	if (len == 0)
+		return 0;
+	if (len == 2 && memcmp(name, "dn", 2) == 0)
+		return add_segment(tp, segm_dn) == NULL;
+	if (len == 3 && memcmp(name, "map", 3) == 0)
+		return add_segment(tp, segm_map) == NULL;
+	if (len == 3 && memcmp(name, "key", 3) == 0)
+		return add_segment(tp, segm_key) == NULL;
+
+	for (i = 0; i < tp->attrc; i++)
+		if (strlen(tp->attrv[i]) == len
+		    && strncasecmp(tp->attrv[i], name, len) == 0)
+			break;
+	if (i == tp->attrc) {
+		char **p = realloc(tp->attrv,
+				   (tp->attrc + 1) * sizeof(tp->attrv[0]));
+		if (!p)
+			return 1;
+		tp->attrv = p;
+		p[i] = malloc(len + 1);
+		if (!p[i])
+			return 1;
+		memcpy(p[i], name, len);
+		p[i][len] = 0;
+		tp->attrc++;
+	}
+
+	segm = add_segment(tp, segm_attr);
+	if (!segm)
+		return 1;
+	segm->v.attr = i;
+	return 0;
+}
+
+/* Compile the reply template TEXT into TP.  Variables are referred to
+   as $NAME or ${NAME}.  A backslash protects the character that
+   follows it from expansion, and is itself retained.  The literal
+   segments point into TEXT, which must not be freed while TP is in
+   use. */
+static int
+reply_template_compile(struct reply_template *tp, const char *text)
+{
+	const char *p, *start, *name;
+	size_t len;
+
+	memset(tp, 0, sizeof(*tp));
+	for (start = p = text; *p; ) {
+		if (*p == '\\') {
+			p += p[1] ? 2 : 1;
+			continue;
+		} else if (*p != '$') {
+			p++;
+			continue;
+		}
+
+		if (isalpha(p[1]) || p[1] == '_') {
+			name = p + 1;
+			for (len = 1; isalnum(name[len]) || name[len] == '_';
+			     len++)
+				;
+			if (add_literal_segment(tp, start, p)
+			    || add_var_segment(tp, name, len))
+				goto nomem;
+			start = p = name + len;
+		} else if (p[1] == '{') {
+			const char *q;
+			int level = 1;
+
+			name = p + 2;
+			len = strcspn(name, ":}");
+			/* Skip ${NAME:...} up to the matching brace */
+			for (q = name + len; *q; q++) {
+				if (*q == '{')
+					level++;
+				else if (*q == '}' && --level == 0)
+					break;
+			}
+			if (!*q) {
+				smap_error("missing closing brace in \"%s\"",
+					   text);
+				reply_template_free(tp);
+				return 1;
+			}
+			if (add_literal_segment(tp, start, p)
+			    || add_var_segment(tp, name, len))
+				goto nomem;
+			start = p = q + 1;
+		} else
+			p += p[1] ? 2 : 1;
+	}
+	if (add_literal_segment(tp, start, p))
+		goto nomem;
+	return 0;
+
+ nomem:
+	smap_error("not enough memory");
+	reply_template_free(tp);
+	return 1;
+}
+
+# define __smap_s_cat2__(a,b) a ## b
+# define REPLY(d,s) \
+	((d)->conf.__smap_s_cat2__(s,_reply)				\
+	 ? (d)->conf.__smap_s_cat2__(s,_reply)				\
+	 : __smap_s_cat3__(dfl_,s,_reply))
+
+static int
+mod_ldap_free_db(smap_database_t dbp)
+{
+	struct ldap_db *db = (struct ldap_db *) dbp;
+	reply_template_free(&db->positive_reply);
+	reply_template_free(&db->negative_reply);
+	reply_template_free(&db->onerror_reply);
+	ldap_conf_free(&db->conf);
+	free(db);
+	return 0;
+}
 
 static smap_database_t
 mod_ldap_init_db(const char *dbid, int argc, char **argv)
 {
-	LDAP *ldap;
 	struct ldap_db *db;
 	struct ldap_conf conf;
-	size_t i, j;
+	size_t i;
 	struct smap_option *opt;
 	
 	if (!ldap_conf_cpy(&conf, &dfl_conf))
@@ -774,39 +1444,25 @@ mod_ldap_init_db(const char *dbid, int argc, char **argv)
 		return NULL;
 	}
 
-	if (conf.positive_reply &&
-	    wordsplit_varnames(conf.positive_reply, &conf.attrs, 0)) {
-		smap_error("can't get attribute names: %s",
-			   strerror(errno));
+	if (conf.replica && !conf.keyattr) {
+		smap_error("%s: replica requires key-attribute", dbid);
 		ldap_conf_free(&conf);
 		return NULL;
 	}
-	if (conf.negative_reply &&
-	    wordsplit_varnames(conf.negative_reply, &conf.attrs, 1)) {
-		smap_error("can't get attribute names: %s",
-			   strerror(errno));
-		ldap_conf_free(&conf);
-		return NULL;
+
+	/* Otherwise each subprocess would load a replica of its own,
+	   only to discard it when the session ends */
+	if (conf.replica && !smap_single_process()) {
+		smap_error("%s: replica ignored: smapd does not run in "
+			   "single-process mode", dbid);
+		conf.replica = 0;
 	}
-	if (conf.onerror_reply &&
-	    wordsplit_varnames(conf.onerror_reply, &conf.attrs, 1)) {
-		smap_error("can't get attribute names: %s",
-			   strerror(errno));
+
+	if (get_passwd(&conf)) {
 		ldap_conf_free(&conf);
 		return NULL;
 	}
 
-	/* Eliminate map and key names */
-	for (i = j = 0; conf.attrs[i]; i++, j++) {
-		if (strcmp(conf.attrs[i], "map") == 0
-		    || strcmp(conf.attrs[i], "key") == 0) {
-			free(conf.attrs[i]);
-			++j;
-		}
-		conf.attrs[i] = conf.attrs[j];
-	}
-	conf.attrs[i] = 0;
-	
 	db = calloc(1, sizeof(*db));
 	if (!db) {
 		ldap_conf_free(&conf);
@@ -815,170 +1471,1155 @@ mod_ldap_init_db(const char *dbid, int argc, char **argv)
 	}
 
 	db->conf = conf;
+
+	if (reply_template_compile(&db->positive_reply,
+				   REPLY(db, positive))
+	    || reply_template_compile(&db->negative_reply,
+				      REPLY(db, negative))
+	    || reply_template_compile(&db->onerror_reply,
+				      REPLY(db, onerror))) {
+		mod_ldap_free_db((smap_database_t) db);
+		return NULL;
+	}
+
+	/* Request only the attributes referred to by the positive reply.
+	   The other replies are formatted without an entry. */
+	for (i = 0; i < db->positive_reply.attrc; i++)
+		if (argz_add(&db->conf.attrs, db->positive_reply.attrv[i]))
+			break;
+	/* Batch queries need the key attribute to tell which key each
+	   entry pertains to */
+	if (i < db->positive_reply.attrc
+	    || (db->conf.keyattr
+		&& argz_add(&db->conf.attrs, db->conf.keyattr))
+	    /* An empty list would request all attributes */
+	    || (!db->conf.attrs
+		&& argz_add(&db->conf.attrs, LDAP_NO_ATTRS))) {
+		smap_error("%s: not enough memory", dbid);
+		mod_ldap_free_db((smap_database_t) db);
+		return NULL;
+	}
 	
 	return (smap_database_t) db;
 }
 
 static int
-mod_ldap_free_db(smap_database_t dbp)
+mod_ldap_open(smap_database_t dbp)
 {
 	struct ldap_db *db = (struct ldap_db *) dbp;
-	ldap_conf_free(&db->conf);
-	free(db);
+
+	db->conn = conn_get(&db->conf);
+	if (!db->conn)
+		return 1;
+	if (!db_handle(db)) {
+		conn_release(db->conn);
+		db->conn = NULL;
+		return 1;
+	}
+	if (db->conf.replica && !db->replica)
+		replica_start(db);
 	return 0;
 }
 
 static int
-mod_ldap_open(smap_database_t dbp)
+mod_ldap_close(smap_database_t dbp)
 {
 	struct ldap_db *db = (struct ldap_db *) dbp;
-	LDAP *ldap;
+	replica_stop(db);
+	db_release(db);
+	conn_release(db->conn);
+	db->conn = NULL;
+	return 0;
+}
 
-	ldap = ldap_connect(&db->conf);
-	if (!ldap) 
-		return 1;
-	
-	if (ldap_bind(ldap, &db->conf))
+static int
+mod_ldap_ping(smap_database_t dbp)
+{
+	struct ldap_db *db = (struct ldap_db *) dbp;
+	struct berval *authzid = NULL;
+	int rc;
+
+	if (!db_handle(db))
 		return 1;
+	rc = ldap_whoami_s(db->ldap, &authzid, NULL, NULL);
+	if (authzid)
+		ber_bvfree(authzid);
+	switch (rc) {
+	case LDAP_SUCCESS:
+	/* The server does not support the Who Am I? operation, but
+	   it has replied, so the connection is alive */
+	case LDAP_PROTOCOL_ERROR:
+	case LDAP_UNWILLING_TO_PERFORM:
+		return 0;
+	}
+	smap_error("ldap_whoami failed: %s", ldap_err2string(rc));
+	/* Reconnect at once: reopening the database would get the same
+	   connection if it is shared with other databases */
+	return db_reconnect(db) ? 0 : 1;
+}
 
-	db->ldap = ldap;
-	
+/* Only the map and key are available to the filter and the reply
+   templates */
+static int
+mod_ldap_uses_conninfo(smap_database_t dbp)
+{
 	return 0;
 }
 
+/* Write the reply formatted from the template TP.  The map name and
+   the key are taken from ENV.  The DN is DN and the values of the
+   attributes are in VALV, in the order of TP->attrv.  Missing ones
+   expand to empty strings.  Multiple values are joined with
+   JOINSTR. */
+static void
+write_reply(smap_stream_t ostr, struct reply_template *tp, char const **env,
+	    const char *dn, struct berval ***valv, const char *joinstr)
+{
+	size_t i, j;
+
+	for (i = 0; i < tp->segc; i++) {
+		struct reply_segm *segm = &tp->segv[i];
+		struct berval **values;
+
+		switch (segm->type) {
+		case segm_literal:
+			smap_stream_write(ostr, segm->v.literal.ptr,
+					  segm->v.literal.size, NULL);
+			break;
+
+		case segm_map:
+			smap_stream_write(ostr, env[1], strlen(env[1]), NULL);
+			break;
+
+		case segm_key:
+			smap_stream_write(ostr, env[3], strlen(env[3]), NULL);
+			break;
+
+		case segm_dn:
+			if (dn)
+				smap_stream_write(ostr, dn, strlen(dn), NULL);
+			break;
+
+		case segm_attr:
+			if (!valv || !(values = valv[segm->v.attr]))
+				break;
+			for (j = 0; values[j]; j++) {
+				if (j) {
+					if (!joinstr)
+						break;
+					smap_stream_write(ostr, joinstr,
+							  strlen(joinstr),
+							  NULL);
+				}
+				smap_stream_write(ostr, values[j]->bv_val,
+						  values[j]->bv_len, NULL);
+			}
+		}
+	}
+	smap_stream_write(ostr, "\n", 1, NULL);
+}
+
+/* Send the reply formatted from the template TP.  The map name and the
+   key are taken from ENV.  The DN and attribute values are taken from
+   the entry MSG, obtained from LD, or expand to empty strings if it is
+   NULL.  Each referred attribute is looked up once. */
 static int
-mod_ldap_close(smap_database_t dbp)
+send_reply(smap_stream_t ostr, struct reply_template *tp, char const **env,
+	   LDAP *ld, LDAPMessage *msg, struct ldap_db *db)
 {
-	struct ldap_db *db = (struct ldap_db *) dbp;
-	ldap_unbind_ext(db->ldap, NULL, NULL);
-	db->ldap = NULL;
+	struct berval **valbuf[16], ***valv = valbuf;
+	char *dn = NULL;
+	size_t i;
+
+	if (!msg) {
+		write_reply(ostr, tp, env, NULL, NULL, NULL);
+		return 0;
+	}
+
+	if (tp->attrc > sizeof(valbuf) / sizeof(valbuf[0])) {
+		valv = calloc(tp->attrc, sizeof(valv[0]));
+		if (!valv) {
+			smap_error("not enough memory");
+			return 1;
+		}
+	}
+	for (i = 0; i < tp->attrc; i++)
+		valv[i] = ldap_get_values_len(ld, msg, tp->attrv[i]);
+	for (i = 0; i < tp->segc; i++)
+		if (tp->segv[i].type == segm_dn) {
+			dn = ldap_get_dn(ld, msg);
+			break;
+		}
+
+	write_reply(ostr, tp, env, dn, valv, db->conf.joinstr);
+
+	if (dn)
+		ldap_memfree(dn);
+	for (i = 0; i < tp->attrc; i++)
+		if (valv[i])
+			ldap_value_free_len(valv[i]);
+	if (valv != valbuf)
+		free(valv);
 	return 0;
 }
 
-struct getvar_data {
-	LDAP *ld;
-	char const **env;
-	LDAPMessage *msg;
-	char *joinstr;
+/* Local replica */
+
+/* A database with the `replica' option keeps in memory the entries
+   below its base that match `replica-filter', indexed by the values of
+   their key attribute.  A separate thread keeps them up to date using
+   content synchronization (RFC 4533) in the refreshAndPersist mode.
+   If the server does not support it, the whole subtree is searched
+   again every `replica-refresh' seconds.  Once the initial content is
+   loaded, lookups are served from the replica without contacting the
+   server.  Replicas are kept only in single-process mode, where the
+   master process serves all sessions itself. */
+
+/* Interval between attempts to reconnect to the server, s */
+#define REPLICA_RETRY 10
+/* Interval between checks for the stop request while loading, s */
+#define REPLICA_POLL 1
+/* Connection and bind timeout, if the database does not set one, s */
+#define REPLICA_TIMEOUT 10
+
+struct replica_entry {
+	struct berval id;         /* entryUUID, or DN if not synchronized */
+	char *dn;
+	unsigned gen;             /* Refresh in which it was last reported */
+	struct berval **keyv;     /* Values of the key attribute */
+	struct berval ***valv;    /* Values of the attributes of the
+				     positive reply, in its order */
 };
 
-static char *
-getvar(const char *var, size_t len, void *data)
+/* Hash index of replica entries */
+struct replica_node {
+	struct replica_node *next;
+	unsigned long long hash;
+	const char *str;
+	size_t len;
+	struct replica_entry *entry;
+};
+
+struct replica_index {
+	struct replica_node **tab;
+	size_t size;              /* Number of buckets */
+	size_t count;             /* Number of nodes */
+	int fold;                 /* Ignore case of keys */
+};
+
+struct ldap_replica {
+	struct ldap_db *db;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;      /* Signalled when STOP is set */
+	pthread_t tid;
+	int stop;                 /* The thread must terminate */
+	int ready;                /* The initial content has been loaded */
+	struct replica_index keys;/* Entries by key */
+	struct replica_index ids; /* Entries by ID */
+	unsigned gen;             /* Current refresh */
+	int present;              /* Remove the entries not reported in
+				     the current refresh when it ends */
+	char *filter;             /* Filter selecting the entries */
+	LDAP *ld;                 /* Session handle of the thread */
+#ifdef MOD_LDAP_SYNC
+	int sync;                 /* Use content synchronization */
+	int ended;                /* The synchronization search has ended */
+	int result;               /* Its result code */
+	ldap_sync_t ls;
+#endif
+};
+
+static char dfl_replica_filter[] = "(objectClass=*)";
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME        0x100000001b3ULL
+
+static unsigned long long
+index_hash(const char *str, size_t len, int fold)
 {
-	struct getvar_data *gd = data;
-	
-	if (len == 2 && memcmp(var, "dn", len) == 0)
-		return ldap_get_dn(gd->ld, gd->msg);
+	const unsigned char *p = (const unsigned char *) str;
+	unsigned long long h = FNV64_OFFSET_BASIS;
+
+	while (len--) {
+		unsigned c = *p++;
+		if (fold && c < 128)
+			c = tolower(c);
+		h ^= c;
+		h *= FNV64_PRIME;
+	}
+	return h;
+}
+
+static struct replica_node *
+index_lookup(struct replica_index *ix, const char *str, size_t len)
+{
+	unsigned long long hash;
+	struct replica_node *np;
+
+	if (ix->size == 0)
+		return NULL;
+	hash = index_hash(str, len, ix->fold);
+	for (np = ix->tab[hash % ix->size]; np; np = np->next)
+		if (np->hash == hash && np->len == len
+		    && (ix->fold ? strncasecmp(np->str, str, len)
+			: memcmp(np->str, str, len)) == 0)
+			return np;
+	return NULL;
+}
+
+static int
+index_add(struct replica_index *ix, const char *str, size_t len,
+	  struct replica_entry *ep)
+{
+	struct replica_node *np;
+	size_t i;
 
-	if (gd->env) {
-		int i;
+	if (ix->count >= ix->size) {
+		size_t size = ix->size ? ix->size * 2 : 64;
+		struct replica_node **tab = calloc(size, sizeof(tab[0]));
 
-		for (i = 0; gd->env[i]; i += 2)
-			if (strlen(gd->env[i]) == len
-			    && memcmp(var, gd->env[i], len) == 0)
-				return strdup(gd->env[i+1]);
+		if (!tab)
+			return 1;
+		for (i = 0; i < ix->size; i++)
+			while ((np = ix->tab[i])) {
+				ix->tab[i] = np->next;
+				np->next = tab[np->hash % size];
+				tab[np->hash % size] = np;
+			}
+		free(ix->tab);
+		ix->tab = tab;
+		ix->size = size;
 	}
 
-	if (gd->ld) {
-		struct berval bv;
-		char *p;
-		struct berval **values;
-		char *attr = malloc(len+1);
+	np = malloc(sizeof(*np));
+	if (!np)
+		return 1;
+	np->hash = index_hash(str, len, ix->fold);
+	np->str = str;
+	np->len = len;
+	np->entry = ep;
+	i = np->hash % ix->size;
+	np->next = ix->tab[i];
+	ix->tab[i] = np;
+	ix->count++;
+	return 0;
+}
 
-		if (!attr)
-			return NULL;
-		memcpy(attr, var, len);
-		attr[len] = 0;
-		values = ldap_get_values_len(gd->ld, gd->msg, attr);
-		free(attr);
-		if (!values)
-			return strdup("");
-
-		if (!gd->joinstr) {
-			p = malloc(values[0]->bv_len + 1);
-			if (!p)
-				return NULL;
-			memcpy(p, values[0]->bv_val, values[0]->bv_len);
-			p[values[0]->bv_len] = 0;
-		} else {
-			size_t i, len, dlen = strlen(gd->joinstr);
-			char *q;
-			
-			len = values[0]->bv_len;
-			for (i = 1; values[i]; i++)
-				len += values[i]->bv_len + dlen;
-		        smap_debug(dbgid, 2, ("%s: %lu", var, (unsigned long)i));
-			p = malloc(len + 1);
-			if (!p)
-				return NULL;
-			q = p;
-			for (i = 0; values[i]; i++) {
-		                smap_debug(dbgid, 2,
-                                           ("%s: %lu=%*.*s", var, 
-					    (unsigned long)i,
-					    (int)values[i]->bv_len,
-					    (int)values[i]->bv_len,
-					    values[i]->bv_val));
-				if (i) {
-					memcpy(q, gd->joinstr, dlen);
-					q += dlen;
-				}
-				memcpy(q, values[i]->bv_val,
-				       values[i]->bv_len);
-				q += values[i]->bv_len;
+/* Remove the node of the entry EP stored under STR */
+static void
+index_remove(struct replica_index *ix, const char *str, size_t len,
+	     struct replica_entry *ep)
+{
+	struct replica_node **pp, *np;
+
+	if (ix->size == 0)
+		return;
+	for (pp = &ix->tab[index_hash(str, len, ix->fold) % ix->size];
+	     (np = *pp); pp = &np->next)
+		if (np->entry == ep && np->str == str) {
+			*pp = np->next;
+			free(np);
+			ix->count--;
+			return;
+		}
+}
+
+static void
+index_free(struct replica_index *ix)
+{
+	struct replica_node *np;
+	size_t i;
+
+	for (i = 0; i < ix->size; i++)
+		while ((np = ix->tab[i])) {
+			ix->tab[i] = np->next;
+			free(np);
+		}
+	free(ix->tab);
+	ix->tab = NULL;
+	ix->size = ix->count = 0;
+}
+
+static void
+replica_entry_free(struct ldap_replica *rp, struct replica_entry *ep)
+{
+	size_t i;
+
+	if (ep->valv) {
+		for (i = 0; i < rp->db->positive_reply.attrc; i++)
+			if (ep->valv[i])
+				ldap_value_free_len(ep->valv[i]);
+		free(ep->valv);
+	}
+	if (ep->keyv)
+		ldap_value_free_len(ep->keyv);
+	if (ep->dn)
+		ldap_memfree(ep->dn);
+	free(ep->id.bv_val);
+	free(ep);
+}
+
+/* Remove the entry EP from the replica RP */
+static void
+replica_remove(struct ldap_replica *rp, struct replica_entry *ep)
+{
+	size_t i;
+
+	for (i = 0; ep->keyv && ep->keyv[i]; i++)
+		index_remove(&rp->keys, ep->keyv[i]->bv_val,
+			     ep->keyv[i]->bv_len, ep);
+	index_remove(&rp->ids, ep->id.bv_val, ep->id.bv_len, ep);
+	replica_entry_free(rp, ep);
+}
+
+static void
+replica_delete(struct ldap_replica *rp, struct berval *id)
+{
+	struct replica_node *np = index_lookup(&rp->ids, id->bv_val,
+					       id->bv_len);
+	if (np)
+		replica_remove(rp, np->entry);
+}
+
+/* Mark the entry with ID as reported in the current refresh */
+static void
+replica_touch(struct ldap_replica *rp, struct berval *id)
+{
+	struct replica_node *np = index_lookup(&rp->ids, id->bv_val,
+					       id->bv_len);
+	if (np)
+		np->entry->gen = rp->gen;
+}
+
+/* Add the entry MSG, obtained from LD, to the replica RP, replacing
+   the one with the same ID, if any.  If ID is NULL, the DN is used. */
+static int
+replica_put(struct ldap_replica *rp, LDAP *ld, LDAPMessage *msg,
+	    struct berval *id)
+{
+	struct reply_template *tp = &rp->db->positive_reply;
+	struct replica_entry *ep;
+	size_t i;
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep
+	    || !(ep->valv = calloc(tp->attrc + 1, sizeof(ep->valv[0])))
+	    || !(ep->dn = ldap_get_dn(ld, msg)))
+		goto err;
+	if (!id) {
+		ep->id.bv_val = strdup(ep->dn);
+		ep->id.bv_len = strlen(ep->dn);
+	} else if ((ep->id.bv_val = malloc(id->bv_len + 1)) != NULL) {
+		memcpy(ep->id.bv_val, id->bv_val, id->bv_len);
+		ep->id.bv_len = id->bv_len;
+	}
+	if (!ep->id.bv_val)
+		goto err;
+	ep->gen = rp->gen;
+	ep->keyv = ldap_get_values_len(ld, msg, rp->db->conf.keyattr);
+	for (i = 0; i < tp->attrc; i++)
+		ep->valv[i] = ldap_get_values_len(ld, msg, tp->attrv[i]);
+
+	replica_delete(rp, &ep->id);
+	if (index_add(&rp->ids, ep->id.bv_val, ep->id.bv_len, ep))
+		goto err;
+	for (i = 0; ep->keyv && ep->keyv[i]; i++)
+		if (index_add(&rp->keys, ep->keyv[i]->bv_val,
+			      ep->keyv[i]->bv_len, ep)) {
+			replica_remove(rp, ep);
+			ep = NULL;
+			goto err;
+		}
+	return 0;
+
+err:
+	smap_error("not enough memory");
+	if (ep)
+		replica_entry_free(rp, ep);
+	return 1;
+}
+
+/* Remove the entries not reported in the current refresh */
+static void
+replica_sweep(struct ldap_replica *rp)
+{
+	struct replica_node *np, *next;
+	size_t i, n = 0;
+
+	for (i = 0; i < rp->ids.size; i++)
+		for (np = rp->ids.tab[i]; np; np = next) {
+			next = np->next;
+			if (np->entry->gen != rp->gen) {
+				replica_remove(rp, np->entry);
+				n++;
+			}
+		}
+	smap_debug(dbgid, 1, ("replica: %lu entries, %lu removed",
+			      (unsigned long) rp->ids.count,
+			      (unsigned long) n));
+}
+
+static int
+replica_stopped(struct ldap_replica *rp)
+{
+	int stop;
+
+	pthread_mutex_lock(&rp->mutex);
+	stop = rp->stop;
+	pthread_mutex_unlock(&rp->mutex);
+	return stop;
+}
+
+/* Wait for SECONDS, or indefinitely if it is negative, unless the
+   thread is told to stop before.  Return 1 if it is. */
+static int
+replica_sleep(struct ldap_replica *rp, long seconds)
+{
+	struct timespec ts;
+	int stop;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += seconds;
+	pthread_mutex_lock(&rp->mutex);
+	while (!rp->stop)
+		if (seconds < 0)
+			pthread_cond_wait(&rp->cond, &rp->mutex);
+		else if (pthread_cond_timedwait(&rp->cond, &rp->mutex, &ts)
+			 == ETIMEDOUT)
+			break;
+	stop = rp->stop;
+	pthread_mutex_unlock(&rp->mutex);
+	return stop;
+}
+
+/* Load the whole content of the replica RP anew.  The entries are
+   added as they arrive, and the thread checks for the stop request
+   every REPLICA_POLL seconds while waiting for them. */
+static int
+replica_refresh(struct ldap_replica *rp)
+{
+	struct ldap_db *db = rp->db;
+	LDAPMessage *msg;
+	struct timeval tv;
+	int rc, err, msgid;
+
+	smap_debug(dbgid, 1, ("replica: loading"));
+	rc = ldap_search_ext(rp->ld, db->conf.base, LDAP_SCOPE_SUBTREE,
+			     rp->filter, db->conf.attrs, 0,
+			     NULL, NULL, NULL, 0, &msgid);
+	if (rc != LDAP_SUCCESS) {
+		smap_error("LDAP replica: search failed: %s",
+			   ldap_err2string(rc));
+		return rc;
+	}
+
+	pthread_mutex_lock(&rp->mutex);
+	rp->gen++;
+	pthread_mutex_unlock(&rp->mutex);
+
+	for (;;) {
+		if (replica_stopped(rp)) {
+			ldap_abandon_ext(rp->ld, msgid, NULL, NULL);
+			return LDAP_SUCCESS;
+		}
+		tv.tv_sec = REPLICA_POLL;
+		tv.tv_usec = 0;
+		msg = NULL;
+		switch (ldap_result(rp->ld, msgid, LDAP_MSG_ONE, &tv, &msg)) {
+		case -1:
+			rc = ldap_errcode(rp->ld);
+			smap_error("LDAP replica: search failed: %s",
+				   ldap_err2string(rc));
+			return rc;
+
+		case 0:
+			continue;
+
+		case LDAP_RES_SEARCH_ENTRY:
+			pthread_mutex_lock(&rp->mutex);
+			replica_put(rp, rp->ld, msg, NULL);
+			pthread_mutex_unlock(&rp->mutex);
+			break;
+
+		case LDAP_RES_SEARCH_RESULT:
+			rc = ldap_parse_result(rp->ld, msg, &err,
+					       NULL, NULL, NULL, NULL, 1);
+			if (rc == LDAP_SUCCESS)
+				rc = err;
+			if (rc != LDAP_SUCCESS) {
+				smap_error("LDAP replica: search failed: %s",
+					   ldap_err2string(rc));
+				return rc;
 			}
-			*q = 0;
+			pthread_mutex_lock(&rp->mutex);
+			replica_sweep(rp);
+			rp->ready = 1;
+			pthread_mutex_unlock(&rp->mutex);
+			return LDAP_SUCCESS;
+
+		default:
+			/* Search references are ignored */
+			break;
 		}
-		smap_debug(dbgid, 1, ("attr %*.*s=%s",
-				      (int)len, (int)len, var, p));
-		ldap_value_free_len(values);
-		return p;
+		ldap_msgfree(msg);
 	}
+}
 
+#ifdef MOD_LDAP_SYNC
+static int
+sync_search_entry(ldap_sync_t *ls, LDAPMessage *msg,
+		  struct berval *uuid, ldap_sync_refresh_t phase)
+{
+	struct ldap_replica *rp = ls->ls_private;
+	int rc = LDAP_SUCCESS;
+
+	pthread_mutex_lock(&rp->mutex);
+	switch (phase) {
+	case LDAP_SYNC_CAPI_PRESENT:
+		rp->present = 1;
+		replica_touch(rp, uuid);
+		break;
+	case LDAP_SYNC_CAPI_ADD:
+	case LDAP_SYNC_CAPI_MODIFY:
+		replica_put(rp, ls->ls_ld, msg, uuid);
+		break;
+	case LDAP_SYNC_CAPI_DELETE:
+		replica_delete(rp, uuid);
+		break;
+	default:
+		break;
+	}
+	/* Interrupt the initial refresh if told to stop */
+	if (rp->stop)
+		rc = LDAP_OTHER;
+	pthread_mutex_unlock(&rp->mutex);
+	return rc;
+}
+
+static int
+sync_search_reference(ldap_sync_t *ls, LDAPMessage *msg)
+{
+	return LDAP_SUCCESS;
+}
+
+static int
+sync_intermediate(ldap_sync_t *ls, LDAPMessage *msg,
+		  BerVarray uuids, ldap_sync_refresh_t phase)
+{
+	struct ldap_replica *rp = ls->ls_private;
+	size_t i;
+
+	pthread_mutex_lock(&rp->mutex);
+	switch (phase) {
+	case LDAP_SYNC_CAPI_PRESENTS_IDSET:
+		rp->present = 1;
+		for (i = 0; uuids && uuids[i].bv_val; i++)
+			replica_touch(rp, &uuids[i]);
+		break;
+	case LDAP_SYNC_CAPI_DELETES_IDSET:
+		for (i = 0; uuids && uuids[i].bv_val; i++)
+			replica_delete(rp, &uuids[i]);
+		break;
+	case LDAP_SYNC_CAPI_PRESENTS:
+	case LDAP_SYNC_CAPI_DONE:
+		/* End of the present phase: the entries that were not
+		   reported are gone */
+		if (rp->present) {
+			replica_sweep(rp);
+			rp->present = 0;
+		}
+		if (phase == LDAP_SYNC_CAPI_DONE && !rp->ready) {
+			smap_debug(dbgid, 1, ("replica: loaded"));
+			rp->ready = 1;
+		}
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&rp->mutex);
+	return LDAP_SUCCESS;
+}
+
+static int
+sync_search_result(ldap_sync_t *ls, LDAPMessage *msg, int refreshDeletes)
+{
+	struct ldap_replica *rp = ls->ls_private;
+	int rc, err;
+
+	rc = ldap_parse_result(ls->ls_ld, msg, &err,
+			       NULL, NULL, NULL, NULL, 0);
+	rp->result = rc == LDAP_SUCCESS ? err : rc;
+	rp->ended = 1;
+	return LDAP_SUCCESS;
+}
+
+/* Keep the replica RP synchronized until the search ends, the
+   connection is lost or the thread is told to stop.  Return the LDAP
+   result code. */
+static int
+replica_sync(struct ldap_replica *rp)
+{
+	ldap_sync_t *ls = &rp->ls;
+	int rc;
+
+	smap_debug(dbgid, 1, ("replica: starting synchronization"));
+	pthread_mutex_lock(&rp->mutex);
+	rp->gen++;
+	/* Without a cookie, the server sends the whole content */
+	rp->present = ls->ls_cookie.bv_val == NULL;
+	pthread_mutex_unlock(&rp->mutex);
+	rp->ended = 0;
+	rp->result = LDAP_SUCCESS;
+	ls->ls_ld = rp->ld;
+
+	rc = ldap_sync_init(ls, LDAP_SYNC_REFRESH_AND_PERSIST);
+	while (rc == LDAP_SUCCESS && !rp->ended && !replica_stopped(rp))
+		rc = ldap_sync_poll(ls);
+	if (rc == -1)
+		rc = ldap_errcode(rp->ld);
+	else if (rc == LDAP_SUCCESS) {
+		if (rp->ended)
+			rc = rp->result;
+		else
+			ldap_abandon_ext(rp->ld, ls->ls_msgid, NULL, NULL);
+	}
+	ls->ls_ld = NULL;
+
+	if (rc == LDAP_SYNC_REFRESH_REQUIRED) {
+		smap_debug(dbgid, 1, ("replica: full reload required"));
+		ldap_memfree(ls->ls_cookie.bv_val);
+		ls->ls_cookie.bv_val = NULL;
+		ls->ls_cookie.bv_len = 0;
+	}
+	return rc;
+}
+
+/* Return 1 if RC means that the server does not support content
+   synchronization */
+static int
+sync_unsupported(int rc)
+{
+	switch (rc) {
+	case LDAP_PROTOCOL_ERROR:
+	case LDAP_UNAVAILABLE_CRITICAL_EXTENSION:
+	case LDAP_UNWILLING_TO_PERFORM:
+	case LDAP_INSUFFICIENT_ACCESS:
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+static void *
+replica_thread(void *data)
+{
+	struct ldap_replica *rp = data;
+	struct ldap_conn *conn = rp->db->conn;
+	long wait;
+	int rc;
+
+	do {
+		wait = REPLICA_RETRY;
+		if (!rp->ld) {
+			size_t idx;
+
+			pthread_mutex_lock(&conn->mutex);
+			idx = conn->cur;
+			pthread_mutex_unlock(&conn->mutex);
+			/* Bound the time replica_stop may have to wait */
+			rp->ld = conn_open(conn, &idx,
+					   conn->timeout ? conn->timeout
+					   : REPLICA_TIMEOUT);
+			if (!rp->ld)
+				continue;
+		}
+#ifdef MOD_LDAP_SYNC
+		if (rp->sync) {
+			rc = replica_sync(rp);
+			if (rc == LDAP_SYNC_REFRESH_REQUIRED)
+				wait = 0;
+			else if (sync_unsupported(rc)) {
+				smap_error("LDAP replica: content "
+					   "synchronization failed: %s; "
+					   "falling back to periodic refresh",
+					   ldap_err2string(rc));
+				rp->sync = 0;
+				wait = 0;
+			} else if (rc != LDAP_SUCCESS)
+				smap_error("LDAP replica: synchronization "
+					   "failed: %s", ldap_err2string(rc));
+		} else
+#endif
+		{
+			rc = replica_refresh(rp);
+			if (rc == LDAP_SUCCESS)
+				wait = rp->db->conf.replica_refresh > 0
+					? rp->db->conf.replica_refresh : -1;
+		}
+		if (server_down(rc)) {
+			ldap_unbind_ext(rp->ld, NULL, NULL);
+			rp->ld = NULL;
+		}
+	} while (!replica_sleep(rp, wait));
+
+	if (rp->ld) {
+		ldap_unbind_ext(rp->ld, NULL, NULL);
+		rp->ld = NULL;
+	}
 	return NULL;
 }
 
-	
+/* Return 1 if the replica of DB can serve lookups */
 static int
-send_reply(smap_stream_t ostr, const char *template, char const **env,
-	   LDAPMessage *msg, struct ldap_db *db)
+replica_ready(struct ldap_db *db)
 {
-	struct wordsplit ws;
+	struct ldap_replica *rp = db->replica;
+	int ready;
+
+	if (!rp)
+		return 0;
+	pthread_mutex_lock(&rp->mutex);
+	ready = rp->ready;
+	pthread_mutex_unlock(&rp->mutex);
+	return ready;
+}
+
+/* Look up the N KEYS in MAP in the replica of DB, sending a reply for
+   each.  Return -1 if the replica cannot serve lookups yet. */
+static int
+replica_query(struct ldap_db *db, smap_stream_t ostr,
+	      const char *map, const char **keys, size_t n)
+{
+	struct ldap_replica *rp = db->replica;
+	struct replica_node *np;
+	char const *inenv[5];
+	smap_stream_t str;
+	const char *buf;
+	smap_off_t size;
+	size_t i;
 	int rc;
-	struct getvar_data gd;
-	
-	ws.ws_env = (const char **) env;
-	ws.ws_error = smap_error;
-	ws.ws_getvar = getvar;
-	if (db) {
-		gd.ld = db->ldap;
-		gd.joinstr = db->conf.joinstr;
-	} else {
-		gd.ld = NULL;
-		gd.joinstr = NULL;
+
+	if (!rp)
+		return -1;
+	/* The replies are formatted into memory, so that the replica is
+	   not locked while they are sent to the client */
+	if (smap_memory_stream_create(&str))
+		return -1;
+	pthread_mutex_lock(&rp->mutex);
+	if (!rp->ready) {
+		pthread_mutex_unlock(&rp->mutex);
+		smap_stream_destroy(&str);
+		return -1;
 	}
-	
-	gd.env = env;
-	gd.msg = msg;
-
-	ws.ws_closure = &gd;
-	rc = wordsplit(template, &ws,
-		       WRDSF_NOSPLIT |
-		       WRDSF_NOCMD |
-		       WRDSF_GETVAR |
-		       WRDSF_CLOSURE |
-		       WRDSF_ERROR |
-		       WRDSF_SHOWERR);
+	inenv[0] = "map";
+	inenv[1] = map;
+	inenv[2] = "key";
+	inenv[4] = NULL;
+	for (i = 0; i < n; i++) {
+		inenv[3] = keys[i];
+		np = index_lookup(&rp->keys, keys[i], strlen(keys[i]));
+		if (np)
+			write_reply(str, &db->positive_reply, inenv,
+				    np->entry->dn, np->entry->valv,
+				    db->conf.joinstr);
+		else
+			write_reply(str, &db->negative_reply, inenv,
+				    NULL, NULL, NULL);
+	}
+	pthread_mutex_unlock(&rp->mutex);
+
+	rc = smap_stream_flush(str)
+		|| smap_stream_size(str, &size)
+		|| smap_stream_ioctl(str, SMAP_IOCTL_GET_BUFFER, &buf);
+	/* Nothing has been sent yet if formatting failed, so the query
+	   can still be passed to the server */
+	if (rc == 0)
+		smap_stream_write(ostr, buf, size, NULL);
+	smap_stream_destroy(&str);
+	return rc ? -1 : 0;
+}
+
+static void
+replica_free(struct ldap_replica *rp)
+{
+	struct replica_node *np;
+	size_t i;
+
+	for (i = 0; i < rp->ids.size; i++)
+		for (np = rp->ids.tab[i]; np; np = np->next)
+			replica_entry_free(rp, np->entry);
+	index_free(&rp->ids);
+	index_free(&rp->keys);
+#ifdef MOD_LDAP_SYNC
+	/* Only the cookie belongs to the synchronization state */
+	rp->ls.ls_base = NULL;
+	rp->ls.ls_filter = NULL;
+	rp->ls.ls_attrs = NULL;
+	rp->ls.ls_ld = NULL;
+	ldap_sync_destroy(&rp->ls, 0);
+#endif
+	pthread_cond_destroy(&rp->cond);
+	pthread_mutex_destroy(&rp->mutex);
+	free(rp);
+}
+
+/* Create the replica of DB and start loading it */
+static void
+replica_start(struct ldap_db *db)
+{
+	struct ldap_replica *rp;
+	int rc;
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp) {
+		smap_error("not enough memory");
+		return;
+	}
+	rp->db = db;
+	pthread_mutex_init(&rp->mutex, NULL);
+	pthread_cond_init(&rp->cond, NULL);
+	rp->keys.fold = 1;
+	rp->filter = db->conf.replica_filter
+		     ? db->conf.replica_filter : dfl_replica_filter;
+#ifdef MOD_LDAP_SYNC
+	rp->sync = 1;
+	ldap_sync_initialize(&rp->ls);
+	rp->ls.ls_base = db->conf.base;
+	rp->ls.ls_scope = LDAP_SCOPE_SUBTREE;
+	rp->ls.ls_filter = rp->filter;
+	rp->ls.ls_attrs = db->conf.attrs;
+	/* Check for the stop request every second */
+	rp->ls.ls_timeout = 1;
+	rp->ls.ls_search_entry = sync_search_entry;
+	rp->ls.ls_search_reference = sync_search_reference;
+	rp->ls.ls_intermediate = sync_intermediate;
+	rp->ls.ls_search_result = sync_search_result;
+	rp->ls.ls_private = rp;
+#endif
+
+	rc = pthread_create(&rp->tid, NULL, replica_thread, rp);
 	if (rc) {
-		smap_error("cannot format reply");
-		wordsplit_free(&ws);
-		return 1;
+		smap_error("LDAP replica: cannot create thread: %s",
+			   strerror(rc));
+		replica_free(rp);
+		return;
 	}
+	db->replica = rp;
+}
+
+/* Stop the replica of DB and free it */
+static void
+replica_stop(struct ldap_db *db)
+{
+	struct ldap_replica *rp = db->replica;
+
+	if (!rp)
+		return;
+	db->replica = NULL;
+
+	pthread_mutex_lock(&rp->mutex);
+	rp->stop = 1;
+	pthread_cond_signal(&rp->cond);
+	pthread_mutex_unlock(&rp->mutex);
+	pthread_join(rp->tid, NULL);
+	replica_free(rp);
+}
+
+/* Expand the filter template for the variables in INENV.  Return the
+   filter in allocated memory, or NULL on error. */
+static char *
+expand_filter(struct ldap_db *db, char const **inenv)
+{
+	struct wordsplit ws;
+	char *filter;
 
- 	smap_debug(dbgid, 1, ("reply: %s", ws.ws_wordv[0]));
-	smap_stream_printf(ostr, "%s\n", ws.ws_wordv[0]);
+	ws.ws_env = (const char **) inenv;
+	ws.ws_error = smap_error;
+	if (wordsplit(db->conf.filter, &ws,
+		      WRDSF_NOSPLIT |
+		      WRDSF_NOCMD |
+		      WRDSF_ENV |
+		      WRDSF_ENV_KV |
+		      WRDSF_ERROR |
+		      WRDSF_SHOWERR))
+		return NULL;
+	filter = strdup(ws.ws_wordv[0]);
+	if (!filter)
+		smap_error("not enough memory");
 	wordsplit_free(&ws);
-	return 0;
+	return filter;
+}
+
+/* Start the search for the entries matching FILTER, returning at most
+   SIZELIMIT of them (0 means no limit).  Return the search message ID
+   in *MSGID.  If the connection to the server is lost, reconnect and
+   try once more. */
+static int
+start_search(struct ldap_db *db, const char *filter, int sizelimit,
+	     ber_int_t *msgid)
+{
+	int rc;
+
+	smap_debug(dbgid, 2, ("using filter %s", filter));
+	if (!db_handle(db))
+		return LDAP_SERVER_DOWN;
+	rc = ldap_search_ext(db->ldap, db->conf.base, LDAP_SCOPE_SUBTREE,
+			     filter, db->conf.attrs, 0,
+			     NULL, NULL, NULL, sizelimit, msgid);
+	if (server_down(rc) && db_reconnect(db))
+		rc = ldap_search_ext(db->ldap, db->conf.base,
+				     LDAP_SCOPE_SUBTREE,
+				     filter, db->conf.attrs, 0,
+				     NULL, NULL, NULL, sizelimit, msgid);
+	if (rc != LDAP_SUCCESS)
+		smap_error("ldap_search_ext: %s", ldap_err2string(rc));
+	return rc;
+}
+
+/* Compute the time to wait for the server: the least of the time left
+   to the query deadline and the configured timeout.  Return NULL if
+   there is no limit.  Set *DEADLINE to 1 if the limit is imposed by
+   the deadline. */
+static struct timeval *
+wait_time(struct ldap_db *db, struct smap_conninfo const *conninfo,
+	  struct timeval *tv, int *deadline)
+{
+	long left = smap_deadline_left(conninfo);
+	long ms = db->conf.timeout * 1000;
+
+	*deadline = left >= 0 && (ms == 0 || left <= ms);
+	if (*deadline)
+		ms = left;
+	else if (ms == 0)
+		return NULL;
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+	return tv;
+}
+
+/* Return the result code of the search result RES.  A missing base
+   object means that nothing was found and is not an error.  Neither is
+   LDAP_SIZELIMIT_EXCEEDED, which is returned as is. */
+static int
+search_error(LDAP *ld, LDAPMessage *res)
+{
+	int rc, err;
+
+	rc = ldap_parse_result(ld, res, &err, NULL, NULL, NULL, NULL, 0);
+	if (rc != LDAP_SUCCESS)
+		err = rc;
+	switch (err) {
+	case LDAP_NO_SUCH_OBJECT:
+		err = LDAP_SUCCESS;
+	case LDAP_SUCCESS:
+	case LDAP_SIZELIMIT_EXCEEDED:
+		break;
+	default:
+		smap_error("LDAP search failed: %s", ldap_err2string(err));
+	}
+	return err;
+}
+
+/* Read the messages of the search MSGID that arrive within the time
+   TVP (no limit if NULL), skipping references and intermediate
+   responses, until the first entry or the final search result.  Upon
+   an entry, abandon the rest of the search.  Messages of other
+   searches stay queued in the session handle LD, so any number of
+   searches may be in progress on it at once.
+
+   Return the type of the message, stored in *RES, 0 if none arrived
+   in time, and -1 on error. */
+static int
+search_next(LDAP *ld, ber_int_t msgid, struct timeval *tvp,
+	    LDAPMessage **res)
+{
+	int rc;
+
+	while ((rc = ldap_result(ld, msgid, LDAP_MSG_ONE, tvp, res))
+	       == LDAP_RES_SEARCH_REFERENCE
+	       || rc == LDAP_RES_INTERMEDIATE)
+		ldap_msgfree(*res);
+	if (rc == LDAP_RES_SEARCH_ENTRY)
+		ldap_abandon_ext(ld, msgid, NULL, NULL);
+	return rc;
+}
+
+/* Search for the entries matching FILTER, at most SIZELIMIT of them,
+   and wait for the result until the query deadline or timeout.  If
+   ALL is LDAP_MSG_ALL, wait for the complete result.  If it is
+   LDAP_MSG_ONE, return as soon as the first entry arrives and abandon
+   the rest of the search.  If the connection to the server turns out
+   to be lost, reconnect and search once more.
+
+   Return 1 and store the result in *RES on success.  For LDAP_MSG_ONE,
+   it is either the first entry or, if nothing was found, the final
+   search result.  Return 0 if the deadline expired and -1 on error. */
+static int
+search_wait(struct ldap_db *db, const char *filter, int sizelimit,
+	    int all, struct smap_conninfo const *conninfo,
+	    LDAPMessage **res)
+{
+	struct timeval tv, *tvp;
+	ber_int_t msgid;
+	int attempt, deadline, rc;
+
+	for (attempt = 0;; attempt++) {
+		if (smap_deadline_left(conninfo) == 0)
+			return 0;
+		if (!db_handle(db))
+			return -1;
+		rc = ldap_search_ext(db->ldap, db->conf.base,
+				     LDAP_SCOPE_SUBTREE,
+				     filter, db->conf.attrs, 0,
+				     NULL, NULL, NULL, sizelimit, &msgid);
+		if (rc == LDAP_SUCCESS) {
+			tvp = wait_time(db, conninfo, &tv, &deadline);
+			if (all == LDAP_MSG_ONE)
+				rc = search_next(db->ldap, msgid, tvp, res);
+			else
+				rc = ldap_result(db->ldap, msgid, all, tvp,
+						 res);
+			if (rc > 0)
+				return 1;
+			if (rc == 0) {
+				ldap_abandon_ext(db->ldap, msgid, NULL, NULL);
+				if (deadline)
+					return 0;
+				smap_error("LDAP search timed out");
+				return -1;
+			}
+			rc = ldap_errcode(db->ldap);
+			smap_error("ldap_result: %s", ldap_err2string(rc));
+		} else
+			smap_error("ldap_search_ext: %s", ldap_err2string(rc));
+		if (attempt || !server_down(rc) || !db_reconnect(db))
+			return -1;
+	}
+}
+
+/* Send the reply for the search result RES, obtained from the session
+   handle LD, and free it */
+static int
+send_result(struct ldap_db *db, LDAP *ld, smap_stream_t ostr,
+	    char const **inenv, LDAPMessage *res)
+{
+	LDAPMessage *msg;
+	int rc;
+
+	msg = ldap_first_entry(ld, res);
+	if (!msg) {
+		rc = search_error(ld, res);
+		ldap_msgfree(res);
+		if (rc != LDAP_SUCCESS && rc != LDAP_SIZELIMIT_EXCEEDED)
+			return send_reply(ostr, &db->onerror_reply, inenv,
+					  NULL, NULL, NULL);
+		return send_reply(ostr, &db->negative_reply, inenv,
+				  NULL, NULL, NULL);
+	}
+
+	rc = send_reply(ostr, &db->positive_reply, inenv, ld, msg, db);
+	ldap_msgfree(res);
+	return rc;
 }
 
 static int
@@ -989,69 +2630,475 @@ mod_ldap_query(smap_database_t dbp,
 {
 	struct ldap_db *db = (struct ldap_db *) dbp;
 	char const *inenv[5];
-	char **env;
-	char **attrs;
-	struct wordsplit ws;
-	ber_int_t msgid;
+	char *filter;
 	int rc;
-	char *reply = NULL;
-	LDAPMessage *res, *msg;
-
-# define __smap_s_cat2__(a,b) a ## b
-# define REPLY(d,s) \
-	((d)->conf.__smap_s_cat2__(s,_reply)				\
-	 ? (d)->conf.__smap_s_cat2__(s,_reply)				\
-	 : __smap_s_cat3__(dfl_,s,_reply))
+	LDAPMessage *res;
 
-	
 	inenv[0] = "map";
 	inenv[1] = map;
 	inenv[2] = "key";
 	inenv[3] = key;
 	inenv[4] = NULL;
 
+	if (replica_query(db, ostr, map, &key, 1) == 0)
+		return 0;
+
+	filter = expand_filter(db, inenv);
+	if (!filter)
+		return 1;
+	rc = search_wait(db, filter, db->conf.size_limit, LDAP_MSG_ONE,
+			 conninfo, &res);
+	free(filter);
+	if (rc == 0) {
+		smap_debug(dbgid, 1, ("query deadline expired"));
+		return send_reply(ostr, &deadline_reply, inenv,
+				  NULL, NULL, NULL);
+	}
+	if (rc < 0)
+		return send_reply(ostr, &db->onerror_reply, inenv,
+				  NULL, NULL, NULL);
+	return send_result(db, db->ldap, ostr, inenv, res);
+}
+
+/* Batch queries */
+
+/* Build the filter matching any of the N KEYS in MAP.  It is a
+   disjunction of the filters for each key. */
+static char *
+batch_filter(struct ldap_db *db, const char *map,
+	     const char **keys, size_t n)
+{
+	struct wordsplit ws;
+	char const *inenv[5];
+	char *filter, *p;
+	size_t i, len, size;
+	int paren;
+
+	filter = malloc(size = 64);
+	if (!filter) {
+		smap_error("not enough memory");
+		return NULL;
+	}
+	strcpy(filter, "(|");
+	len = 2;
+
+	inenv[0] = "map";
+	inenv[1] = map;
+	inenv[2] = "key";
+	inenv[4] = NULL;
 	ws.ws_env = (const char **) inenv;
 	ws.ws_error = smap_error;
-	rc = wordsplit(db->conf.filter, &ws,
-		       WRDSF_NOSPLIT |
-		       WRDSF_NOCMD |
-		       WRDSF_ENV |
-		       WRDSF_ENV_KV |
-		       WRDSF_ERROR |
-		       WRDSF_SHOWERR);
-	if (rc)
+	for (i = 0; i < n; i++) {
+		size_t flen;
+
+		inenv[3] = keys[i];
+		if (wordsplit(db->conf.filter, &ws,
+			      WRDSF_NOSPLIT |
+			      WRDSF_NOCMD |
+			      WRDSF_ENV |
+			      WRDSF_ENV_KV |
+			      WRDSF_ERROR |
+			      WRDSF_SHOWERR)) {
+			free(filter);
+			return NULL;
+		}
+		flen = strlen(ws.ws_wordv[0]);
+		if (len + flen + 4 > size) {
+			while (len + flen + 4 > size)
+				size *= 2;
+			p = realloc(filter, size);
+			if (!p) {
+				smap_error("not enough memory");
+				wordsplit_free(&ws);
+				free(filter);
+				return NULL;
+			}
+			filter = p;
+		}
+		/* A filter may lack the enclosing parentheses */
+		paren = ws.ws_wordv[0][0] != '(';
+		if (paren)
+			filter[len++] = '(';
+		memcpy(filter + len, ws.ws_wordv[0], flen);
+		len += flen;
+		if (paren)
+			filter[len++] = ')';
+		wordsplit_free(&ws);
+	}
+	filter[len++] = ')';
+	filter[len] = 0;
+	return filter;
+}
+
+/* Return 1 if the entry MSG has the key attribute equal to KEY */
+static int
+entry_matches(struct ldap_db *db, LDAPMessage *msg, const char *key)
+{
+	struct berval **values;
+	size_t len = strlen(key);
+	int i, rc = 0;
+
+	values = ldap_get_values_len(db->ldap, msg, db->conf.keyattr);
+	if (!values)
+		return 0;
+	for (i = 0; values[i]; i++)
+		if (values[i]->bv_len == len
+		    && strncasecmp(values[i]->bv_val, key, len) == 0) {
+			rc = 1;
+			break;
+		}
+	ldap_value_free_len(values);
+	return rc;
+}
+
+/* Look up the N KEYS in MAP by a separate search for each key.  The
+   searches are all sent at once over the same connection, and their
+   results are collected as they arrive.  The replies are sent in the
+   order of KEYS. */
+static int
+batch_multiplex(struct ldap_db *db, smap_stream_t ostr,
+		const char *map, const char **keys, size_t n,
+		struct smap_conninfo const *conninfo)
+{
+	struct batch_search {
+		ber_int_t msgid;
+		int rc;                   /* Message type, 0 while waiting */
+		LDAPMessage *res;
+	} *sv;
+	struct reply_template *reply = &db->onerror_reply;
+	struct timeval zero = { 0, 0 }, tv, *tvp;
+	char const *inenv[5];
+	char *filter;
+	LDAP *ld = NULL;
+	size_t i, first, left;
+	int deadline = 0, rc = LDAP_SUCCESS;
+
+	sv = calloc(n, sizeof(sv[0]));
+	if (!sv) {
+		smap_error("not enough memory");
 		return 1;
+	}
+	inenv[0] = "map";
+	inenv[1] = map;
+	inenv[2] = "key";
+	inenv[4] = NULL;
 
-	smap_debug(dbgid, 2, ("using filter %s", ws.ws_wordv[0]));
-	rc = ldap_search_ext(db->ldap, db->conf.base, LDAP_SCOPE_SUBTREE,
-			     ws.ws_wordv[0], db->conf.attrs, 0,
-			     NULL, NULL, NULL, -1, &msgid);
+	for (i = 0; i < n; i++) {
+		inenv[3] = keys[i];
+		filter = expand_filter(db, inenv);
+		if (!filter)
+			break;
+		if (i == 0) {
+			/* This one reconnects if need be */
+			rc = start_search(db, filter, db->conf.size_limit,
+					  &sv[i].msgid);
+			ld = db->ldap;
+		} else {
+			smap_debug(dbgid, 2, ("using filter %s", filter));
+			rc = ldap_search_ext(ld, db->conf.base,
+					     LDAP_SCOPE_SUBTREE,
+					     filter, db->conf.attrs, 0,
+					     NULL, NULL, NULL,
+					     db->conf.size_limit,
+					     &sv[i].msgid);
+			if (rc != LDAP_SUCCESS)
+				smap_error("ldap_search_ext: %s",
+					   ldap_err2string(rc));
+		}
+		free(filter);
+		if (rc != LDAP_SUCCESS)
+			break;
+	}
+	if (i < n) {
+		while (i-- > 0)
+			ldap_abandon_ext(ld, sv[i].msgid, NULL, NULL);
+		free(sv);
+		return 1;
+	}
 
-	if (rc != LDAP_SUCCESS)	{
-		smap_error("ldap_search_ext: %s", ldap_err2string(rc));
-		return send_reply(ostr, REPLY(db, onerror), inenv, NULL, NULL);
+	left = n;
+	first = 0;
+	while (left > 0) {
+		/* Collect the results that have already arrived */
+		for (i = first; i < n; i++) {
+			if (sv[i].rc)
+				continue;
+			rc = sv[i].rc = search_next(ld, sv[i].msgid, &zero,
+						    &sv[i].res);
+			if (rc < 0)
+				break;
+			if (rc > 0)
+				left--;
+		}
+		if (rc < 0 || left == 0)
+			break;
+		/* Wait for the first search still in progress */
+		while (sv[first].rc)
+			first++;
+		tvp = wait_time(db, conninfo, &tv, &deadline);
+		rc = sv[first].rc = search_next(ld, sv[first].msgid, tvp,
+						&sv[first].res);
+		if (rc <= 0)
+			break;
+		left--;
 	}
 
-	rc = ldap_result(db->ldap, msgid, LDAP_MSG_ALL, NULL, &res);
 	if (rc < 0) {
+		rc = ldap_errcode(ld);
 		smap_error("ldap_result: %s", ldap_err2string(rc));
-		return send_reply(ostr, REPLY(db, onerror), inenv, NULL, NULL);
+		/* Let the next query reconnect */
+		if (server_down(rc) && ld == db->ldap)
+			conn_invalidate(db->conn, db->gen);
+	} else if (left > 0) {
+		if (deadline) {
+			smap_debug(dbgid, 1, ("query deadline expired"));
+			reply = &deadline_reply;
+		} else
+			smap_error("LDAP search timed out");
 	}
 
-	msg = ldap_first_entry(db->ldap, res);
-	if (!msg) {
+	for (i = 0, rc = 0; i < n; i++) {
+		inenv[3] = keys[i];
+		if (sv[i].rc > 0) {
+			if (rc == 0)
+				rc = send_result(db, ld, ostr, inenv,
+						 sv[i].res);
+			else
+				ldap_msgfree(sv[i].res);
+		} else {
+			if (sv[i].rc == 0)
+				ldap_abandon_ext(ld, sv[i].msgid, NULL, NULL);
+			if (rc == 0)
+				rc = send_reply(ostr, reply, inenv,
+						NULL, NULL, NULL);
+		}
+	}
+	free(sv);
+	return rc;
+}
+
+static int
+mod_ldap_query_batch(smap_database_t dbp,
+		     smap_stream_t ostr,
+		     const char *map, const char **keys, size_t n,
+		     struct smap_conninfo const *conninfo)
+{
+	struct ldap_db *db = (struct ldap_db *) dbp;
+	char const *inenv[5];
+	struct reply_template *reply = NULL;
+	char *filter;
+	LDAPMessage *res = NULL, *msg;
+	size_t i;
+	int rc;
+
+	if (replica_query(db, ostr, map, keys, n) == 0)
+		return 0;
+	if (!db->conf.keyattr)
+		return batch_multiplex(db, ostr, map, keys, n, conninfo);
+
+	filter = batch_filter(db, map, keys, n);
+	if (!filter)
+		return 1;
+	rc = search_wait(db, filter, (int) (db->conf.size_limit * n),
+			 LDAP_MSG_ALL, conninfo, &res);
+	free(filter);
+	if (rc == 0) {
+		smap_debug(dbgid, 1, ("query deadline expired"));
+		reply = &deadline_reply;
+	} else if (rc < 0)
+		reply = &db->onerror_reply;
+	else {
+		rc = search_error(db->ldap, res);
+		if (rc == LDAP_SIZELIMIT_EXCEEDED) {
+			/* Entries of some keys may be missing.  Search
+			   for each key separately. */
+			smap_debug(dbgid, 1, ("size limit exceeded"));
+			ldap_msgfree(res);
+			return batch_multiplex(db, ostr, map, keys, n,
+					       conninfo);
+		} else if (rc != LDAP_SUCCESS)
+			reply = &db->onerror_reply;
+	}
+
+	inenv[0] = "map";
+	inenv[1] = map;
+	inenv[2] = "key";
+	inenv[4] = NULL;
+	for (i = 0, rc = 0; rc == 0 && i < n; i++) {
+		inenv[3] = keys[i];
+		if (reply) {
+			rc = send_reply(ostr, reply, inenv, NULL, NULL, NULL);
+			continue;
+		}
+		for (msg = ldap_first_entry(db->ldap, res); msg;
+		     msg = ldap_next_entry(db->ldap, msg))
+			if (entry_matches(db, msg, keys[i]))
+				break;
+		if (msg)
+			rc = send_reply(ostr, &db->positive_reply, inenv,
+					db->ldap, msg, db);
+		else
+			rc = send_reply(ostr, &db->negative_reply, inenv,
+					NULL, NULL, NULL);
+	}
+	if (res)
 		ldap_msgfree(res);
-		return send_reply(ostr, REPLY(db, negative), inenv, NULL, NULL);
+	return rc;
+}
+
+/* Asynchronous queries */
+
+struct ldap_query {
+	struct ldap_db *db;
+	LDAP *ld;                 /* Session handle the search was sent to,
+				     referenced by the query */
+	ber_int_t msgid;
+	int local;                /* Look up in the replica */
+	int rc;                   /* Type of RES, 0 while waiting */
+	LDAPMessage *res;         /* First entry or the search result */
+	char *map;
+	char *key;
+	char const *inenv[5];
+};
+
+static void
+ldap_query_free(struct ldap_query *qp)
+{
+	if (qp->res)
+		ldap_msgfree(qp->res);
+	if (qp->ld)
+		conn_unref(qp->db->conn, qp->ld);
+	free(qp->map);
+	free(qp->key);
+	free(qp);
+}
+
+static smap_query_t
+mod_ldap_query_submit(smap_database_t dbp,
+		      const char *map, const char *key,
+		      struct smap_conninfo const *conninfo)
+{
+	struct ldap_db *db = (struct ldap_db *) dbp;
+	struct ldap_query *qp;
+	char *filter;
+	int rc;
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp
+	    || (qp->map = strdup(map)) == NULL
+	    || (qp->key = strdup(key)) == NULL) {
+		smap_error("not enough memory");
+		if (qp)
+			ldap_query_free(qp);
+		return NULL;
+	}
+	qp->db = db;
+	qp->inenv[0] = "map";
+	qp->inenv[1] = qp->map;
+	qp->inenv[2] = "key";
+	qp->inenv[3] = qp->key;
+	qp->inenv[4] = NULL;
+
+	if (replica_ready(db)) {
+		qp->local = 1;
+		return (smap_query_t) qp;
 	}
 
-	rc = send_reply(ostr, REPLY(db, positive), inenv, msg, db);
-	ldap_msgfree(res);
+	filter = expand_filter(db, qp->inenv);
+	if (!filter) {
+		ldap_query_free(qp);
+		return NULL;
+	}
+	rc = start_search(db, filter, db->conf.size_limit, &qp->msgid);
+	free(filter);
+	if (rc != LDAP_SUCCESS) {
+		ldap_query_free(qp);
+		return NULL;
+	}
+	/* Keep the handle until the query is finished, even if the
+	   database switches to another one meanwhile */
+	qp->ld = db->ldap;
+	conn_ref(db->conn, qp->ld);
+	return (smap_query_t) qp;
+}
+
+static int
+mod_ldap_query_fd(smap_query_t q, int *events)
+{
+	struct ldap_query *qp = (struct ldap_query *) q;
+	struct timeval zero = { 0, 0 };
+	int fd;
+
+	if (qp->local) {
+		*events = 0;
+		return -1;
+	}
+	/* The result may have already been read from the connection
+	   along with those of other searches.  Then there is nothing to
+	   wait for. */
+	if (qp->rc == 0)
+		qp->rc = search_next(qp->ld, qp->msgid, &zero, &qp->res);
+	if (qp->rc == 0
+	    && ldap_get_option(qp->ld, LDAP_OPT_DESC, &fd)
+	       == LDAP_OPT_SUCCESS) {
+		*events = POLLIN;
+		return fd;
+	}
+	*events = 0;
+	return -1;
+}
+
+static int
+mod_ldap_query_complete(smap_query_t q, int revents, smap_stream_t ostr)
+{
+	struct ldap_query *qp = (struct ldap_query *) q;
+	struct ldap_db *db = qp->db;
+	struct timeval zero = { 0, 0 };
+	int rc;
+
+	if (qp->local) {
+		if (replica_query(db, ostr, qp->map,
+				  (const char **) &qp->key, 1))
+			rc = send_reply(ostr, &db->onerror_reply, qp->inenv,
+					NULL, NULL, NULL);
+		else
+			rc = 0;
+		ldap_query_free(qp);
+		return rc;
+	}
+	if (qp->rc == 0)
+		qp->rc = search_next(qp->ld, qp->msgid, &zero, &qp->res);
+	if (qp->rc == 0)
+		return SMAP_QUERY_PENDING;
+	if (qp->rc < 0) {
+		rc = ldap_errcode(qp->ld);
+		smap_error("ldap_result: %s", ldap_err2string(rc));
+		/* Let the next query reconnect */
+		if (server_down(rc) && qp->ld == db->ldap)
+			conn_invalidate(db->conn, db->gen);
+		rc = send_reply(ostr, &db->onerror_reply, qp->inenv,
+				NULL, NULL, NULL);
+	} else {
+		rc = send_result(db, qp->ld, ostr, qp->inenv, qp->res);
+		qp->res = NULL;
+	}
+	ldap_query_free(qp);
 	return rc;
 }
 
+static void
+mod_ldap_query_cancel(smap_query_t q)
+{
+	struct ldap_query *qp = (struct ldap_query *) q;
+
+	if (!qp->local && qp->rc == 0)
+		ldap_abandon_ext(qp->ld, qp->msgid, NULL, NULL);
+	ldap_query_free(qp);
+}
+
 struct smap_module SMAP_EXPORT(ldap, module) = {
 	SMAP_MODULE_VERSION,
-	SMAP_CAPA_DEFAULT,
+	SMAP_CAPA_DEFAULT|SMAP_CAPA_THREADSAFE|SMAP_CAPA_ASYNC|SMAP_CAPA_BATCH,
 	mod_ldap_init,
 	mod_ldap_init_db,
 	mod_ldap_free_db,
@@ -1059,5 +3106,14 @@ struct smap_module SMAP_EXPORT(ldap, module) = {
 	mod_ldap_close,
 	mod_ldap_query,
 	NULL, /* smap_xform */
+	mod_ldap_query_submit,
+	mod_ldap_query_fd,
+	mod_ldap_query_complete,
+	mod_ldap_query_cancel,
+	mod_ldap_query_batch,
+	mod_ldap_ping,
+	NULL, /* smap_notify_fd */
+	NULL, /* smap_notify_read */
+	mod_ldap_uses_conninfo
 };
 
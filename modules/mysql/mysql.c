@@ -19,10 +19,13 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <regex.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <mysql/mysql.h>
 #include <smap/diag.h>
@@ -34,10 +37,25 @@
 #define MDB_OPEN  0x01
 #define MDB_DEFDB 0x02
 
+/* MariaDB client library provides non-blocking API, which is used
+   to implement asynchronous queries. */
+#ifdef MYSQL_WAIT_READ
+# define MOD_MYSQL_ASYNC 1
+#endif
+
+/* MySQL 8.0 dropped the my_bool type in favor of bool */
+#if !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) \
+    && MYSQL_VERSION_ID >= 80000
+typedef bool my_bool;
+#endif
+
+struct mod_mysql_stmt;
+
 struct mod_mysql_db {
 	int flags;
 	unsigned refcnt;
 	MYSQL mysql;
+	unsigned long gen;          /* Incremented on each connect */
 	const char *name;
 	char *config_file;
 	char *config_group;
@@ -48,14 +66,25 @@ struct mod_mysql_db {
 	char *database;
 	long port;
 	char *socket;
+	long read_timeout;
+	long write_timeout;
 	char *template;
+	char *batch_template;
 	char *positive_reply;
 	char *negative_reply;
 	char *onerror_reply;
+	int prepare;
+	struct mod_mysql_stmt *stmt;/* Compiled query template */
+	int single_row;             /* Fetch only the first row */
+	int auto_limit;             /* Add LIMIT clause to the query */
 };
 
 static size_t dbgid;
 static struct mod_mysql_db def_db;
+/* Databases using the default connection may be queried from different
+   threads (see SMAP_CAPA_THREADSAFE).  This mutex serializes access
+   to that connection. */
+static pthread_mutex_t def_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static MYSQL *
 moddb_handle(struct mod_mysql_db *db)
@@ -65,6 +94,20 @@ moddb_handle(struct mod_mysql_db *db)
 	return &db->mysql;
 }
 
+static void
+defdb_lock(struct mod_mysql_db *db)
+{
+	if (db->flags & MDB_DEFDB)
+		pthread_mutex_lock(&def_db_mutex);
+}
+
+static void
+defdb_unlock(struct mod_mysql_db *db)
+{
+	if (db->flags & MDB_DEFDB)
+		pthread_mutex_unlock(&def_db_mutex);
+}
+
 static const char *
 moddb_positive_reply(struct mod_mysql_db *db)
 {
@@ -113,6 +156,18 @@ opendb(struct mod_mysql_db *db)
 		mysql_ssl_set (&db->mysql, NULL, NULL, db->ssl_ca,
 			       NULL, NULL);
 
+	if (db->read_timeout) {
+		unsigned int t = db->read_timeout;
+		mysql_options(&db->mysql, MYSQL_OPT_READ_TIMEOUT, &t);
+	}
+	if (db->write_timeout) {
+		unsigned int t = db->write_timeout;
+		mysql_options(&db->mysql, MYSQL_OPT_WRITE_TIMEOUT, &t);
+	}
+#ifdef MOD_MYSQL_ASYNC
+	mysql_options(&db->mysql, MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 	if (!mysql_real_connect(&db->mysql,
 				db->host,
 				db->user,
@@ -127,6 +182,7 @@ opendb(struct mod_mysql_db *db)
 	}
 	db->refcnt++;
 	db->flags |= MDB_OPEN;
+	db->gen++;
 	return 0;
 }
 
@@ -151,6 +207,7 @@ freedb(struct mod_mysql_db *db)
 	free(db->database);
 	free(db->socket);
 	free(db->template);
+	free(db->batch_template);
 	free(db->positive_reply);
 	free(db->negative_reply);
 	free(db->onerror_reply);
@@ -167,10 +224,357 @@ dbdeclared(struct mod_mysql_db *db)
 	       db->password ||
 	       db->database ||
 	       db->port ||
-	       db->socket;
+	       db->socket ||
+	       db->read_timeout ||
+	       db->write_timeout;
+}
+
+
+
+/* Prepared statements */
+
+#define STMT_BUFSIZE 256
+
+/* Variables that may be referenced in the query template */
+static char *query_vartab[] = { "map", "key", "src", "dst" };
+#define QUERY_VAR_COUNT (sizeof(query_vartab) / sizeof(query_vartab[0]))
+
+/* Query template compiled into a prepared statement.  The statement
+   text is built once, when the database is initialized.  It is prepared
+   on the connection when first used, and prepared anew after the
+   connection has been reestablished. */
+struct mod_mysql_stmt {
+	char *text;                 /* Statement text */
+	unsigned nparam;            /* Number of placeholders */
+	int *param;                 /* Variable index for each placeholder */
+	MYSQL_BIND *pbind;          /* Parameter bindings */
+	unsigned long *plen;        /* Parameter lengths */
+	MYSQL_STMT *handle;         /* Prepared statement or NULL */
+	unsigned long gen;          /* Connection generation it belongs to */
+	MYSQL_RES *meta;            /* Result metadata */
+	unsigned nfld;              /* Number of result columns */
+	MYSQL_BIND *rbind;          /* Result bindings */
+	unsigned long *rlen;        /* Lengths of result values */
+	my_bool *rnull;             /* NULL indicators */
+	char **row;                 /* Current result row */
+};
+
+static int
+query_var_lookup(const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < QUERY_VAR_COUNT; i++)
+		if (strlen(query_vartab[i]) == len
+		    && memcmp(query_vartab[i], name, len) == 0)
+			return i;
+	return -1;
+}
+
+static void
+stmt_close(struct mod_mysql_stmt *st)
+{
+	unsigned i;
+
+	if (st->meta) {
+		mysql_free_result(st->meta);
+		st->meta = NULL;
+	}
+	if (st->handle) {
+		mysql_stmt_close(st->handle);
+		st->handle = NULL;
+	}
+	if (st->rbind) {
+		for (i = 0; i < st->nfld; i++)
+			free(st->rbind[i].buffer);
+		free(st->rbind);
+		st->rbind = NULL;
+	}
+	free(st->rlen);
+	st->rlen = NULL;
+	free(st->rnull);
+	st->rnull = NULL;
+	free(st->row);
+	st->row = NULL;
+	st->nfld = 0;
+	st->gen = 0;
+}
+
+static void
+stmt_free(struct mod_mysql_stmt *st)
+{
+	if (!st)
+		return;
+	stmt_close(st);
+	free(st->text);
+	free(st->param);
+	free(st->pbind);
+	free(st->plen);
+	free(st);
+}
+
+/* Compile the query TEMPLATE of the database DBID.  Each reference to
+   a query variable is replaced with a placeholder.  A reference that
+   makes up a quoted string literal is replaced along with the quotes,
+   e.g. '$key' becomes ?. */
+static struct mod_mysql_stmt *
+stmt_compile(const char *dbid, const char *template)
+{
+	struct mod_mysql_stmt *st;
+	size_t len = strlen(template);
+	const char *p;
+	char *q;
+	int quote = 0;
+	char *qstart = NULL;
+
+	st = calloc(1, sizeof(*st));
+	if (!st
+	    || (st->text = malloc(len + 1)) == NULL
+	    || (st->param = calloc(len / 2 + 1, sizeof(st->param[0])))
+	         == NULL) {
+		smap_error("%s: not enough memory", dbid);
+		stmt_free(st);
+		return NULL;
+	}
+
+	for (p = template, q = st->text; *p; ) {
+		const char *name;
+		size_t nlen;
+		int n;
+
+		if (*p == '\\' && p[1]) {
+			*q++ = *p++;
+			*q++ = *p++;
+			continue;
+		}
+		if (quote) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			qstart = q;
+		}
+		if (*p != '$') {
+			*q++ = *p++;
+			continue;
+		}
+
+		if (p[1] == '{') {
+			name = p + 2;
+			nlen = strcspn(name, "}");
+			if (name[nlen] != '}') {
+				smap_error("%s: unterminated variable reference "
+					   "in query", dbid);
+				goto err;
+			}
+			p = name + nlen + 1;
+		} else {
+			name = p + 1;
+			for (nlen = 0;
+			     name[nlen] == '_' || isalnum(name[nlen]);
+			     nlen++)
+				;
+			if (nlen == 0) {
+				*q++ = *p++;
+				continue;
+			}
+			p = name + nlen;
+		}
+
+		n = query_var_lookup(name, nlen);
+		if (n == -1) {
+			smap_error("%s: cannot prepare query: "
+				   "unsupported variable reference %.*s",
+				   dbid, (int) nlen, name);
+			goto err;
+		}
+		if (quote) {
+			if (qstart != q - 1 || *p != quote) {
+				smap_error("%s: cannot prepare query: "
+					   "variable %s is part of a string "
+					   "literal", dbid, query_vartab[n]);
+				goto err;
+			}
+			q = qstart;
+			p++;
+			quote = 0;
+		}
+		*q++ = '?';
+		st->param[st->nparam++] = n;
+	}
+	*q = 0;
+
+	if (st->nparam) {
+		st->pbind = calloc(st->nparam, sizeof(st->pbind[0]));
+		st->plen = calloc(st->nparam, sizeof(st->plen[0]));
+		if (!st->pbind || !st->plen) {
+			smap_error("%s: not enough memory", dbid);
+			goto err;
+		}
+	}
+	smap_debug(dbgid, 1, ("%s: compiled query: %s", dbid, st->text));
+	return st;
+
+err:
+	stmt_free(st);
+	return NULL;
+}
+
+/* Prepare the statement ST of DB on its current connection */
+static int
+stmt_prepare(struct mod_mysql_db *db, struct mod_mysql_stmt *st)
+{
+	MYSQL *mysql = moddb_handle(db);
+	unsigned long gen;
+	unsigned i;
+
+	stmt_close(st);
+	st->gen = (db->flags & MDB_DEFDB) ? def_db.gen : db->gen;
+
+	st->handle = mysql_stmt_init(mysql);
+	if (!st->handle) {
+		smap_error("%s: not enough memory", db->name);
+		return 1;
+	}
+	if (mysql_stmt_prepare(st->handle, st->text, strlen(st->text))) {
+		smap_error("%s: cannot prepare statement: %s",
+			   db->name, mysql_stmt_error(st->handle));
+		smap_error("%s: failed statement: %s", db->name, st->text);
+		goto err;
+	}
+	st->meta = mysql_stmt_result_metadata(st->handle);
+	if (!st->meta) {
+		smap_error("%s: statement returns no result set", db->name);
+		goto err;
+	}
+	st->nfld = mysql_num_fields(st->meta);
+	st->rbind = calloc(st->nfld, sizeof(st->rbind[0]));
+	st->rlen = calloc(st->nfld, sizeof(st->rlen[0]));
+	st->rnull = calloc(st->nfld, sizeof(st->rnull[0]));
+	st->row = calloc(st->nfld, sizeof(st->row[0]));
+	if (!st->rbind || !st->rlen || !st->rnull || !st->row) {
+		smap_error("%s: not enough memory", db->name);
+		goto err;
+	}
+	for (i = 0; i < st->nfld; i++) {
+		st->rbind[i].buffer_type = MYSQL_TYPE_STRING;
+		st->rbind[i].buffer = malloc(STMT_BUFSIZE);
+		if (!st->rbind[i].buffer) {
+			smap_error("%s: not enough memory", db->name);
+			goto err;
+		}
+		st->rbind[i].buffer_length = STMT_BUFSIZE;
+		st->rbind[i].length = &st->rlen[i];
+		st->rbind[i].is_null = &st->rnull[i];
+	}
+	if (mysql_stmt_bind_result(st->handle, st->rbind)) {
+		smap_error("%s: cannot bind result: %s",
+			   db->name, mysql_stmt_error(st->handle));
+		goto err;
+	}
+	smap_debug(dbgid, 1, ("%s: prepared statement", db->name));
+	return 0;
+
+err:
+	gen = st->gen;
+	stmt_close(st);
+	st->gen = gen;
+	return 1;
 }
 
+/* Return the statement of DB, if it can be used for queries */
+static struct mod_mysql_stmt *
+stmt_get(struct mod_mysql_db *db)
+{
+	struct mod_mysql_stmt *st = db->stmt;
+
+	if (!st)
+		return NULL;
+	/* A failed statement is not retried until the next reconnect.
+	   Queries are meanwhile run as text. */
+	if (st->gen != ((db->flags & MDB_DEFDB) ? def_db.gen : db->gen))
+		stmt_prepare(db, st);
+	return st->handle ? st : NULL;
+}
+
+/* Automatic LIMIT clause.  The query is limited to two rows, so that
+   the presence of more than one row can still be detected. */
+
+#define AUTO_LIMIT " LIMIT 2"
 
+static int
+is_keyword(const char *start, const char *p, const char *kw)
+{
+	size_t len = strlen(kw);
+
+	return strncasecmp(p, kw, len) == 0
+		&& !(isalnum(p[len]) || p[len] == '_')
+		&& (p == start
+		    || !(isalnum(p[-1]) || p[-1] == '_'
+			 || p[-1] == '$' || p[-1] == '{'));
+}
+
+/* Append the LIMIT clause to the query template of DB, unless it
+   already has one */
+static int
+add_limit(struct mod_mysql_db *db)
+{
+	const char *template = db->template;
+	const char *p, *end;
+	int quote = 0;
+	int depth = 0;
+	char *q;
+
+	for (p = template; isspace(*p); p++)
+		;
+	if (!is_keyword(template, p, "select")) {
+		smap_error("%s: not adding LIMIT to a query that is not "
+			   "a SELECT", db->name);
+		return 0;
+	}
+
+	/* Strip the trailing semicolon */
+	for (end = p + strlen(p);
+	     end > p && (isspace(end[-1]) || end[-1] == ';');
+	     end--)
+		;
+	
+	for (; p < end; p++) {
+		if (*p == '\\' && p + 1 < end)
+			p++;
+		else if (quote) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '\'' || *p == '"' || *p == '`')
+			quote = *p;
+		else if (*p == '(')
+			depth++;
+		else if (*p == ')') {
+			if (depth > 0)
+				depth--;
+		} else if (*p == ';') {
+			smap_error("%s: not adding LIMIT to a query with "
+				   "several statements", db->name);
+			return 0;
+		} else if (depth == 0 && is_keyword(template, p, "limit"))
+			/* Only a LIMIT of the outer query bounds the
+			   result; those of subqueries do not */
+			return 0;
+	}
+
+	q = malloc(end - template + sizeof(AUTO_LIMIT));
+	if (!q) {
+		smap_error("%s: not enough memory", db->name);
+		return 1;
+	}
+	memcpy(q, template, end - template);
+	strcpy(q + (end - template), AUTO_LIMIT);
+	free(db->template);
+	db->template = q;
+	smap_debug(dbgid, 1, ("%s: query: %s", db->name, q));
+	return 0;
+}
+
 static int
 mod_init(int argc, char **argv)
 {
@@ -195,15 +599,27 @@ mod_init(int argc, char **argv)
 		  &def_db.port },
 		{ SMAP_OPTSTR(socket), smap_opt_string,
 		  &def_db.socket },
+		{ SMAP_OPTSTR(read-timeout), smap_opt_long,
+		  &def_db.read_timeout },
+		{ SMAP_OPTSTR(write-timeout), smap_opt_long,
+		  &def_db.write_timeout },
 		
 		{ SMAP_OPTSTR(query), smap_opt_string,
 		  &def_db.template },
+		{ SMAP_OPTSTR(batch-query), smap_opt_string,
+		  &def_db.batch_template },
 		{ SMAP_OPTSTR(positive-reply), smap_opt_string,
 		  &def_db.positive_reply },
 		{ SMAP_OPTSTR(negative-reply), smap_opt_string,
 		  &def_db.negative_reply },
 		{ SMAP_OPTSTR(onerror-reply), smap_opt_string,
 		  &def_db.onerror_reply },
+		{ SMAP_OPTSTR(prepare), smap_opt_bool,
+		  &def_db.prepare },
+		{ SMAP_OPTSTR(single-row), smap_opt_bool,
+		  &def_db.single_row },
+		{ SMAP_OPTSTR(auto-limit), smap_opt_bool,
+		  &def_db.auto_limit },
 		{ NULL }
 	};
 	dbgid = smap_debug_alloc("mysql");
@@ -211,6 +627,12 @@ mod_init(int argc, char **argv)
 	if (rc)
 		return rc;
 	def_db.flags = 0;
+	/* Initialize the library explicitly, as mysql_init is not
+	   thread-safe otherwise */
+	if (mysql_library_init(0, NULL, NULL)) {
+		smap_error("cannot initialize MySQL library");
+		return 1;
+	}
 	return 0;
 }
 
@@ -222,6 +644,7 @@ mod_init_db(const char *dbid, int argc, char **argv)
 	char *negative_reply = NULL;
 	char *onerror_reply = NULL;
 	char *query = NULL;
+	char *batch_query = NULL;
 	char *config_file = NULL;
 	char *config_group = NULL;
 	char *ssl_ca = NULL;
@@ -231,6 +654,11 @@ mod_init_db(const char *dbid, int argc, char **argv)
 	char *database = NULL;
 	long port = 0;
 	char *socket = NULL;
+	long read_timeout = 0;
+	long write_timeout = 0;
+	int prepare = def_db.prepare;
+	int single_row = def_db.single_row;
+	int auto_limit = def_db.auto_limit;
 	int flags = 0;
 	struct smap_option init_option[] = {
 		{ SMAP_OPTSTR(defaultdb), smap_opt_bitmask,
@@ -253,15 +681,27 @@ mod_init_db(const char *dbid, int argc, char **argv)
 		  &port },
 		{ SMAP_OPTSTR(socket), smap_opt_string,
 		  &socket },
+		{ SMAP_OPTSTR(read-timeout), smap_opt_long,
+		  &read_timeout },
+		{ SMAP_OPTSTR(write-timeout), smap_opt_long,
+		  &write_timeout },
 		
 		{ SMAP_OPTSTR(query), smap_opt_string,
 		  &query },
+		{ SMAP_OPTSTR(batch-query), smap_opt_string,
+		  &batch_query },
 		{ SMAP_OPTSTR(positive-reply), smap_opt_string,
 		  &positive_reply },
 		{ SMAP_OPTSTR(negative-reply), smap_opt_string,
 		  &negative_reply },
 		{ SMAP_OPTSTR(onerror-reply), smap_opt_string,
 		  &onerror_reply },
+		{ SMAP_OPTSTR(prepare), smap_opt_bool,
+		  &prepare },
+		{ SMAP_OPTSTR(single-row), smap_opt_bool,
+		  &single_row },
+		{ SMAP_OPTSTR(auto-limit), smap_opt_bool,
+		  &auto_limit },
 		{ NULL }
 	};
 
@@ -285,14 +725,35 @@ mod_init_db(const char *dbid, int argc, char **argv)
 	db->database = database;
 	db->port = port;
 	db->socket = socket;
+	db->read_timeout = read_timeout;
+	db->write_timeout = write_timeout;
 	db->template = query;
+	db->batch_template = batch_query;
 	db->positive_reply = positive_reply;
 	db->negative_reply = negative_reply;
 	db->onerror_reply = onerror_reply;
+	db->prepare = prepare;
+	db->single_row = single_row;
+	db->auto_limit = auto_limit;
 
 	if (!dbdeclared(db))
 		db->flags |= MDB_DEFDB;
 
+	if (auto_limit && db->template && add_limit(db)) {
+		freedb(db);
+		free(db);
+		return NULL;
+	}
+
+	if (prepare && db->template) {
+		db->stmt = stmt_compile(dbid, db->template);
+		if (!db->stmt) {
+			freedb(db);
+			free(db);
+			return NULL;
+		}
+	}
+
 	return (smap_database_t) db;
 }
 
@@ -300,6 +761,7 @@ static int
 mod_free_db(smap_database_t dbp)
 {
 	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+	stmt_free(db->stmt);
 	freedb(db);
 	free(db);
 	return 0;
@@ -309,21 +771,46 @@ static int
 mod_open(smap_database_t dbp)
 {
 	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+	int rc;
+
+	defdb_lock(db);
 	if (db->flags & MDB_DEFDB)
-		return opendb(&def_db);
-	return opendb(db);
+		rc = opendb(&def_db);
+	else
+		rc = opendb(db);
+	defdb_unlock(db);
+	return rc;
 }
 
 static int
 mod_close(smap_database_t dbp)
 {
 	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+
+	defdb_lock(db);
+	if (db->stmt)
+		stmt_close(db->stmt);
 	if (db->flags & MDB_DEFDB)
 		closedb(&def_db);
 	closedb(db);
+	defdb_unlock(db);
 	return 0;
 }
 
+static int
+mod_ping(smap_database_t dbp)
+{
+	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+	int rc;
+
+	defdb_lock(db);
+	rc = mysql_ping(moddb_handle(db));
+	if (rc)
+		smap_error("%s: %s", db->name, mysql_error(moddb_handle(db)));
+	defdb_unlock(db);
+	return rc;
+}
+
 
 static char *
 format_envar(const char *var, const char *val)
@@ -409,38 +896,64 @@ fill_env(MYSQL *mysql, char **vartab, const char **intab, char ***penv)
 	return rc;
 }
 
-static int
-create_query_env(struct mod_mysql_db *db,
-		 const char *map, const char *key,
-		 struct smap_conninfo const *conninfo,
-		 char ***penv, char ***pqenv)
+/* Fill INTAB with the values of query variables.  The addresses are
+   formatted into SRCBUF and DSTBUF. */
+static void
+query_values(const char *map, const char *key,
+	     struct smap_conninfo const *conninfo,
+	     const char **intab, char *srcbuf, char *dstbuf)
 {
-	static char *vartab[] = { "map", "key", "src", "dst" };
-	static const char *intab[INIT_ENV_SIZE];
 	struct sockaddr_in *s_in;
-	
+
 	intab[0] = map;
 	intab[1] = key;
 	if (conninfo && conninfo->src->sa_family == AF_INET) {
 		s_in = (struct sockaddr_in *)conninfo->src;
-		intab[2] = inet_ntoa(s_in->sin_addr);
+		intab[2] = inet_ntop(AF_INET, &s_in->sin_addr,
+				     srcbuf, INET_ADDRSTRLEN);
 	} else
 		intab[2] = NULL;
 	if (conninfo && conninfo->dst->sa_family == AF_INET) {
 		s_in = (struct sockaddr_in *)conninfo->dst;
-		intab[3] = inet_ntoa(s_in->sin_addr);
+		intab[3] = inet_ntop(AF_INET, &s_in->sin_addr,
+				     dstbuf, INET_ADDRSTRLEN);
 	} else
 		intab[3] = NULL;
-	
-	if (fill_env(NULL, vartab, intab, penv))
+}
+
+static int
+create_query_env(struct mod_mysql_db *db,
+		 const char *map, const char *key,
+		 struct smap_conninfo const *conninfo,
+		 char ***penv, char ***pqenv)
+{
+	const char *intab[INIT_ENV_SIZE];
+	char srcbuf[INET_ADDRSTRLEN], dstbuf[INET_ADDRSTRLEN];
+
+	query_values(map, key, conninfo, intab, srcbuf, dstbuf);
+	if (fill_env(NULL, query_vartab, intab, penv))
 		return 1;
-	if (fill_env(moddb_handle(db), vartab, intab, pqenv)) {
+	if (fill_env(moddb_handle(db), query_vartab, intab, pqenv)) {
 		free_env(*penv);
 		return 1;
 	}
 	return 0;
 }
 	
+/* Expand the query TEMPLATE into WS->ws_wordv[0] */
+static int
+format_query(const char *template, char **env, struct wordsplit *ws)
+{
+	ws->ws_env = (const char **) env;
+	ws->ws_error = smap_error;
+	return wordsplit(template, ws,
+			 WRDSF_NOSPLIT |
+			 WRDSF_NOCMD |
+			 WRDSF_ENV |
+			 WRDSF_ERROR |
+			 WRDSF_SHOWERR);
+}
+
 static int
 do_query(struct mod_mysql_db *db, char **env, MYSQL_RES **pres)
 {
@@ -448,15 +961,7 @@ do_query(struct mod_mysql_db *db, char **env, MYSQL_RES **pres)
 	int rc;
 	MYSQL *mysql = moddb_handle(db);
 	
-	ws.ws_env = (const char **) env;
-	ws.ws_error = smap_error;
-	rc = wordsplit(db->template, &ws,
-		       WRDSF_NOSPLIT |
-		       WRDSF_NOCMD |
-		       WRDSF_ENV |
-		       WRDSF_ERROR |
-		       WRDSF_SHOWERR);
-	if (rc)
+	if (format_query(db->template, env, &ws))
 		return 1;
 
  	smap_debug(dbgid, 1,
@@ -473,8 +978,13 @@ do_query(struct mod_mysql_db *db, char **env, MYSQL_RES **pres)
 	wordsplit_free(&ws);
 	if (rc)
 		return 1;
-	
-	*pres = mysql_store_result(mysql);
+
+	/* In single row mode, rows are read from the server as needed
+	   instead of being stored in the client memory. */
+	if (db->single_row)
+		*pres = mysql_use_result(mysql);
+	else
+		*pres = mysql_store_result(mysql);
 	return 0;
 }
 
@@ -508,15 +1018,13 @@ static int
 do_positive_reply(struct mod_mysql_db *db, 
 		  smap_stream_t ostr,
 		  char ***penv,
-		  MYSQL_RES *result)
+		  MYSQL_RES *result, MYSQL_ROW row)
 {
 	unsigned nfld;
 	char **env;
 	size_t i, j;
 	MYSQL_FIELD *fields;
-	MYSQL_ROW row;
 	
-	row = mysql_fetch_row(result);
 	nfld = mysql_num_fields(result);
 	
 	env = *penv;
@@ -531,7 +1039,8 @@ do_positive_reply(struct mod_mysql_db *db,
 
 	fields = mysql_fetch_fields(result);
 	for (j = 0; j < nfld; j++) {
-		char *p = format_envar(fields[j].name, row[j]);
+		char *p = format_envar(fields[j].name,
+				       row[j] ? row[j] : "");
 		env[i + j] = p;
 		if (!p) {
 			smap_error("not enough memory");
@@ -549,7 +1058,8 @@ flush_result(struct mod_mysql_db *db)
 {
 	MYSQL *mysql = moddb_handle(db);
 	while (mysql_next_result(mysql) == 0) {
-		MYSQL_RES *result = mysql_store_result(mysql);
+		MYSQL_RES *result = db->single_row ?
+			mysql_use_result(mysql) : mysql_store_result(mysql);
 		if (!result)
 			break;
 		if (mysql_field_count(mysql))
@@ -559,37 +1069,197 @@ flush_result(struct mod_mysql_db *db)
 	}
 }
 
+/* Send the reply for the unbuffered query result RES.  Only the first
+   row is used, the rest are discarded by mysql_free_result. */
 static int
-mod_query(smap_database_t dbp,
-	  smap_stream_t ostr,
-	  const char *map, const char *key,
-	  struct smap_conninfo const *conninfo)
+send_first_row(struct mod_mysql_db *db, smap_stream_t ostr, char ***penv,
+	       MYSQL_RES *res)
+{
+	MYSQL_ROW row = mysql_fetch_row(res);
+	int rc;
+
+	if (!row) {
+		smap_debug(dbgid, 1, ("query returned no rows"));
+		return send_reply(ostr, moddb_negative_reply(db), *penv);
+	}
+	rc = do_positive_reply(db, ostr, penv, res, row);
+	if (mysql_fetch_row(res))
+		smap_error("%s: query returned more than one row", db->name);
+	return rc;
+}
+
+/* Send the reply for the query result RES */
+static int
+send_result(struct mod_mysql_db *db, smap_stream_t ostr, char ***penv,
+	    MYSQL_RES *res)
+{
+	unsigned nrow = mysql_num_rows(res);
+	unsigned ncol = mysql_num_fields(res);
+	
+	smap_debug(dbgid, 1,
+		   ("query returned %u columns in %u rows",
+		    ncol, nrow));
+	if (nrow > 1 && db->single_row)
+		smap_error("%s: query returned more than one row", db->name);
+	if (nrow > 0)
+		return do_positive_reply(db, ostr, penv, res,
+					 mysql_fetch_row(res));
+	return send_reply(ostr, moddb_negative_reply(db), *penv);
+}
+
+/* Execute the prepared statement ST with the query variables VALUES
+   and fetch the first row of its result.  Set *FOUND to 1 if there
+   was one. */
+static int
+stmt_query(struct mod_mysql_db *db, struct mod_mysql_stmt *st,
+	   const char **values, int *found)
+{
+	unsigned i;
+	int rc;
+
+	for (i = 0; i < st->nparam; i++) {
+		const char *val = values[st->param[i]];
+
+		if (!val)
+			val = "";
+		st->plen[i] = strlen(val);
+		st->pbind[i].buffer_type = MYSQL_TYPE_STRING;
+		st->pbind[i].buffer = (void *) val;
+		st->pbind[i].buffer_length = st->plen[i];
+		st->pbind[i].length = &st->plen[i];
+	}
+
+	smap_debug(dbgid, 1, ("executing statement: %s", st->text));
+	if ((st->nparam && mysql_stmt_bind_param(st->handle, st->pbind))
+	    || mysql_stmt_execute(st->handle)) {
+		smap_error("%s: query failed: %s",
+			   db->name, mysql_stmt_error(st->handle));
+		return 1;
+	}
+
+	rc = mysql_stmt_fetch(st->handle);
+	if (rc == 0 || rc == MYSQL_DATA_TRUNCATED) {
+		int rebind = 0;
+
+		for (i = 0; i < st->nfld; i++) {
+			MYSQL_BIND *bp = &st->rbind[i];
+
+			if (st->rnull[i]) {
+				st->row[i] = NULL;
+				continue;
+			}
+			if (st->rlen[i] >= bp->buffer_length) {
+				/* Value did not fit: enlarge the buffer
+				   and fetch the column again */
+				char *p = realloc(bp->buffer, st->rlen[i] + 1);
+				if (!p) {
+					smap_error("not enough memory");
+					rc = 1;
+					break;
+				}
+				bp->buffer = p;
+				bp->buffer_length = st->rlen[i] + 1;
+				if (mysql_stmt_fetch_column(st->handle, bp,
+							    i, 0)) {
+					rc = 1;
+					break;
+				}
+				rebind = 1;
+			}
+			st->row[i] = bp->buffer;
+			st->row[i][st->rlen[i]] = 0;
+		}
+		if (rebind && mysql_stmt_bind_result(st->handle, st->rbind))
+			rc = 1;
+		if (rc == 1)
+			smap_error("%s: cannot fetch result: %s",
+				   db->name, mysql_stmt_error(st->handle));
+		else
+			rc = 0;
+		*found = 1;
+	} else if (rc == MYSQL_NO_DATA) {
+		rc = 0;
+		*found = 0;
+	} else {
+		smap_error("%s: cannot fetch result: %s",
+			   db->name, mysql_stmt_error(st->handle));
+		rc = 1;
+	}
+	/* Discard the rest of the rows */
+	mysql_stmt_free_result(st->handle);
+	return rc;
+}
+
+static int
+stmt_query_db(struct mod_mysql_db *db, struct mod_mysql_stmt *st,
+	      smap_stream_t ostr,
+	      const char *map, const char *key,
+	      struct smap_conninfo const *conninfo)
+{
+	const char *intab[INIT_ENV_SIZE];
+	char srcbuf[INET_ADDRSTRLEN], dstbuf[INET_ADDRSTRLEN];
+	char **env;
+	int rc, found = 0;
+
+	query_values(map, key, conninfo, intab, srcbuf, dstbuf);
+	if (fill_env(NULL, query_vartab, intab, &env))
+		return 1;
+
+	if (smap_deadline_left(conninfo) == 0) {
+		smap_debug(dbgid, 1, ("%s: query deadline expired", db->name));
+		rc = send_reply(ostr, "TEMP query deadline expired", env);
+		free_env(env);
+		return rc;
+	}
+	rc = stmt_query(db, st, intab, &found);
+	if (rc && smap_deadline_left(conninfo) == 0)
+		rc = send_reply(ostr, "TEMP query deadline expired", env);
+	else if (rc)
+		rc = send_reply(ostr, moddb_onerror_reply(db), env);
+	else if (found)
+		rc = do_positive_reply(db, ostr, &env, st->meta, st->row);
+	else
+		rc = send_reply(ostr, moddb_negative_reply(db), env);
+	free_env(env);
+	return rc;
+}
+
+static int
+query_db(struct mod_mysql_db *db,
+	 smap_stream_t ostr,
+	 const char *map, const char *key,
+	 struct smap_conninfo const *conninfo)
 {
-	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
 	MYSQL_RES *res;
 	int rc;
 	char **env, **qenv;
+	struct mod_mysql_stmt *st;
 
+	if ((st = stmt_get(db)) != NULL)
+		return stmt_query_db(db, st, ostr, map, key, conninfo);
 	if (create_query_env(db, map, key, conninfo, &env, &qenv))
 		return 1;
 	
+	if (smap_deadline_left(conninfo) == 0) {
+		smap_debug(dbgid, 1, ("%s: query deadline expired", db->name));
+		free_env(qenv);
+		rc = send_reply(ostr, "TEMP query deadline expired", env);
+		free_env(env);
+		return rc;
+	}
 	rc = do_query(db, qenv, &res);
 	free_env(qenv);
 	
-	if (rc) {
+	if (rc && smap_deadline_left(conninfo) == 0)
+		/* Most probably, the read timeout has expired */
+		rc = send_reply(ostr, "TEMP query deadline expired", env);
+	else if (rc) {
 		rc = send_reply(ostr, moddb_onerror_reply(db), env);
 	} else if (res) {
-		unsigned nrow = mysql_num_rows(res);
-		unsigned ncol = mysql_num_fields(res);
-	
-		smap_debug(dbgid, 1,
-			   ("query returned %u columns in %u rows",
-			    ncol, nrow));
-		if (nrow > 0)
-			rc = do_positive_reply(db, ostr, &env, res);
-		else	
-			rc = send_reply(ostr, moddb_negative_reply(db),
-					env);
+		if (db->single_row)
+			rc = send_first_row(db, ostr, &env, res);
+		else
+			rc = send_result(db, ostr, &env, res);
 		mysql_free_result(res);
 		flush_result(db);
 	} else
@@ -598,15 +1268,500 @@ mod_query(smap_database_t dbp,
 	return rc;
 }
 
+static int
+mod_query(smap_database_t dbp,
+	  smap_stream_t ostr,
+	  const char *map, const char *key,
+	  struct smap_conninfo const *conninfo)
+{
+	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+	int rc;
+
+	defdb_lock(db);
+	rc = query_db(db, ostr, map, key, conninfo);
+	defdb_unlock(db);
+	return rc;
+}
+
+/* Batch queries */
+
+static const char *
+moddb_batch_template(struct mod_mysql_db *db)
+{
+	return db->batch_template ? db->batch_template : def_db.batch_template;
+}
+
+/* Return the comma-separated list of quoted KEYS */
+static char *
+format_key_list(MYSQL *mysql, const char **keys, size_t n)
+{
+	char *list, *p;
+	size_t i, size = 1;
+
+	for (i = 0; i < n; i++)
+		size += 2 * strlen(keys[i]) + 3;
+	list = malloc(size);
+	if (!list) {
+		smap_error("not enough memory");
+		return NULL;
+	}
+	p = list;
+	for (i = 0; i < n; i++) {
+		if (i)
+			*p++ = ',';
+		*p++ = '\'';
+		p += mysql_real_escape_string(mysql, p, keys[i],
+					      strlen(keys[i]));
+		*p++ = '\'';
+	}
+	*p = 0;
+	return list;
+}
+
+/* Run the batch query of DB for N KEYS and store its result in *PRES */
+static int
+do_batch_query(struct mod_mysql_db *db, const char *map,
+	       const char **keys, size_t n,
+	       struct smap_conninfo const *conninfo, MYSQL_RES **pres)
+{
+	MYSQL *mysql = moddb_handle(db);
+	char **env, **qenv, **p;
+	char *list;
+	size_t i;
+	struct wordsplit ws;
+	int rc;
+
+	list = format_key_list(mysql, keys, n);
+	if (!list)
+		return 1;
+	if (create_query_env(db, map, "", conninfo, &env, &qenv)) {
+		free(list);
+		return 1;
+	}
+	free_env(env);
+	for (i = 0; qenv[i]; i++)
+		;
+	p = realloc(qenv, (i + 2) * sizeof(qenv[0]));
+	if (!p || (p[i] = format_envar("keys", list)) == NULL) {
+		smap_error("not enough memory");
+		free_env(p ? p : qenv);
+		free(list);
+		return 1;
+	}
+	qenv = p;
+	qenv[i + 1] = NULL;
+	free(list);
+
+	rc = format_query(moddb_batch_template(db), qenv, &ws);
+	free_env(qenv);
+	if (rc)
+		return 1;
+
+ 	smap_debug(dbgid, 1, ("running batch query: %s", ws.ws_wordv[0]));
+	rc = mysql_query(mysql, ws.ws_wordv[0]);
+	if (rc) {
+		smap_error("%s: query failed: %s",
+			   db->name, mysql_error(mysql));
+		smap_error("%s: failed query: %s",
+			   db->name, ws.ws_wordv[0]);
+	}
+	wordsplit_free(&ws);
+	if (rc)
+		return 1;
+	*pres = mysql_store_result(mysql);
+	return 0;
+}
+
+/* Look up KEYS in a single query.  The first column of each row
+   returned by the batch query must contain the key the row pertains
+   to. */
+static int
+batch_db(struct mod_mysql_db *db, smap_stream_t ostr,
+	 const char *map, const char **keys, size_t n,
+	 struct smap_conninfo const *conninfo)
+{
+	MYSQL_RES *res = NULL;
+	MYSQL_ROW *rows = NULL;
+	unsigned nrow = 0, r;
+	size_t i;
+	int qrc, rc = 0;
+
+	if (smap_deadline_left(conninfo) == 0)
+		qrc = 2;
+	else {
+		qrc = do_batch_query(db, map, keys, n, conninfo, &res);
+		if (qrc && smap_deadline_left(conninfo) == 0)
+			qrc = 2;
+	}
+	if (qrc == 0 && res) {
+		nrow = mysql_num_rows(res);
+		smap_debug(dbgid, 1,
+			   ("batch query returned %u columns in %u rows",
+			    mysql_num_fields(res), nrow));
+		if (nrow) {
+			rows = calloc(nrow, sizeof(rows[0]));
+			if (!rows) {
+				smap_error("not enough memory");
+				mysql_free_result(res);
+				flush_result(db);
+				return 1;
+			}
+			for (r = 0; r < nrow; r++)
+				rows[r] = mysql_fetch_row(res);
+		}
+	}
+	
+	for (i = 0; rc == 0 && i < n; i++) {
+		char **env, **qenv;
+
+		if (create_query_env(db, map, keys[i], conninfo,
+				     &env, &qenv)) {
+			rc = 1;
+			break;
+		}
+		free_env(qenv);
+		if (qrc == 2)
+			rc = send_reply(ostr, "TEMP query deadline expired",
+					env);
+		else if (qrc)
+			rc = send_reply(ostr, moddb_onerror_reply(db), env);
+		else {
+			for (r = 0; r < nrow; r++)
+				if (rows[r][0]
+				    && strcmp(rows[r][0], keys[i]) == 0)
+					break;
+			if (r < nrow)
+				rc = do_positive_reply(db, ostr, &env,
+						       res, rows[r]);
+			else
+				rc = send_reply(ostr,
+						moddb_negative_reply(db),
+						env);
+		}
+		free_env(env);
+	}
+	free(rows);
+	if (res) {
+		mysql_free_result(res);
+		flush_result(db);
+	}
+	return rc;
+}
+
+static int
+mod_query_batch(smap_database_t dbp,
+		smap_stream_t ostr,
+		const char *map, const char **keys, size_t n,
+		struct smap_conninfo const *conninfo)
+{
+	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+	int rc;
+
+	if (!moddb_batch_template(db))
+		return 1;
+	defdb_lock(db);
+	rc = batch_db(db, ostr, map, keys, n, conninfo);
+	defdb_unlock(db);
+	return rc;
+}
+
+#ifdef MOD_MYSQL_ASYNC
+/* Asynchronous queries */
+
+enum mod_mysql_state {
+	MQ_QUERY,                   /* Sending the query */
+	MQ_STORE,                   /* Retrieving the result */
+	MQ_NEXT,                    /* Advancing to the next result */
+	MQ_FLUSH                    /* Retrieving the next result */
+};
+
+struct mod_mysql_query {
+	struct mod_mysql_db *db;
+	MYSQL *mysql;
+	enum mod_mysql_state state;
+	int status;                 /* Events to wait for */
+	struct wordsplit ws;        /* Query text */
+	char **env;                 /* Reply environment */
+	MYSQL_RES *res;             /* Query result */
+	MYSQL_RES *extra;           /* Additional result */
+};
+
+static void
+mysql_query_free(struct mod_mysql_query *qp)
+{
+	if (qp->res)
+		mysql_free_result(qp->res);
+	if (qp->extra)
+		mysql_free_result(qp->extra);
+	wordsplit_free(&qp->ws);
+	free_env(qp->env);
+	defdb_unlock(qp->db);
+	free(qp);
+}
+
+/* Start the next stage of the query QP, the current one having
+   finished with ERR.  Return SMAP_QUERY_PENDING if the query has to
+   wait, 0 if it is finished and -1 if it failed. */
+static int
+query_next(struct mod_mysql_query *qp, int err)
+{
+	for (;;) {
+		switch (qp->state) {
+		case MQ_QUERY:
+			if (err)
+				return -1;
+			qp->state = MQ_STORE;
+			qp->status = mysql_store_result_start(&qp->res,
+							      qp->mysql);
+			break;
+
+		case MQ_FLUSH:
+			if (!qp->extra)
+				return 0;
+			mysql_free_result(qp->extra);
+			qp->extra = NULL;
+			/* FALLTHROUGH */
+		case MQ_STORE:
+			if (!qp->res || !mysql_more_results(qp->mysql))
+				return 0;
+			qp->state = MQ_NEXT;
+			qp->status = mysql_next_result_start(&err, qp->mysql);
+			break;
+
+		case MQ_NEXT:
+			if (err)
+				return 0;
+			qp->state = MQ_FLUSH;
+			qp->status = mysql_store_result_start(&qp->extra,
+							      qp->mysql);
+			break;
+		}
+		if (qp->status)
+			return SMAP_QUERY_PENDING;
+	}
+}
+
+static smap_query_t
+mod_query_submit(smap_database_t dbp,
+		 const char *map, const char *key,
+		 struct smap_conninfo const *conninfo)
+{
+	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+	struct mod_mysql_query *qp;
+	char **qenv;
+	int rc, err;
+
+	/* Prepared statements are executed synchronously */
+	if (db->stmt)
+		return NULL;
+
+	/* The default connection may be busy with a query of another
+	   database.  The caller will then run this one synchronously. */
+	if ((db->flags & MDB_DEFDB) && pthread_mutex_trylock(&def_db_mutex))
+		return NULL;
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp) {
+		smap_error("%s: not enough memory", db->name);
+		defdb_unlock(db);
+		return NULL;
+	}
+	qp->db = db;
+	qp->mysql = moddb_handle(db);
+	if (create_query_env(db, map, key, conninfo, &qp->env, &qenv)) {
+		free(qp);
+		defdb_unlock(db);
+		return NULL;
+	}
+	rc = format_query(db->template, qenv, &qp->ws);
+	free_env(qenv);
+	if (rc) {
+		free_env(qp->env);
+		free(qp);
+		defdb_unlock(db);
+		return NULL;
+	}
+
+ 	smap_debug(dbgid, 1, ("submitting query: %s", qp->ws.ws_wordv[0]));
+	qp->state = MQ_QUERY;
+	qp->status = mysql_real_query_start(&err, qp->mysql,
+					    qp->ws.ws_wordv[0],
+					    strlen(qp->ws.ws_wordv[0]));
+	if (qp->status == 0 && query_next(qp, err) == -1) {
+		smap_error("%s: query failed: %s",
+			   db->name, mysql_error(qp->mysql));
+		mysql_query_free(qp);
+		return NULL;
+	}
+	return (smap_query_t) qp;
+}
+
+static int
+mod_query_fd(smap_query_t q, int *events)
+{
+	struct mod_mysql_query *qp = (struct mod_mysql_query *)q;
+
+	*events = 0;
+	if (qp->status & MYSQL_WAIT_READ)
+		*events |= POLLIN;
+	if (qp->status & MYSQL_WAIT_WRITE)
+		*events |= POLLOUT;
+	if (qp->status & MYSQL_WAIT_EXCEPT)
+		*events |= POLLPRI;
+	return mysql_get_socket(qp->mysql);
+}
+
+static int
+mod_query_complete(smap_query_t q, int revents, smap_stream_t ostr)
+{
+	struct mod_mysql_query *qp = (struct mod_mysql_query *)q;
+	struct mod_mysql_db *db = qp->db;
+	int status = 0, err = 0, rc = 0;
+
+	if (qp->status) {
+		if (revents & POLLIN)
+			status |= MYSQL_WAIT_READ;
+		if (revents & POLLOUT)
+			status |= MYSQL_WAIT_WRITE;
+		if (revents & POLLPRI)
+			status |= MYSQL_WAIT_EXCEPT;
+		if (!status)
+			status = qp->status;
+
+		switch (qp->state) {
+		case MQ_QUERY:
+			qp->status = mysql_real_query_cont(&err, qp->mysql,
+							   status);
+			break;
+		case MQ_STORE:
+			qp->status = mysql_store_result_cont(&qp->res,
+							     qp->mysql,
+							     status);
+			break;
+		case MQ_NEXT:
+			qp->status = mysql_next_result_cont(&err, qp->mysql,
+							    status);
+			break;
+		case MQ_FLUSH:
+			qp->status = mysql_store_result_cont(&qp->extra,
+							     qp->mysql,
+							     status);
+		}
+		if (qp->status)
+			return SMAP_QUERY_PENDING;
+		rc = query_next(qp, err);
+		if (rc == SMAP_QUERY_PENDING)
+			return rc;
+	}
+
+	if (rc) {
+		smap_error("%s: query failed: %s",
+			   db->name, mysql_error(qp->mysql));
+		smap_error("%s: failed query: %s",
+			   db->name, qp->ws.ws_wordv[0]);
+		rc = send_reply(ostr, moddb_onerror_reply(db), qp->env);
+	} else if (qp->res)
+		rc = send_result(db, ostr, &qp->env, qp->res);
+	else
+		rc = send_reply(ostr, moddb_negative_reply(db), qp->env);
+	mysql_query_free(qp);
+	return rc;
+}
+
+/* The non-blocking API provides no way to abandon a query in progress,
+   so the connection is closed and opened anew. */
+static void
+mod_query_cancel(smap_query_t q)
+{
+	struct mod_mysql_query *qp = (struct mod_mysql_query *)q;
+	struct mod_mysql_db *conn;
+	unsigned refcnt;
+
+	if (qp->status) {
+		conn = (qp->db->flags & MDB_DEFDB) ? &def_db : qp->db;
+		refcnt = conn->refcnt;
+		mysql_close(&conn->mysql);
+		conn->flags &= ~MDB_OPEN;
+		conn->refcnt = 0;
+		if (opendb(conn) == 0)
+			conn->refcnt = refcnt;
+	}
+	mysql_query_free(qp);
+}
+
+# define MOD_MYSQL_CAPA SMAP_CAPA_ASYNC
+#else
+# define MOD_MYSQL_CAPA 0
+# define mod_query_submit NULL
+# define mod_query_fd NULL
+# define mod_query_complete NULL
+# define mod_query_cancel NULL
+#endif
+
+/* Return 1 if TEMPLATE refers to the client addresses */
+static int
+template_uses_conninfo(const char *template)
+{
+	const char *p;
+
+	if (!template)
+		return 0;
+	for (p = template; (p = strchr(p, '$')) != NULL; ) {
+		if (*++p == '{')
+			p++;
+		if ((strncmp(p, "src", 3) == 0 || strncmp(p, "dst", 3) == 0)
+		    && !(isalnum(p[3]) || p[3] == '_'))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+mod_uses_conninfo(smap_database_t dbp)
+{
+	struct mod_mysql_db *db = (struct mod_mysql_db *)dbp;
+
+	return template_uses_conninfo(db->template)
+		|| template_uses_conninfo(moddb_batch_template(db))
+		|| template_uses_conninfo(moddb_positive_reply(db))
+		|| template_uses_conninfo(moddb_negative_reply(db))
+		|| template_uses_conninfo(moddb_onerror_reply(db));
+}
+
+/* The client library needs per-thread initialization in the threads
+   smapd starts for parallel queries */
+static void
+mod_thread_init(void)
+{
+	mysql_thread_init();
+}
+
+static void
+mod_thread_end(void)
+{
+	mysql_thread_end();
+}
+
 struct smap_module SMAP_EXPORT(mysql, module) = {
 	SMAP_MODULE_VERSION,
-	SMAP_CAPA_QUERY,
+	SMAP_CAPA_QUERY|SMAP_CAPA_THREADSAFE|SMAP_CAPA_BATCH|MOD_MYSQL_CAPA,
 	mod_init,
 	mod_init_db,
 	mod_free_db,
 	mod_open,
 	mod_close,
 	mod_query,
-	NULL /* smap_xform */
+	NULL, /* smap_xform */
+	mod_query_submit,
+	mod_query_fd,
+	mod_query_complete,
+	mod_query_cancel,
+	mod_query_batch,
+	mod_ping,
+	NULL, /* smap_notify_fd */
+	NULL, /* smap_notify_read */
+	mod_uses_conninfo,
+	mod_thread_init,
+	mod_thread_end
 };
 
@@ -19,10 +19,14 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <regex.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include <libpq-fe.h>
 
@@ -35,20 +39,32 @@
 #define MDB_OPEN  0x01
 #define MDB_DEFDB 0x02
 
+struct modpg_stmt;
+
 struct modpg_db {
 	int flags;
 	unsigned refcnt;
 	const char *name;
 	PGconn *pgconn;
+	unsigned long gen;          /* Incremented on each connect */
 	char *conninfo;
 	char *template;
+	char *batch_template;
 	char *positive_reply;
 	char *negative_reply;
 	char *onerror_reply;
+	int prepare;
+	struct modpg_stmt *stmt;    /* Compiled query template */
+	char *notify_channel;       /* Channel for change notifications */
+	PGconn *listener;           /* Connection listening on it */
 };
 
 static size_t dbgid;
 static struct modpg_db def_db;
+/* Databases using the default connection may be queried from different
+   threads (see SMAP_CAPA_THREADSAFE).  This mutex serializes access
+   to that connection. */
+static pthread_mutex_t def_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static PGconn *
 modpg_handle(struct modpg_db *db)
@@ -58,6 +74,20 @@ modpg_handle(struct modpg_db *db)
 	return db->pgconn;
 }
 
+static void
+defdb_lock(struct modpg_db *db)
+{
+	if (db->flags & MDB_DEFDB)
+		pthread_mutex_lock(&def_db_mutex);
+}
+
+static void
+defdb_unlock(struct modpg_db *db)
+{
+	if (db->flags & MDB_DEFDB)
+		pthread_mutex_unlock(&def_db_mutex);
+}
+
 static const char *
 modpg_positive_reply(struct modpg_db *db)
 {
@@ -82,6 +112,12 @@ modpg_onerror_reply(struct modpg_db *db)
 		(def_db.onerror_reply ? def_db.onerror_reply : "NOTFOUND");
 }
 
+static const char *
+modpg_batch_template(struct modpg_db *db)
+{
+	return db->batch_template ? db->batch_template : def_db.batch_template;
+}
+
 static int
 opendb(struct modpg_db *db)
 {
@@ -105,6 +141,7 @@ opendb(struct modpg_db *db)
 	}
 	db->refcnt++;
 	db->flags |= MDB_OPEN;
+	db->gen++;
 	return 0;
 }
 
@@ -123,9 +160,11 @@ freedb(struct modpg_db *db)
 {
 	free(db->conninfo);
 	free(db->template);
+	free(db->batch_template);
 	free(db->positive_reply);
 	free(db->negative_reply);
 	free(db->onerror_reply);
+	free(db->notify_channel);
 }
 	
 
@@ -198,6 +237,180 @@ create_conninfo(int argc, char **argv)
 	return conninfo;
 }
 
+
+/* Prepared statements */
+
+/* Variables that may be referenced in the query template */
+static char *query_vartab[] = { "map", "key", "src", "dst" };
+#define QUERY_VAR_COUNT (sizeof(query_vartab) / sizeof(query_vartab[0]))
+
+/* Query template compiled into a prepared statement.  The statement
+   text is built once, when the database is initialized.  It is prepared
+   on the connection when first used, and prepared anew after the
+   connection has been reestablished. */
+struct modpg_stmt {
+	char *text;                 /* Statement text */
+	int nparam;                 /* Number of parameters */
+	int param[QUERY_VAR_COUNT]; /* Variable index of each parameter */
+	const char *values[QUERY_VAR_COUNT]; /* Parameter values */
+	unsigned long gen;          /* Connection generation it belongs to */
+	int prepared;               /* Statement is prepared */
+};
+
+static int
+query_var_lookup(const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < QUERY_VAR_COUNT; i++)
+		if (strlen(query_vartab[i]) == len
+		    && memcmp(query_vartab[i], name, len) == 0)
+			return i;
+	return -1;
+}
+
+static void
+stmt_free(struct modpg_stmt *st)
+{
+	if (!st)
+		return;
+	free(st->text);
+	free(st);
+}
+
+/* Compile the query TEMPLATE of the database DBID.  Each reference to
+   a query variable is replaced with a parameter, numbered in the order
+   of first appearance.  A reference that makes up a string literal is
+   replaced along with the quotes, e.g. '$key' becomes $1. */
+static struct modpg_stmt *
+stmt_compile(const char *dbid, const char *template)
+{
+	struct modpg_stmt *st;
+	const char *p;
+	char *q;
+	int quote = 0;
+	char *qstart = NULL;
+
+	st = calloc(1, sizeof(*st));
+	if (!st || (st->text = malloc(strlen(template) + 1)) == NULL) {
+		smap_error("%s: not enough memory", dbid);
+		free(st);
+		return NULL;
+	}
+
+	for (p = template, q = st->text; *p; ) {
+		const char *name;
+		size_t nlen;
+		int n, i;
+
+		if (*p == '\\' && p[1]) {
+			*q++ = *p++;
+			*q++ = *p++;
+			continue;
+		}
+		if (quote) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			qstart = q;
+		}
+		if (*p != '$') {
+			*q++ = *p++;
+			continue;
+		}
+
+		if (p[1] == '{') {
+			name = p + 2;
+			nlen = strcspn(name, "}");
+			if (name[nlen] != '}') {
+				smap_error("%s: unterminated variable reference "
+					   "in query", dbid);
+				goto err;
+			}
+			p = name + nlen + 1;
+		} else {
+			name = p + 1;
+			for (nlen = 0;
+			     name[nlen] == '_' || isalnum(name[nlen]);
+			     nlen++)
+				;
+			if (nlen == 0) {
+				*q++ = *p++;
+				continue;
+			}
+			p = name + nlen;
+		}
+
+		n = query_var_lookup(name, nlen);
+		if (n == -1) {
+			smap_error("%s: cannot prepare query: "
+				   "unsupported variable reference %.*s",
+				   dbid, (int) nlen, name);
+			goto err;
+		}
+		if (quote) {
+			if (quote == '"' || qstart != q - 1 || *p != quote) {
+				smap_error("%s: cannot prepare query: "
+					   "variable %s is part of a quoted "
+					   "string", dbid, query_vartab[n]);
+				goto err;
+			}
+			q = qstart;
+			p++;
+			quote = 0;
+		}
+		for (i = 0; i < st->nparam; i++)
+			if (st->param[i] == n)
+				break;
+		if (i == st->nparam)
+			st->param[st->nparam++] = n;
+		*q++ = '$';
+		*q++ = '1' + i;
+	}
+	*q = 0;
+
+	smap_debug(dbgid, 1, ("%s: compiled query: %s", dbid, st->text));
+	return st;
+
+err:
+	stmt_free(st);
+	return NULL;
+}
+
+/* Return the statement of DB, if it can be used for queries.  Prepare
+   it if necessary.  A statement that failed to prepare is not retried
+   until the next reconnect; queries are meanwhile run as text. */
+static struct modpg_stmt *
+stmt_get(struct modpg_db *db)
+{
+	struct modpg_stmt *st = db->stmt;
+	unsigned long gen;
+	PGconn *pgconn;
+	PGresult *res;
+
+	if (!st)
+		return NULL;
+	gen = (db->flags & MDB_DEFDB) ? def_db.gen : db->gen;
+	if (st->gen == gen)
+		return st->prepared ? st : NULL;
+
+	st->gen = gen;
+	pgconn = modpg_handle(db);
+	res = PQprepare(pgconn, db->name, st->text, st->nparam, NULL);
+	st->prepared = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+	if (st->prepared)
+		smap_debug(dbgid, 1, ("%s: prepared statement", db->name));
+	else {
+		smap_error("%s: cannot prepare statement: %s",
+			   db->name, PQerrorMessage(pgconn));
+		smap_error("%s: failed statement: %s", db->name, st->text);
+	}
+	PQclear(res);
+	return st->prepared ? st : NULL;
+}
+
+
 static int
 modpg_init(int argc, char **argv)
 {
@@ -208,12 +421,16 @@ modpg_init(int argc, char **argv)
 	struct smap_option init_option[] = {
 		{ SMAP_OPTSTR(query), smap_opt_string,
 		  &def_db.template },
+		{ SMAP_OPTSTR(batch-query), smap_opt_string,
+		  &def_db.batch_template },
 		{ SMAP_OPTSTR(positive-reply), smap_opt_string,
 		  &def_db.positive_reply },
 		{ SMAP_OPTSTR(negative-reply), smap_opt_string,
 		  &def_db.negative_reply },
 		{ SMAP_OPTSTR(onerror-reply), smap_opt_string,
 		  &def_db.onerror_reply },
+		{ SMAP_OPTSTR(prepare), smap_opt_bool,
+		  &def_db.prepare },
 		{ NULL }
 	};
 	rc = smap_parseopt(init_option, argc, argv, SMAP_PARSEOPT_PERMUTE, &i);
@@ -239,18 +456,27 @@ modpg_init_db(const char *dbid, int argc, char **argv)
 	char *negative_reply = NULL;
 	char *onerror_reply = NULL;
 	char *query = NULL;
+	char *batch_query = NULL;
+	int prepare = def_db.prepare;
+	char *notify_channel = NULL;
 	int flags = 0;
 	int i;
 	
 	struct smap_option init_option[] = {
 		{ SMAP_OPTSTR(query), smap_opt_string,
 		  &query },
+		{ SMAP_OPTSTR(batch-query), smap_opt_string,
+		  &batch_query },
 		{ SMAP_OPTSTR(positive-reply), smap_opt_string,
 		  &positive_reply },
 		{ SMAP_OPTSTR(negative-reply), smap_opt_string,
 		  &negative_reply },
 		{ SMAP_OPTSTR(onerror-reply), smap_opt_string,
 		  &onerror_reply },
+		{ SMAP_OPTSTR(prepare), smap_opt_bool,
+		  &prepare },
+		{ SMAP_OPTSTR(notify-channel), smap_opt_string,
+		  &notify_channel },
 		{ NULL }
 	};
 
@@ -275,9 +501,21 @@ modpg_init_db(const char *dbid, int argc, char **argv)
 	db->flags = flags;
 	db->name = dbid;
 	db->template = query;
+	db->batch_template = batch_query;
 	db->positive_reply = positive_reply;
 	db->negative_reply = negative_reply;
 	db->onerror_reply = onerror_reply;
+	db->prepare = prepare;
+	db->notify_channel = notify_channel;
+
+	if (prepare && db->template) {
+		db->stmt = stmt_compile(dbid, db->template);
+		if (!db->stmt) {
+			freedb(db);
+			free(db);
+			return NULL;
+		}
+	}
 
 	return (smap_database_t) db;
 }
@@ -286,7 +524,11 @@ static int
 modpg_free_db(smap_database_t dbp)
 {
 	struct modpg_db *db = (struct modpg_db *)dbp;
+	stmt_free(db->stmt);
+	if (db->listener)
+		PQfinish(db->listener);
 	freedb(db);
+	free(db);
 	return 0;
 }
 
@@ -294,21 +536,49 @@ static int
 modpg_open(smap_database_t dbp)
 {
 	struct modpg_db *db = (struct modpg_db *)dbp;
+	int rc;
+
+	defdb_lock(db);
 	if (db->flags & MDB_DEFDB)
-		return opendb(&def_db);
-	return opendb(db);
+		rc = opendb(&def_db);
+	else
+		rc = opendb(db);
+	defdb_unlock(db);
+	return rc;
 }
 
 static int
 modpg_close(smap_database_t dbp)
 {
 	struct modpg_db *db = (struct modpg_db *)dbp;
+
+	defdb_lock(db);
 	if (db->flags & MDB_DEFDB)
 		closedb(&def_db);
 	closedb(db);
+	defdb_unlock(db);
 	return 0;
 }
 
+static int
+modpg_ping(smap_database_t dbp)
+{
+	struct modpg_db *db = (struct modpg_db *)dbp;
+	PGconn *pgconn;
+	int rc = 0;
+
+	defdb_lock(db);
+	pgconn = modpg_handle(db);
+	/* PQstatus does not notice a connection closed by the server
+	   until some data are read from it */
+	if (!PQconsumeInput(pgconn) || PQstatus(pgconn) != CONNECTION_OK) {
+		smap_error("%s: %s", db->name, PQerrorMessage(pgconn));
+		rc = 1;
+	}
+	defdb_unlock(db);
+	return rc;
+}
+
 
 static char *
 format_envar(const char *var, const char *val)
@@ -423,73 +693,214 @@ fill_env(int escape, char **vartab, const char **intab, char ***penv)
 	return rc;
 }
 		
-static int
-create_query_env(const char *map, const char *key,
-		 struct smap_conninfo const *conninfo,
-		 char ***penv, char ***pqenv)
+/* Fill INTAB with the values of query variables.  The addresses are
+   formatted into SRCBUF and DSTBUF. */
+static void
+query_values(const char *map, const char *key,
+	     struct smap_conninfo const *conninfo,
+	     const char **intab, char *srcbuf, char *dstbuf)
 {
-	static char *vartab[] = { "map", "key", "src", "dst" };
-	static const char *intab[INIT_ENV_SIZE];
 	struct sockaddr_in *s_in;
-	
+
 	intab[0] = map;
 	intab[1] = key;
 	if (conninfo && conninfo->src->sa_family == AF_INET) {
 		s_in = (struct sockaddr_in *)conninfo->src;
-		intab[2] = inet_ntoa(s_in->sin_addr);
+		intab[2] = inet_ntop(AF_INET, &s_in->sin_addr,
+				     srcbuf, INET_ADDRSTRLEN);
 	} else
 		intab[2] = NULL;
 	if (conninfo && conninfo->dst->sa_family == AF_INET) {
 		s_in = (struct sockaddr_in *)conninfo->dst;
-		intab[3] = inet_ntoa(s_in->sin_addr);
+		intab[3] = inet_ntop(AF_INET, &s_in->sin_addr,
+				     dstbuf, INET_ADDRSTRLEN);
 	} else
 		intab[3] = NULL;
-	
-	if (fill_env(0, vartab, intab, penv))
+}
+
+static int
+create_query_env(const char *map, const char *key,
+		 struct smap_conninfo const *conninfo,
+		 char ***penv, char ***pqenv)
+{
+	const char *intab[INIT_ENV_SIZE];
+	char srcbuf[INET_ADDRSTRLEN], dstbuf[INET_ADDRSTRLEN];
+
+	query_values(map, key, conninfo, intab, srcbuf, dstbuf);
+	if (fill_env(0, query_vartab, intab, penv))
 		return 1;
-	if (fill_env(1, vartab, intab, pqenv)) {
+	if (fill_env(1, query_vartab, intab, pqenv)) {
 		free_env(*penv);
 		return 1;
 	}
 	return 0;
 }
 
+/* Set the parameter values of the statement ST from INTAB */
+static void
+stmt_bind(struct modpg_stmt *st, const char **intab)
+{
+	int i;
+
+	for (i = 0; i < st->nparam; i++) {
+		const char *val = intab[st->param[i]];
+		st->values[i] = val ? val : "";
+	}
+}
+
+/* Cancel the query in progress on PGCONN */
+static void
+cancel_query(struct modpg_db *db, PGconn *pgconn)
+{
+	PGcancel *cancel;
+	char errbuf[256];
+
+	cancel = PQgetCancel(pgconn);
+	if (!cancel) {
+		smap_error("%s: cannot cancel query", db->name);
+		return;
+	}
+	if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+		smap_error("%s: cannot cancel query: %s", db->name, errbuf);
+	PQfreeCancel(cancel);
+}
+
+/* Wait for the result of the query sent to PGCONN.  If CONNINFO has
+   a deadline, wait no longer than it allows, and cancel the query when
+   it expires.  In that case, set *EXPIRED to 1 and return NULL. */
+static PGresult *
+wait_result(struct modpg_db *db, PGconn *pgconn,
+	    struct smap_conninfo const *conninfo, int *expired)
+{
+	PGresult *res, *last = NULL;
+	long left;
+
+	while (PQisBusy(pgconn)) {
+		struct pollfd pfd;
+
+		left = smap_deadline_left(conninfo);
+		if (left == 0) {
+			smap_debug(dbgid, 1, ("%s: query deadline expired",
+					      db->name));
+			cancel_query(db, pgconn);
+			*expired = 1;
+			break;
+		}
+		pfd.fd = PQsocket(pgconn);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, left) < 0 && errno != EINTR) {
+			smap_error("%s: poll: %s", db->name, strerror(errno));
+			break;
+		}
+		if (!PQconsumeInput(pgconn))
+			break;
+	}
+	/* Collect the results.  As PQexec does, return the last one. */
+	while ((res = PQgetResult(pgconn)) != NULL) {
+		PQclear(last);
+		last = res;
+	}
+	if (*expired) {
+		PQclear(last);
+		return NULL;
+	}
+	return last;
+}
+
+/* Execute QUERY on PGCONN, observing the deadline of CONNINFO.  See
+   wait_result for the description of EXPIRED. */
+static PGresult *
+exec_query(struct modpg_db *db, PGconn *pgconn, const char *query,
+	   struct smap_conninfo const *conninfo, int *expired)
+{
+	long left;
+
+	*expired = 0;
+	left = smap_deadline_left(conninfo);
+	if (left < 0)
+		return PQexec(pgconn, query);
+	if (left == 0) {
+		*expired = 1;
+		return NULL;
+	}
+	if (!PQsendQuery(pgconn, query))
+		return NULL;
+	return wait_result(db, pgconn, conninfo, expired);
+}
+
+/* Execute the prepared statement ST of DB on PGCONN.  Arguments as for
+   exec_query. */
+static PGresult *
+exec_prepared(struct modpg_db *db, PGconn *pgconn, struct modpg_stmt *st,
+	      struct smap_conninfo const *conninfo, int *expired)
+{
+	long left;
+
+	*expired = 0;
+	left = smap_deadline_left(conninfo);
+	if (left < 0)
+		return PQexecPrepared(pgconn, db->name, st->nparam,
+				      st->values, NULL, NULL, 0);
+	if (left == 0) {
+		*expired = 1;
+		return NULL;
+	}
+	if (!PQsendQueryPrepared(pgconn, db->name, st->nparam,
+				 st->values, NULL, NULL, 0))
+		return NULL;
+	return wait_result(db, pgconn, conninfo, expired);
+}
+
+/* Expand the query TEMPLATE into WS->ws_wordv[0] */
+static int
+format_query(const char *template, char **env, struct wordsplit *ws)
+{
+	ws->ws_env = (const char **) env;
+	ws->ws_error = smap_error;
+	return wordsplit(template, ws,
+			 WRDSF_NOSPLIT |
+			 WRDSF_NOCMD |
+			 WRDSF_ENV |
+			 WRDSF_ERROR |
+			 WRDSF_SHOWERR);
+}
+
+static int
+query_ok(PGresult *res)
+{
+	ExecStatusType stat = PQresultStatus(res);
+	return stat == PGRES_COMMAND_OK || stat == PGRES_TUPLES_OK;
+}
+
 static int
-do_query(struct modpg_db *db, char **env, PGresult **pres)
+do_query(struct modpg_db *db, char **env,
+	 struct smap_conninfo const *conninfo, PGresult **pres)
 {
 	struct wordsplit ws;
 	int rc = 0;
 	PGconn *pgconn = modpg_handle(db);
 	PGresult *res;
+	int expired;
 	
-	ws.ws_env = (const char **) env;
-	ws.ws_error = smap_error;
-	rc = wordsplit(db->template, &ws,
-		       WRDSF_NOSPLIT |
-		       WRDSF_NOCMD |
-		       WRDSF_ENV |
-		       WRDSF_ERROR |
-		       WRDSF_SHOWERR);
-	if (rc)
+	if (format_query(db->template, env, &ws))
 		return 1;
 
  	smap_debug(dbgid, 1,
 		   ("running query: %s", ws.ws_wordv[0]));
 
-	res = PQexec(pgconn, ws.ws_wordv[0]);
-	if (res == NULL)
-		rc = 1;
-	else {
-		ExecStatusType stat;
-		stat = PQresultStatus(res);
-		if (stat != PGRES_COMMAND_OK && stat != PGRES_TUPLES_OK)
-			rc = 1;
+	res = exec_query(db, pgconn, ws.ws_wordv[0], conninfo, &expired);
+	if (expired) {
+		wordsplit_free(&ws);
+		return 2;
 	}
+	if (res == NULL || !query_ok(res))
+		rc = 1;
 	if (rc) {
 		smap_error("%s: query failed: %s",
 			   db->name, PQerrorMessage(pgconn));
 		smap_error("%s: failed query: %s",
 			   db->name, ws.ws_wordv[0]);
+		PQclear(res);
 	}
 	wordsplit_free(&ws);
 	if (rc)
@@ -498,6 +909,29 @@ do_query(struct modpg_db *db, char **env, PGresult **pres)
 	return 0;
 }
 
+/* Run the prepared statement ST of DB.  Return value as for do_query. */
+static int
+do_prepared_query(struct modpg_db *db, struct modpg_stmt *st,
+		  struct smap_conninfo const *conninfo, PGresult **pres)
+{
+	PGconn *pgconn = modpg_handle(db);
+	PGresult *res;
+	int expired;
+
+ 	smap_debug(dbgid, 1, ("executing statement: %s", st->text));
+	res = exec_prepared(db, pgconn, st, conninfo, &expired);
+	if (expired)
+		return 2;
+	if (res == NULL || !query_ok(res)) {
+		smap_error("%s: query failed: %s",
+			   db->name, PQerrorMessage(pgconn));
+		PQclear(res);
+		return 1;
+	}
+	*pres = res;
+	return 0;
+}
+
 static int
 send_reply(smap_stream_t ostr, const char *template, char **env)
 {
@@ -528,7 +962,7 @@ static int
 do_positive_reply(struct modpg_db *db, 
 		  smap_stream_t ostr,
 		  char ***penv,
-		  PGresult *res)
+		  PGresult *res, int row)
 {
 	size_t nfld = PQnfields(res);
 	char **env;
@@ -545,7 +979,8 @@ do_positive_reply(struct modpg_db *db,
 	*penv = env;
 
 	for (j = 0; j < nfld; j++) {
-		char *p = format_envar(PQfname(res, j), PQgetvalue(res, 0, j));
+		char *p = format_envar(PQfname(res, j),
+				       PQgetvalue(res, row, j));
 		env[i + j] = p;
 		if (!p) {
 			smap_error("not enough memory");
@@ -557,6 +992,59 @@ do_positive_reply(struct modpg_db *db,
 	return send_reply(ostr, modpg_positive_reply(db), env);
 }
 		
+/* Send the reply for the successful query result RES */
+static int
+send_result(struct modpg_db *db, smap_stream_t ostr, char ***penv,
+	    PGresult *res)
+{
+	size_t ntuples = PQntuples(res);
+
+	smap_debug(dbgid, 1,
+		   ("query returned %u columns in %u rows",
+		    PQnfields(res), ntuples));
+	if (ntuples)
+		return do_positive_reply(db, ostr, penv, res, 0);
+	return send_reply(ostr, modpg_negative_reply(db), *penv);
+}
+
+static int
+query_db(struct modpg_db *db,
+	 smap_stream_t ostr,
+	 const char *map, const char *key,
+	 struct smap_conninfo const *conninfo)
+{
+	PGresult *res = NULL;
+	int rc;
+	char **env, **qenv;
+	struct modpg_stmt *st = stmt_get(db);
+
+	if (st) {
+		const char *intab[INIT_ENV_SIZE];
+		char srcbuf[INET_ADDRSTRLEN], dstbuf[INET_ADDRSTRLEN];
+
+		query_values(map, key, conninfo, intab, srcbuf, dstbuf);
+		if (fill_env(0, query_vartab, intab, &env))
+			return 1;
+		stmt_bind(st, intab);
+		rc = do_prepared_query(db, st, conninfo, &res);
+	} else {
+		if (create_query_env(map, key, conninfo, &env, &qenv))
+			return 1;
+		rc = do_query(db, qenv, conninfo, &res);
+		free_env(qenv);
+	}
+	if (rc == 2)
+		rc = send_reply(ostr, "TEMP query deadline expired", env);
+	else if (rc)
+		rc = send_reply(ostr, modpg_onerror_reply(db), env);
+	else {
+		rc = send_result(db, ostr, &env, res);
+		PQclear(res);
+	}
+	free_env(env);
+	return rc;
+}
+
 static int
 modpg_query(smap_database_t dbp,
 	    smap_stream_t ostr,
@@ -564,40 +1052,714 @@ modpg_query(smap_database_t dbp,
 	    struct smap_conninfo const *conninfo)
 {
 	struct modpg_db *db = (struct modpg_db *)dbp;
+	int rc;
+
+	defdb_lock(db);
+	rc = query_db(db, ostr, map, key, conninfo);
+	defdb_unlock(db);
+	return rc;
+}
+
+/* Batch queries */
+
+/* Return the comma-separated list of quoted KEYS */
+static char *
+format_key_list(struct modpg_db *db, PGconn *pgconn,
+		const char **keys, size_t n)
+{
+	char *list = NULL;
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		char *lit = PQescapeLiteral(pgconn, keys[i], strlen(keys[i]));
+		size_t size;
+		char *p;
+
+		if (!lit) {
+			smap_error("%s: cannot quote key: %s",
+				   db->name, PQerrorMessage(pgconn));
+			free(list);
+			return NULL;
+		}
+		size = strlen(lit);
+		p = realloc(list, len + size + 2);
+		if (!p) {
+			smap_error("not enough memory");
+			PQfreemem(lit);
+			free(list);
+			return NULL;
+		}
+		list = p;
+		if (i)
+			list[len++] = ',';
+		memcpy(list + len, lit, size + 1);
+		len += size;
+		PQfreemem(lit);
+	}
+	return list;
+}
+
+/* Run the batch query of DB for N KEYS and store its result in *PRES.
+   Return value as for do_query. */
+static int
+do_batch_query(struct modpg_db *db, const char *map,
+	       const char **keys, size_t n,
+	       struct smap_conninfo const *conninfo, PGresult **pres)
+{
+	PGconn *pgconn = modpg_handle(db);
+	char **env, **qenv, **p;
+	char *list;
+	size_t i;
+	struct wordsplit ws;
 	PGresult *res;
+	int expired;
 	int rc;
-	char **env, **qenv;
-	
-	if (create_query_env(map, key, conninfo, &env, &qenv))
+
+	list = format_key_list(db, pgconn, keys, n);
+	if (!list)
 		return 1;
-	
-	rc = do_query(db, qenv, &res);
+	if (create_query_env(map, "", conninfo, &env, &qenv)) {
+		free(list);
+		return 1;
+	}
+	free_env(env);
+	for (i = 0; qenv[i]; i++)
+		;
+	p = realloc(qenv, (i + 2) * sizeof(qenv[0]));
+	if (!p || (p[i] = format_envar("keys", list)) == NULL) {
+		smap_error("not enough memory");
+		free_env(p ? p : qenv);
+		free(list);
+		return 1;
+	}
+	qenv = p;
+	qenv[i + 1] = NULL;
+	free(list);
+
+	rc = format_query(modpg_batch_template(db), qenv, &ws);
 	free_env(qenv);
 	if (rc)
-		rc = send_reply(ostr, modpg_onerror_reply(db), env);
-	else {
-		size_t ntuples = PQntuples(res);
+		return 1;
+
+ 	smap_debug(dbgid, 1, ("running batch query: %s", ws.ws_wordv[0]));
+	res = exec_query(db, pgconn, ws.ws_wordv[0], conninfo, &expired);
+	if (expired) {
+		wordsplit_free(&ws);
+		return 2;
+	}
+	if (res == NULL || !query_ok(res)) {
+		smap_error("%s: query failed: %s",
+			   db->name, PQerrorMessage(pgconn));
+		smap_error("%s: failed query: %s",
+			   db->name, ws.ws_wordv[0]);
+		PQclear(res);
+		wordsplit_free(&ws);
+		return 1;
+	}
+	wordsplit_free(&ws);
+	*pres = res;
+	return 0;
+}
+
+/* Look up KEYS in a single query.  The first column of each row
+   returned by the batch query must contain the key the row pertains
+   to. */
+static int
+batch_db(struct modpg_db *db, smap_stream_t ostr,
+	 const char *map, const char **keys, size_t n,
+	 struct smap_conninfo const *conninfo)
+{
+	PGresult *res = NULL;
+	size_t i;
+	int ntuples = 0, qrc, rc = 0;
+
+	qrc = do_batch_query(db, map, keys, n, conninfo, &res);
+	if (qrc == 0) {
+		ntuples = PQntuples(res);
 		smap_debug(dbgid, 1,
-			   ("query returned %u columns in %u rows",
+			   ("batch query returned %u columns in %u rows",
 			    PQnfields(res), ntuples));
-		if (ntuples)
-			rc = do_positive_reply(db, ostr, &env, res);
-		else	
-			rc = send_reply(ostr, modpg_negative_reply(db),	env);
 	}
-	free_env(env);
+	for (i = 0; rc == 0 && i < n; i++) {
+		char **env, **qenv;
+		int row;
+
+		if (create_query_env(map, keys[i], conninfo, &env, &qenv)) {
+			rc = 1;
+			break;
+		}
+		free_env(qenv);
+		if (qrc == 2)
+			rc = send_reply(ostr, "TEMP query deadline expired",
+					env);
+		else if (qrc)
+			rc = send_reply(ostr, modpg_onerror_reply(db), env);
+		else {
+			for (row = 0; row < ntuples; row++)
+				if (strcmp(PQgetvalue(res, row, 0),
+					   keys[i]) == 0)
+					break;
+			if (row < ntuples)
+				rc = do_positive_reply(db, ostr, &env,
+						       res, row);
+			else
+				rc = send_reply(ostr,
+						modpg_negative_reply(db),
+						env);
+		}
+		free_env(env);
+	}
+	PQclear(res);
+	return rc;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/* Pipelined queries.  When the batch query is not defined, the queries
+   for all keys are sent at once in pipeline mode and their results are
+   collected in order, so that the whole batch costs a single round trip
+   to the server.  Each query is followed by a synchronization point, so
+   that a failed query does not abort the ones following it. */
+
+/* Send the query for KEY to PGCONN */
+static int
+pipeline_send(struct modpg_db *db, PGconn *pgconn, struct modpg_stmt *st,
+	      const char *map, const char *key,
+	      struct smap_conninfo const *conninfo)
+{
+	int rc;
+
+	if (st) {
+		const char *intab[INIT_ENV_SIZE];
+		char srcbuf[INET_ADDRSTRLEN], dstbuf[INET_ADDRSTRLEN];
+
+		query_values(map, key, conninfo, intab, srcbuf, dstbuf);
+		stmt_bind(st, intab);
+		rc = PQsendQueryPrepared(pgconn, db->name, st->nparam,
+					 st->values, NULL, NULL, 0);
+	} else {
+		struct wordsplit ws;
+		char **env, **qenv;
+
+		if (create_query_env(map, key, conninfo, &env, &qenv))
+			return 1;
+		free_env(env);
+		rc = format_query(db->template, qenv, &ws);
+		free_env(qenv);
+		if (rc)
+			return 1;
+		smap_debug(dbgid, 2, ("sending query: %s", ws.ws_wordv[0]));
+		/* PQsendQuery is not allowed in pipeline mode */
+		rc = PQsendQueryParams(pgconn, ws.ws_wordv[0], 0,
+				       NULL, NULL, NULL, NULL, 0);
+		wordsplit_free(&ws);
+	}
+	if (!rc || !PQpipelineSync(pgconn)) {
+		smap_error("%s: cannot send query: %s",
+			   db->name, PQerrorMessage(pgconn));
+		return 1;
+	}
+	return 0;
+}
+
+/* Collect the results of NSENT queries sent to PGCONN into RESV.
+   Return the number of queries whose results have been received
+   completely.  Set *EXPIRED if the deadline expired. */
+static size_t
+pipeline_collect(struct modpg_db *db, PGconn *pgconn,
+		 PGresult **resv, size_t nsent,
+		 struct smap_conninfo const *conninfo, int *expired)
+{
+	size_t cur = 0;
+	PGresult *res;
+
+	while (cur < nsent) {
+		struct pollfd pfd;
+		long left;
+		int flush;
+
+		flush = PQflush(pgconn);
+		if (flush < 0 || !PQconsumeInput(pgconn))
+			break;
+		while (cur < nsent && !PQisBusy(pgconn)) {
+			res = PQgetResult(pgconn);
+			if (!res)
+				/* End of results of the current query */
+				continue;
+			if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+				PQclear(res);
+				cur++;
+			} else {
+				PQclear(resv[cur]);
+				resv[cur] = res;
+			}
+		}
+		if (cur == nsent)
+			break;
+
+		left = smap_deadline_left(conninfo);
+		if (left == 0) {
+			smap_debug(dbgid, 1, ("%s: query deadline expired",
+					      db->name));
+			cancel_query(db, pgconn);
+			*expired = 1;
+			break;
+		}
+		pfd.fd = PQsocket(pgconn);
+		pfd.events = POLLIN;
+		if (flush)
+			pfd.events |= POLLOUT;
+		if (poll(&pfd, 1, left) < 0 && errno != EINTR) {
+			smap_error("%s: poll: %s", db->name, strerror(errno));
+			break;
+		}
+	}
+	
+	if (cur < nsent) {
+		size_t n = cur;
+		int null = 0;
+
+		/* Discard the rest of the results */
+		PQsetnonblocking(pgconn, 0);
+		PQflush(pgconn);
+		while (n < nsent && PQstatus(pgconn) == CONNECTION_OK) {
+			res = PQgetResult(pgconn);
+			if (!res) {
+				if (null++)
+					break;
+				continue;
+			}
+			null = 0;
+			if (PQresultStatus(res) == PGRES_PIPELINE_SYNC)
+				n++;
+			PQclear(res);
+		}
+	}
+	return cur;
+}
+
+/* Look up N KEYS in pipeline mode */
+static int
+pipeline_db(struct modpg_db *db, smap_stream_t ostr,
+	    const char *map, const char **keys, size_t n,
+	    struct smap_conninfo const *conninfo)
+{
+	PGconn *pgconn = modpg_handle(db);
+	struct modpg_stmt *st = stmt_get(db);
+	PGresult **resv;
+	size_t i, nsent = 0, nrecv = 0;
+	int expired = 0;
+	int rc = 0;
+
+	resv = calloc(n, sizeof(resv[0]));
+	if (!resv) {
+		smap_error("not enough memory");
+		return 1;
+	}
+	if (smap_deadline_left(conninfo) == 0)
+		expired = 1;
+	else {
+		PQsetnonblocking(pgconn, 1);
+		if (!PQenterPipelineMode(pgconn)) {
+			smap_error("%s: cannot enter pipeline mode: %s",
+				   db->name, PQerrorMessage(pgconn));
+			PQsetnonblocking(pgconn, 0);
+			free(resv);
+			return 1;
+		}
+		smap_debug(dbgid, 1, ("%s: sending %lu queries in pipeline",
+				      db->name, (unsigned long) n));
+		for (nsent = 0; nsent < n; nsent++)
+			if (pipeline_send(db, pgconn, st, map, keys[nsent],
+					  conninfo))
+				break;
+		nrecv = pipeline_collect(db, pgconn, resv, nsent,
+					 conninfo, &expired);
+		if (!PQexitPipelineMode(pgconn))
+			smap_error("%s: cannot exit pipeline mode: %s",
+				   db->name, PQerrorMessage(pgconn));
+		PQsetnonblocking(pgconn, 0);
+	}
+
+	for (i = 0; rc == 0 && i < n; i++) {
+		char **env, **qenv;
+
+		if (create_query_env(map, keys[i], conninfo, &env, &qenv)) {
+			rc = 1;
+			break;
+		}
+		free_env(qenv);
+		if (i >= nrecv && expired)
+			rc = send_reply(ostr, "TEMP query deadline expired",
+					env);
+		else if (i >= nrecv || !resv[i] || !query_ok(resv[i])) {
+			if (i < nrecv)
+				smap_error("%s: query failed: %s", db->name,
+					   resv[i]
+					    ? PQresultErrorMessage(resv[i])
+					    : "no result");
+			rc = send_reply(ostr, modpg_onerror_reply(db), env);
+		} else
+			rc = send_result(db, ostr, &env, resv[i]);
+		free_env(env);
+	}
+
+	for (i = 0; i < n; i++)
+		PQclear(resv[i]);
+	free(resv);
+	return rc;
+}
+#endif
+
+static int
+modpg_query_batch(smap_database_t dbp,
+		  smap_stream_t ostr,
+		  const char *map, const char **keys, size_t n,
+		  struct smap_conninfo const *conninfo)
+{
+	struct modpg_db *db = (struct modpg_db *)dbp;
+	int rc;
+
+	if (modpg_batch_template(db)) {
+		defdb_lock(db);
+		rc = batch_db(db, ostr, map, keys, n, conninfo);
+		defdb_unlock(db);
+	} else {
+#ifdef LIBPQ_HAS_PIPELINING
+		defdb_lock(db);
+		rc = pipeline_db(db, ostr, map, keys, n, conninfo);
+		defdb_unlock(db);
+#else
+		rc = 1;
+#endif
+	}
 	return rc;
 }
 
+/* Asynchronous queries */
+
+struct modpg_query {
+	struct modpg_db *db;
+	PGconn *pgconn;
+	char **env;                 /* Reply environment */
+	int flush;                  /* Query is not sent completely */
+	PGresult *res;              /* Last result received */
+};
+
+static smap_query_t
+modpg_query_submit(smap_database_t dbp,
+		   const char *map, const char *key,
+		   struct smap_conninfo const *conninfo)
+{
+	struct modpg_db *db = (struct modpg_db *)dbp;
+	struct modpg_query *qp;
+	struct modpg_stmt *st;
+	char **env;
+	PGconn *pgconn;
+	int rc;
+
+	/* The default connection may be busy with a query of another
+	   database.  The caller will then run this one synchronously. */
+	if ((db->flags & MDB_DEFDB) && pthread_mutex_trylock(&def_db_mutex))
+		return NULL;
+	
+	qp = calloc(1, sizeof(*qp));
+	if (!qp) {
+		smap_error("%s: not enough memory", db->name);
+		defdb_unlock(db);
+		return NULL;
+	}
+	pgconn = modpg_handle(db);
+	st = stmt_get(db);
+	if (st) {
+		const char *intab[INIT_ENV_SIZE];
+		char srcbuf[INET_ADDRSTRLEN], dstbuf[INET_ADDRSTRLEN];
+
+		query_values(map, key, conninfo, intab, srcbuf, dstbuf);
+		if (fill_env(0, query_vartab, intab, &env)) {
+			free(qp);
+			defdb_unlock(db);
+			return NULL;
+		}
+		stmt_bind(st, intab);
+		smap_debug(dbgid, 1, ("submitting statement: %s", st->text));
+		PQsetnonblocking(pgconn, 1);
+		rc = PQsendQueryPrepared(pgconn, db->name, st->nparam,
+					 st->values, NULL, NULL, 0);
+	} else {
+		struct wordsplit ws;
+		char **qenv;
+
+		if (create_query_env(map, key, conninfo, &env, &qenv)) {
+			free(qp);
+			defdb_unlock(db);
+			return NULL;
+		}
+		rc = format_query(db->template, qenv, &ws);
+		free_env(qenv);
+		if (rc) {
+			free(qp);
+			free_env(env);
+			defdb_unlock(db);
+			return NULL;
+		}
+
+		smap_debug(dbgid, 1, ("submitting query: %s", ws.ws_wordv[0]));
+		PQsetnonblocking(pgconn, 1);
+		rc = PQsendQuery(pgconn, ws.ws_wordv[0]);
+		wordsplit_free(&ws);
+	}
+	if (!rc) {
+		smap_error("%s: cannot send query: %s",
+			   db->name, PQerrorMessage(pgconn));
+		PQsetnonblocking(pgconn, 0);
+		free(qp);
+		free_env(env);
+		defdb_unlock(db);
+		return NULL;
+	}
+
+	qp->db = db;
+	qp->pgconn = pgconn;
+	qp->env = env;
+	qp->flush = 1;
+	return (smap_query_t) qp;
+}
+
+static int
+modpg_query_fd(smap_query_t q, int *events)
+{
+	struct modpg_query *qp = (struct modpg_query *)q;
+
+	*events = POLLIN;
+	if (qp->flush)
+		*events |= POLLOUT;
+	return PQsocket(qp->pgconn);
+}
+
+static void
+query_free(struct modpg_query *qp)
+{
+	PQsetnonblocking(qp->pgconn, 0);
+	PQclear(qp->res);
+	free_env(qp->env);
+	defdb_unlock(qp->db);
+	free(qp);
+}
+
+static int
+modpg_query_complete(smap_query_t q, int revents, smap_stream_t ostr)
+{
+	struct modpg_query *qp = (struct modpg_query *)q;
+	struct modpg_db *db = qp->db;
+	PGresult *res;
+	int rc;
+
+	if (qp->flush) {
+		rc = PQflush(qp->pgconn);
+		if (rc < 0)
+			goto err;
+		qp->flush = rc;
+	}
+	if (!PQconsumeInput(qp->pgconn))
+		goto err;
+	while (!PQisBusy(qp->pgconn)) {
+		res = PQgetResult(qp->pgconn);
+		if (!res) {
+			/* All results are collected */
+			if (!qp->res || !query_ok(qp->res))
+				goto err;
+			rc = send_result(db, ostr, &qp->env, qp->res);
+			query_free(qp);
+			return rc;
+		}
+		PQclear(qp->res);
+		qp->res = res;
+	}
+	return SMAP_QUERY_PENDING;
+
+ err:
+	smap_error("%s: query failed: %s",
+		   db->name, PQerrorMessage(qp->pgconn));
+	/* Discard the rest of the results, if any */
+	PQsetnonblocking(qp->pgconn, 0);
+	while ((res = PQgetResult(qp->pgconn)) != NULL)
+		PQclear(res);
+	rc = send_reply(ostr, modpg_onerror_reply(db), qp->env);
+	query_free(qp);
+	return rc;
+}
+
+static void
+modpg_query_cancel(smap_query_t q)
+{
+	struct modpg_query *qp = (struct modpg_query *)q;
+	PGresult *res;
+
+	cancel_query(qp->db, qp->pgconn);
+	PQsetnonblocking(qp->pgconn, 0);
+	while ((res = PQgetResult(qp->pgconn)) != NULL)
+		PQclear(res);
+	query_free(qp);
+}
+
+/* Change notifications.  The master process listens on the channel
+   given by the notify-channel option.  The payload of each notification
+   is the changed key. */
+
+/* Default timeout for connecting the listener, s.  The master process
+   does not accept connections meanwhile. */
+#define LISTENER_CONNECT_TIMEOUT "5"
+
+static PGconn *
+listener_connect(const char *conninfo)
+{
+	/* connect_timeout set in CONNINFO takes precedence */
+	static const char *keywords[] = {
+		"connect_timeout", "dbname", NULL
+	};
+	const char *values[3];
+
+	values[0] = LISTENER_CONNECT_TIMEOUT;
+	values[1] = conninfo ? conninfo : "";
+	values[2] = NULL;
+	return PQconnectdbParams(keywords, values, 1);
+}
+
+static int
+modpg_notify_fd(smap_database_t dbp)
+{
+	struct modpg_db *db = (struct modpg_db *)dbp;
+	const char *conninfo;
+	char *ident, *cmd;
+	PGresult *res;
+	int rc;
+
+	if (!db->notify_channel)
+		return -1;
+	if (db->listener)
+		PQfinish(db->listener);
+	conninfo = (db->flags & MDB_DEFDB) ? def_db.conninfo : db->conninfo;
+	db->listener = listener_connect(conninfo);
+	if (!db->listener) {
+		smap_error("%s: out of memory", db->name);
+		return -1;
+	}
+	if (PQstatus(db->listener) == CONNECTION_BAD) {
+		smap_error("%s: cannot connect: %s", db->name,
+			   PQerrorMessage(db->listener));
+		goto err;
+	}
+
+	ident = PQescapeIdentifier(db->listener, db->notify_channel,
+				   strlen(db->notify_channel));
+	if (!ident) {
+		smap_error("%s: cannot quote channel name: %s",
+			   db->name, PQerrorMessage(db->listener));
+		goto err;
+	}
+	cmd = malloc(strlen(ident) + 8);
+	if (!cmd) {
+		smap_error("not enough memory");
+		PQfreemem(ident);
+		goto err;
+	}
+	strcpy(cmd, "LISTEN ");
+	strcat(cmd, ident);
+	PQfreemem(ident);
+	smap_debug(dbgid, 1, ("%s: %s", db->name, cmd));
+	res = PQexec(db->listener, cmd);
+	free(cmd);
+	rc = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+	if (!rc) {
+		smap_error("%s: cannot listen on %s: %s", db->name,
+			   db->notify_channel, PQerrorMessage(db->listener));
+		goto err;
+	}
+	return PQsocket(db->listener);
+
+ err:
+	PQfinish(db->listener);
+	db->listener = NULL;
+	return -1;
+}
+
+static int
+modpg_notify_read(smap_database_t dbp,
+		  void (*fun)(const char *key, void *data), void *data)
+{
+	struct modpg_db *db = (struct modpg_db *)dbp;
+	PGnotify *notify;
+
+	if (!db->listener)
+		return 1;
+	if (!PQconsumeInput(db->listener)) {
+		smap_error("%s: %s", db->name, PQerrorMessage(db->listener));
+		PQfinish(db->listener);
+		db->listener = NULL;
+		return 1;
+	}
+	while ((notify = PQnotifies(db->listener)) != NULL) {
+		smap_debug(dbgid, 1, ("%s: notification on %s: %s",
+				      db->name, notify->relname,
+				      notify->extra));
+		if (notify->extra[0])
+			fun(notify->extra, data);
+		PQfreemem(notify);
+	}
+	return 0;
+}
+
+/* Return 1 if TEMPLATE refers to the client addresses */
+static int
+template_uses_conninfo(const char *template)
+{
+	const char *p;
+
+	if (!template)
+		return 0;
+	for (p = template; (p = strchr(p, '$')) != NULL; ) {
+		if (*++p == '{')
+			p++;
+		if ((strncmp(p, "src", 3) == 0 || strncmp(p, "dst", 3) == 0)
+		    && !(isalnum(p[3]) || p[3] == '_'))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+modpg_uses_conninfo(smap_database_t dbp)
+{
+	struct modpg_db *db = (struct modpg_db *)dbp;
+
+	return template_uses_conninfo(db->template)
+		|| template_uses_conninfo(modpg_batch_template(db))
+		|| template_uses_conninfo(modpg_positive_reply(db))
+		|| template_uses_conninfo(modpg_negative_reply(db))
+		|| template_uses_conninfo(modpg_onerror_reply(db));
+}
+
 struct smap_module SMAP_EXPORT(postgres, module) = {
 	SMAP_MODULE_VERSION,
-	SMAP_CAPA_QUERY,
+	SMAP_CAPA_QUERY|SMAP_CAPA_THREADSAFE|SMAP_CAPA_ASYNC|SMAP_CAPA_BATCH|
+	SMAP_CAPA_NOTIFY,
 	modpg_init,
 	modpg_init_db,
 	modpg_free_db,
 	modpg_open,
 	modpg_close,
 	modpg_query,
-	NULL /* smap_xform */
+	NULL, /* smap_xform */
+	modpg_query_submit,
+	modpg_query_fd,
+	modpg_query_complete,
+	modpg_query_cancel,
+	modpg_query_batch,
+	modpg_ping,
+	modpg_notify_fd,
+	modpg_notify_read,
+	modpg_uses_conninfo
 };
 
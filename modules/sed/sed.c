@@ -317,16 +317,46 @@ sed_query(smap_database_t dbp,
 	return rc;
 }
 
+static int
+sed_query_batch(smap_database_t dbp,
+		smap_stream_t ostr,
+		const char *map, const char **keys, size_t n,
+		struct smap_conninfo const *conninfo)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (sed_query(dbp, ostr, map, keys[i], conninfo))
+			smap_stream_printf(ostr, "NOTFOUND\n");
+	return 0;
+}
+
+static int
+sed_uses_conninfo(smap_database_t dbp)
+{
+	return 0;
+}
+
 struct smap_module SMAP_EXPORT(sed, module) = {
 	SMAP_MODULE_VERSION,
-	SMAP_CAPA_QUERY|SMAP_CAPA_XFORM,
+	SMAP_CAPA_QUERY|SMAP_CAPA_XFORM|SMAP_CAPA_THREADSAFE|SMAP_CAPA_BATCH|
+	SMAP_CAPA_FORKSAFE,
 	sed_init,
 	sed_init_db,
 	sed_free_db,
 	NULL, /* smap_open */
 	NULL, /* smap_close */
 	sed_query,
-	sed_xform
+	sed_xform,
+	NULL, /* smap_query_submit */
+	NULL, /* smap_query_fd */
+	NULL, /* smap_query_complete */
+	NULL, /* smap_query_cancel */
+	sed_query_batch,
+	NULL, /* smap_ping */
+	NULL, /* smap_notify_fd */
+	NULL, /* smap_notify_read */
+	sed_uses_conninfo
 };
 
 
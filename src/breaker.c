@@ -0,0 +1,187 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Circuit breaker.
+
+   The breaker counts consecutive failures to open the database.  When
+   their number reaches the threshold, the breaker opens: no process
+   attempts to open the database until the backoff interval expires.
+   After that, the breaker becomes half-open and lets a single process
+   probe the database.  If the probe succeeds, the breaker closes.
+   Otherwise it opens again for twice as long, up to the maximal
+   backoff interval.
+
+   The breaker state is kept in the shared memory, so that all
+   subprocesses see it. */
+
+#include "smapd.h"
+
+#define BREAKER_DEFAULT_THRESHOLD   5
+#define BREAKER_DEFAULT_MIN_BACKOFF 1000
+#define BREAKER_DEFAULT_MAX_BACKOFF 60000
+
+enum breaker_state {
+	BR_CLOSED,                  /* Database is usable */
+	BR_OPEN,                    /* Database is not used */
+	BR_HALF_OPEN                /* Database is being probed */
+};
+
+struct breaker_shm {
+	shm_lock_t lock;
+	enum breaker_state state;
+	unsigned failures;          /* Number of consecutive failures */
+	unsigned backoff;           /* Current backoff interval, ms */
+	unsigned long long until;   /* End of the open state, ms */
+	pid_t prober;               /* PID of the probing process */
+};
+
+struct breaker {
+	unsigned threshold;         /* Failures to open the breaker */
+	unsigned min_backoff;       /* Initial backoff interval, ms */
+	unsigned max_backoff;       /* Maximal backoff interval, ms */
+	struct breaker_shm *shm;
+};
+
+struct breaker *
+breaker_create()
+{
+	struct breaker *br = ecalloc(1, sizeof(*br));
+	br->threshold = BREAKER_DEFAULT_THRESHOLD;
+	br->min_backoff = BREAKER_DEFAULT_MIN_BACKOFF;
+	br->max_backoff = BREAKER_DEFAULT_MAX_BACKOFF;
+	return br;
+}
+
+void
+breaker_free(struct breaker *br)
+{
+	if (!br)
+		return;
+	shm_free(br->shm, sizeof(*br->shm));
+	free(br);
+}
+
+void
+breaker_set_threshold(struct breaker *br, unsigned threshold)
+{
+	br->threshold = threshold;
+}
+
+void
+breaker_set_backoff(struct breaker *br, unsigned min, unsigned max)
+{
+	br->min_backoff = min;
+	br->max_backoff = max;
+}
+
+int
+breaker_init(struct breaker *br)
+{
+	br->shm = shm_alloc(sizeof(*br->shm));
+	return br->shm == NULL;
+}
+
+static unsigned long long
+now_msec()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Return 1 if the database DBID may be opened. */
+int
+breaker_allow(struct breaker *br, const char *dbid)
+{
+	struct breaker_shm *shm = br->shm;
+	int rc = 1;
+
+	if (!shm)
+		return 1;
+	shm_lock(&shm->lock);
+	switch (shm->state) {
+	case BR_CLOSED:
+		break;
+
+	case BR_OPEN:
+		if (now_msec() < shm->until) {
+			rc = 0;
+			break;
+		}
+		shm->state = BR_HALF_OPEN;
+		shm->prober = getpid();
+		rc = 2;
+		break;
+
+	case BR_HALF_OPEN:
+		if (shm->prober != getpid() && shm_pid_alive(shm->prober))
+			rc = 0;
+		else
+			shm->prober = getpid();
+	}
+	shm_unlock(&shm->lock);
+	if (rc == 2) {
+		debug(DBG_DATABASE, 1, ("%s: probing database", dbid));
+		rc = 1;
+	}
+	return rc;
+}
+
+/* Register the result of an attempt to open the database DBID. */
+void
+breaker_report(struct breaker *br, const char *dbid, int success)
+{
+	struct breaker_shm *shm = br->shm;
+	enum breaker_state ostate, nstate;
+	unsigned failures, backoff;
+
+	if (!shm)
+		return;
+	shm_lock(&shm->lock);
+	ostate = shm->state;
+	if (success) {
+		shm->state = BR_CLOSED;
+		shm->failures = 0;
+		shm->backoff = 0;
+	} else if (shm->state == BR_HALF_OPEN) {
+		shm->backoff *= 2;
+		if (shm->backoff > br->max_backoff)
+			shm->backoff = br->max_backoff;
+		shm->state = BR_OPEN;
+		shm->until = now_msec() + shm->backoff;
+	} else if (shm->state == BR_CLOSED
+		   && ++shm->failures >= br->threshold) {
+		shm->backoff = br->min_backoff;
+		shm->state = BR_OPEN;
+		shm->until = now_msec() + shm->backoff;
+	}
+	nstate = shm->state;
+	failures = shm->failures;
+	backoff = shm->backoff;
+	shm_unlock(&shm->lock);
+
+	if (success) {
+		if (ostate != BR_CLOSED)
+			smap_error("%s: database is usable again", dbid);
+	} else if (ostate == BR_HALF_OPEN)
+		smap_error("%s: probe failed, database disabled for %u ms",
+			   dbid, backoff);
+	else if (ostate == BR_CLOSED && nstate == BR_OPEN)
+		smap_error("%s: %u consecutive failures, database disabled "
+			   "for %u ms",
+			   dbid, failures, backoff);
+}
@@ -0,0 +1,819 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Connection broker.
+
+   A database may be served by a pool of broker processes, each of
+   which keeps a single connection to the backend.  The master forks
+   them at startup and restarts them if they die.  Brokers listen on a
+   common UNIX socket.  Subprocesses serving sendmail sessions do not
+   open the database: the master replaces its module with a proxy,
+   which passes each query to a broker over that socket and relays
+   the reply.  Thus the number of backend connections does not depend
+   on the number of sessions.  Change notifications are still received
+   by the master using the real module.  Batch queries are not passed
+   to brokers: the keys are sent one by one.
+
+   The master learns about terminated brokers from the server manager,
+   which reaps all subprocesses.  A broker is restarted at once,
+   unless it has run for less than BROKER_RESTART_DELAY seconds, in
+   which case the restart is delayed by that many seconds.
+
+   A broker serves one query at a time.  It takes pending queries from
+   its clients in turn, so that a busy client cannot monopolize it.
+   If the number of queries waiting in a broker reaches the queue
+   limit, further queries are refused and replied to as if the
+   database could not be opened. */
+
+#include "smapd.h"
+#include <poll.h>
+#include <pthread.h>
+
+#define BROKER_DEFAULT_QUEUE 0
+
+/* Query request, followed by the map, key, source and destination
+   addresses */
+struct broker_request {
+	uint32_t maplen;
+	uint32_t keylen;
+	uint32_t srclen;
+	uint32_t dstlen;
+	uint32_t timeout;           /* Time left to the deadline, ms, or 0 */
+};
+
+/* Reply, followed by REPLEN bytes of text */
+struct broker_reply {
+	int32_t rc;                 /* Return code of smap_query */
+	uint32_t replen;
+};
+
+/* Return code of a refused query */
+#define BROKER_REFUSED (-1)
+
+struct broker_pool {
+	unsigned size;              /* Number of broker processes */
+	unsigned queue;             /* Maximal number of waiting queries */
+	char *socket;               /* Socket file name */
+	int fd;                     /* Listening socket */
+	pid_t *pidv;                /* Broker PIDs, 0 if not running */
+	time_t *timev;              /* Start time of each running broker,
+				       earliest restart time of the others */
+	struct smap_database_instance *dbi;
+	struct smap_module_instance *inst;  /* Real module */
+	smap_database_t dbh;        /* Real database handle */
+	struct smap_module proxy;   /* Proxy module and its instance */
+	struct smap_module_instance proxy_inst;
+	/* Client side */
+	int cfd;                    /* Connection to a broker */
+	pthread_mutex_t mutex;      /* Serializes use of CFD */
+};
+
+struct broker_pool *
+broker_pool_create()
+{
+	struct broker_pool *bp = ecalloc(1, sizeof(*bp));
+	bp->queue = BROKER_DEFAULT_QUEUE;
+	bp->fd = -1;
+	bp->cfd = -1;
+	pthread_mutex_init(&bp->mutex, NULL);
+	return bp;
+}
+
+void
+broker_pool_free(struct broker_pool *bp)
+{
+	if (!bp)
+		return;
+	free(bp->socket);
+	free(bp->pidv);
+	free(bp->timev);
+	pthread_mutex_destroy(&bp->mutex);
+	free(bp);
+}
+
+void
+broker_pool_set_size(struct broker_pool *bp, unsigned size)
+{
+	bp->size = size;
+}
+
+void
+broker_pool_set_queue(struct broker_pool *bp, unsigned queue)
+{
+	bp->queue = queue;
+}
+
+void
+broker_pool_set_socket(struct broker_pool *bp, const char *file)
+{
+	free(bp->socket);
+	bp->socket = estrdup(file);
+}
+
+/* Check the settings of the pool BP of database DBI.  Return 0 if
+   the pool can be used. */
+int
+broker_pool_init(struct broker_pool *bp, struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+
+	if (bp->size == 0)
+		return 1;
+	if (!(mod->smap_capabilities & SMAP_CAPA_QUERY)) {
+		smap_error("%s:%u: module %s cannot be used by a broker",
+			   dbi->file, dbi->line, dbi->modname);
+		return 1;
+	}
+	if (!bp->socket) {
+		smap_error("%s:%u: broker socket not specified",
+			   dbi->file, dbi->line);
+		return 1;
+	}
+	if (strlen(bp->socket) >=
+	    sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		smap_error("%s:%u: broker socket name too long",
+			   dbi->file, dbi->line);
+		return 1;
+	}
+	if (batch_size > 1 && mod->smap_version > 2
+	    && (mod->smap_capabilities & SMAP_CAPA_BATCH))
+		smap_error("%s:%u: batch queries are not passed to "
+			   "connection brokers, keys will be looked up "
+			   "one by one", dbi->file, dbi->line);
+	bp->dbi = dbi;
+	bp->pidv = ecalloc(bp->size, sizeof(bp->pidv[0]));
+	bp->timev = ecalloc(bp->size, sizeof(bp->timev[0]));
+	return 0;
+}
+
+static int
+full_read(int fd, void *buf, size_t size)
+{
+	char *p = buf;
+
+	while (size) {
+		ssize_t n = read(fd, p, size);
+		if (n == 0)
+			return EIO;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int
+full_write(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void
+fill_sockaddr(struct sockaddr_un *sun, const char *file)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, file);
+}
+
+
+/* Broker process */
+
+struct broker_client {
+	int fd;
+	int pending;                /* A query is waiting */
+	struct broker_request req;
+	char *buf;                  /* Map, key and addresses */
+	size_t bufsize;
+	struct timeval deadline;    /* Deadline of the waiting query */
+};
+
+static int
+broker_send_reply(int fd, int rc, const char *text)
+{
+	struct broker_reply rep;
+	int ec;
+
+	rep.rc = rc;
+	rep.replen = strlen(text);
+	ec = full_write(fd, &rep, sizeof(rep));
+	if (ec == 0)
+		ec = full_write(fd, text, rep.replen);
+	return ec;
+}
+
+/* Read the query from the client CP.  Return 0 on success. */
+static int
+broker_read_request(struct broker_client *cp)
+{
+	size_t len;
+	int rc;
+
+	rc = full_read(cp->fd, &cp->req, sizeof(cp->req));
+	if (rc)
+		return rc;
+	len = (size_t) cp->req.maplen + cp->req.keylen + 2
+		+ cp->req.srclen + cp->req.dstlen;
+	if (len > cp->bufsize) {
+		cp->buf = erealloc(cp->buf, len);
+		cp->bufsize = len;
+	}
+	rc = full_read(cp->fd, cp->buf, cp->req.maplen + 1);
+	if (rc == 0)
+		rc = full_read(cp->fd, cp->buf + cp->req.maplen + 1,
+			       len - cp->req.maplen - 1);
+	if (rc)
+		return rc;
+	if (cp->buf[cp->req.maplen]
+	    || cp->buf[cp->req.maplen + 1 + cp->req.keylen]
+	    || cp->req.srclen > sizeof(struct sockaddr_storage)
+	    || cp->req.dstlen > sizeof(struct sockaddr_storage))
+		return EPROTO;
+	if (cp->req.timeout) {
+		gettimeofday(&cp->deadline, NULL);
+		cp->deadline.tv_sec += cp->req.timeout / 1000;
+		cp->deadline.tv_usec += (cp->req.timeout % 1000) * 1000;
+		if (cp->deadline.tv_usec >= 1000000) {
+			cp->deadline.tv_sec++;
+			cp->deadline.tv_usec -= 1000000;
+		}
+	}
+	cp->pending = 1;
+	return 0;
+}
+
+/* Read the query from the client CP and queue it, unless the queue
+   is full.  WAITING is the number of queries in the queue.  Return
+   non-zero if the client must be disconnected. */
+static int
+broker_take_request(struct broker_pool *bp, struct broker_client *cp,
+		    size_t *waiting)
+{
+	if (broker_read_request(cp))
+		return 1;
+	if (!bp->queue || *waiting < bp->queue) {
+		++*waiting;
+		return 0;
+	}
+	debug(DBG_QUERY, 1, ("%s: queue full, query refused", bp->dbi->id));
+	cp->pending = 0;
+	return broker_send_reply(cp->fd, BROKER_REFUSED, "");
+}
+
+/* Run the query waiting in CP and send the reply.  Return 0 on
+   success. */
+static int
+broker_serve(struct broker_pool *bp, struct broker_client *cp,
+	     smap_stream_t str)
+{
+	struct smap_database_instance *dbi = bp->dbi;
+	struct sockaddr_storage src, dst;
+	struct smap_conninfo ci;
+	const char *map = cp->buf;
+	const char *key = cp->buf + cp->req.maplen + 1;
+	const char *p = key + cp->req.keylen + 1;
+	const char *text;
+	int rc;
+
+	cp->pending = 0;
+	memset(&src, 0, sizeof(src));
+	memcpy(&src, p, cp->req.srclen);
+	memset(&dst, 0, sizeof(dst));
+	memcpy(&dst, p + cp->req.srclen, cp->req.dstlen);
+	ci.src = (struct sockaddr *) &src;
+	ci.srclen = cp->req.srclen;
+	ci.dst = (struct sockaddr *) &dst;
+	ci.dstlen = cp->req.dstlen;
+	ci.deadline = cp->req.timeout ? &cp->deadline : NULL;
+
+	if (smap_deadline_left(&ci) == 0) {
+		debug(DBG_QUERY, 1, ("%s: query %s %s: deadline expired",
+				     dbi->id, map, key));
+		return broker_send_reply(cp->fd, 0, DEADLINE_REPLY "\n");
+	}
+	if (database_open(dbi))
+		return broker_send_reply(cp->fd, BROKER_REFUSED, "");
+	smap_stream_truncate(str, 0);
+	rc = dbi->inst->module->smap_query(dbi->dbh, str, map, key, &ci);
+	smap_stream_flush(str);
+	if (smap_stream_ioctl(str, SMAP_IOCTL_GET_BUFFER, &text))
+		text = "";
+	return broker_send_reply(cp->fd, rc, text);
+}
+
+static RETSIGTYPE
+broker_sigterm(int sig)
+{
+	_exit(0);
+}
+
+/* Main loop of a broker process */
+static void
+broker_run(struct broker_pool *bp)
+{
+	struct smap_database_instance *dbi = bp->dbi;
+	struct broker_client *clv = NULL;
+	struct pollfd *pfd = NULL;
+	size_t clc = 0, clmax = 0;
+	size_t next = 0;            /* Client to be served next */
+	size_t waiting = 0;         /* Number of pending queries */
+	smap_stream_t str;
+	size_t i, j, n;
+
+	signal(SIGTERM, broker_sigterm);
+	signal(SIGHUP, broker_sigterm);
+	signal(SIGINT, broker_sigterm);
+	signal(SIGQUIT, broker_sigterm);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Use the real module */
+	dbi->inst = bp->inst;
+	dbi->dbh = bp->dbh;
+	dbi->opened = 0;
+
+	if (smap_memory_stream_create(&str)) {
+		smap_error("%s: cannot create memory stream", dbi->id);
+		_exit(EX_UNAVAILABLE);
+	}
+	debug(DBG_DATABASE, 1, ("%s: broker started", dbi->id));
+	database_open(dbi);
+	for (;;) {
+		int rc;
+
+		if (clc + 1 > clmax) {
+			clmax = clc + 16;
+			clv = erealloc(clv, clmax * sizeof(clv[0]));
+			pfd = erealloc(pfd, (clmax + 1) * sizeof(pfd[0]));
+		}
+		pfd[0].fd = bp->fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < clc; i++) {
+			pfd[i + 1].fd = clv[i].fd;
+			pfd[i + 1].events = clv[i].pending ? 0 : POLLIN;
+		}
+		rc = poll(pfd, clc + 1, waiting ? 0 : -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			smap_error("%s: poll: %s", dbi->id, strerror(errno));
+			_exit(EX_UNAVAILABLE);
+		}
+
+		/* Read incoming queries, in the order of connection */
+		n = next;
+		for (i = j = 0; i < clc; i++) {
+			if (pfd[i + 1].revents && !clv[i].pending
+			    && broker_take_request(bp, &clv[i], &waiting)) {
+				close(clv[i].fd);
+				free(clv[i].buf);
+				if (i < next)
+					n--;
+				continue;
+			}
+			clv[j++] = clv[i];
+		}
+		clc = j;
+		next = n;
+
+		/* Accept new clients */
+		if (pfd[0].revents & POLLIN) {
+			int fd;
+
+			while ((fd = accept(bp->fd, NULL, NULL)) >= 0) {
+				if (clc == clmax) {
+					clmax += 16;
+					clv = erealloc(clv,
+						       clmax * sizeof(clv[0]));
+					pfd = erealloc(pfd, (clmax + 1)
+						       * sizeof(pfd[0]));
+				}
+				memset(&clv[clc], 0, sizeof(clv[0]));
+				clv[clc++].fd = fd;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK
+			    && errno != EINTR)
+				smap_error("%s: accept: %s",
+					   dbi->id, strerror(errno));
+			debug(DBG_DATABASE, 2,
+			      ("%s: broker has %lu clients",
+			       dbi->id, (unsigned long) clc));
+		}
+
+		/* Serve the next pending query, in turn */
+		if (waiting) {
+			for (i = 0; i < clc; i++) {
+				n = (next + i) % clc;
+				if (clv[n].pending) {
+					waiting--;
+					if (broker_serve(bp, &clv[n], str)) {
+						/* The client will be
+						   removed when its
+						   connection is found
+						   closed */
+						shutdown(clv[n].fd, SHUT_RDWR);
+					}
+					next = n + 1;
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void
+broker_start(struct broker_pool *bp, unsigned n)
+{
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		smap_error("%s: cannot start broker: %s",
+			   bp->dbi->id, strerror(errno));
+		return;
+	}
+	if (pid == 0) {
+		fd_set fdset;
+
+		FD_ZERO(&fdset);
+		FD_SET(bp->fd, &fdset);
+		if (log_to_stderr) {
+			FD_SET(1, &fdset);
+			FD_SET(2, &fdset);
+		}
+		close_fds_except(&fdset);
+		broker_run(bp);
+	}
+	bp->pidv[n] = pid;
+	bp->timev[n] = time(NULL);
+}
+
+static int
+broker_listen(struct broker_pool *bp)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (stat(bp->socket, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			smap_error("%s: file %s is not a socket",
+				   bp->dbi->id, bp->socket);
+			return 1;
+		}
+		unlink(bp->socket);
+	}
+	fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		smap_error("%s: cannot create socket: %s",
+			   bp->dbi->id, strerror(errno));
+		return 1;
+	}
+	fill_sockaddr(&sun, bp->socket);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun))
+	    || listen(fd, SOMAXCONN)) {
+		smap_error("%s: cannot listen on %s: %s",
+			   bp->dbi->id, bp->socket, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	bp->fd = fd;
+	return 0;
+}
+
+
+/* Proxy module used by the subprocesses */
+
+static int
+proxy_open(smap_database_t dbh)
+{
+	struct broker_pool *bp = (struct broker_pool *) dbh;
+	struct sockaddr_un sun;
+	int fd;
+
+	fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		smap_error("%s: cannot create socket: %s",
+			   bp->dbi->id, strerror(errno));
+		return 1;
+	}
+	fill_sockaddr(&sun, bp->socket);
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+		smap_error("%s: cannot connect to broker: %s",
+			   bp->dbi->id, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	bp->cfd = fd;
+	return 0;
+}
+
+static int
+proxy_close(smap_database_t dbh)
+{
+	struct broker_pool *bp = (struct broker_pool *) dbh;
+
+	if (bp->cfd != -1) {
+		close(bp->cfd);
+		bp->cfd = -1;
+	}
+	return 0;
+}
+
+/* Handle the failure to pass the query to a broker as if the database
+   could not be opened */
+static int
+proxy_failure(struct smap_database_instance *dbi, smap_stream_t ostr)
+{
+	return database_failure(dbi, ostr) ? QUERY_NEXT_RULE : 0;
+}
+
+/* Wait for the reply on FD until the query deadline.  Return 0 if
+   it has arrived. */
+static int
+proxy_wait(int fd, struct smap_conninfo const *conninfo)
+{
+	struct pollfd pfd;
+	long left = smap_deadline_left(conninfo);
+	int rc;
+
+	if (left == -1)
+		return 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do
+		rc = poll(&pfd, 1, left);
+	while (rc < 0 && errno == EINTR);
+	return rc != 1;
+}
+
+static int
+proxy_query(smap_database_t dbh, smap_stream_t ostr,
+	    const char *map, const char *key,
+	    struct smap_conninfo const *conninfo)
+{
+	struct broker_pool *bp = (struct broker_pool *) dbh;
+	struct smap_database_instance *dbi = bp->dbi;
+	struct broker_request req;
+	struct broker_reply rep;
+	long left = smap_deadline_left(conninfo);
+	char *buf, *p;
+	size_t len;
+	int rc;
+
+	pthread_mutex_lock(&bp->mutex);
+	if (bp->cfd == -1 && proxy_open(dbh)) {
+		pthread_mutex_unlock(&bp->mutex);
+		return proxy_failure(dbi, ostr);
+	}
+
+	req.maplen = strlen(map);
+	req.keylen = strlen(key);
+	req.srclen = conninfo->src ? conninfo->srclen : 0;
+	req.dstlen = conninfo->dst ? conninfo->dstlen : 0;
+	req.timeout = left == -1 ? 0 : (left ? left : 1);
+	len = sizeof(req) + req.maplen + req.keylen + 2
+		+ req.srclen + req.dstlen;
+	p = buf = emalloc(len);
+	memcpy(p, &req, sizeof(req));
+	p += sizeof(req);
+	memcpy(p, map, req.maplen + 1);
+	p += req.maplen + 1;
+	memcpy(p, key, req.keylen + 1);
+	p += req.keylen + 1;
+	memcpy(p, conninfo->src, req.srclen);
+	p += req.srclen;
+	memcpy(p, conninfo->dst, req.dstlen);
+	rc = full_write(bp->cfd, buf, len);
+	free(buf);
+
+	if (rc == 0 && proxy_wait(bp->cfd, conninfo)) {
+		/* The reply would arrive out of order: drop the
+		   connection */
+		debug(DBG_QUERY, 1, ("query %s %s: deadline expired",
+				     map, key));
+		proxy_close(dbh);
+		pthread_mutex_unlock(&bp->mutex);
+		smap_stream_printf(ostr, "%s\n", DEADLINE_REPLY);
+		return 0;
+	}
+	if (rc == 0)
+		rc = full_read(bp->cfd, &rep, sizeof(rep));
+	if (rc == 0) {
+		buf = emalloc(rep.replen + 1);
+		rc = full_read(bp->cfd, buf, rep.replen);
+		buf[rep.replen] = 0;
+	}
+	if (rc) {
+		smap_error("%s: broker connection failed: %s",
+			   dbi->id, strerror(rc));
+		proxy_close(dbh);
+		pthread_mutex_unlock(&bp->mutex);
+		return proxy_failure(dbi, ostr);
+	}
+	pthread_mutex_unlock(&bp->mutex);
+
+	if (rep.rc == BROKER_REFUSED)
+		rc = proxy_failure(dbi, ostr);
+	else {
+		smap_stream_write(ostr, buf, rep.replen, NULL);
+		rc = rep.rc;
+	}
+	free(buf);
+	return rc;
+}
+
+/* Change notifications are received by the master using the real
+   module */
+static int
+proxy_notify_fd(smap_database_t dbh)
+{
+	struct broker_pool *bp = (struct broker_pool *) dbh;
+
+	return bp->inst->module->smap_notify_fd(bp->dbh);
+}
+
+static int
+proxy_notify_read(smap_database_t dbh,
+		  void (*fun)(const char *key, void *data), void *data)
+{
+	struct broker_pool *bp = (struct broker_pool *) dbh;
+
+	return bp->inst->module->smap_notify_read(bp->dbh, fun, data);
+}
+
+static int
+proxy_uses_conninfo(smap_database_t dbh)
+{
+	struct broker_pool *bp = (struct broker_pool *) dbh;
+	struct smap_module *mod = bp->inst->module;
+
+	return !(mod->smap_version > 2
+		 && mod->smap_uses_conninfo
+		 && mod->smap_uses_conninfo(bp->dbh) == 0);
+}
+
+static struct smap_module proxy_module = {
+	SMAP_MODULE_VERSION,
+	SMAP_CAPA_QUERY|SMAP_CAPA_THREADSAFE,
+	NULL, /* smap_init */
+	NULL, /* smap_init_db */
+	NULL, /* smap_free_db */
+	proxy_open,
+	proxy_close,
+	proxy_query,
+	NULL, /* smap_xform */
+	NULL, /* smap_query_submit */
+	NULL, /* smap_query_fd */
+	NULL, /* smap_query_complete */
+	NULL, /* smap_query_cancel */
+	NULL, /* smap_query_batch */
+	NULL, /* smap_ping */
+	proxy_notify_fd,
+	proxy_notify_read,
+	proxy_uses_conninfo
+};
+
+static struct smap_module_instance proxy_instance = {
+	NULL, NULL,
+	__FILE__, __LINE__,
+	"broker",
+	0, NULL,
+	&proxy_module,
+};
+
+
+/* Start the broker pool of database DBI.  From then on, the database
+   is queried through the brokers. */
+void
+broker_pool_start(struct smap_database_instance *dbi)
+{
+	struct broker_pool *bp = dbi->broker_pool;
+	unsigned i;
+
+	if (broker_listen(bp))
+		return;
+	bp->inst = dbi->inst;
+	bp->dbh = dbi->dbh;
+	for (i = 0; i < bp->size; i++)
+		broker_start(bp, i);
+	bp->proxy = proxy_module;
+	if (bp->inst->module->smap_version > 2)
+		bp->proxy.smap_capabilities |=
+			bp->inst->module->smap_capabilities
+			& SMAP_CAPA_NOTIFY;
+	bp->proxy_inst = proxy_instance;
+	bp->proxy_inst.module = &bp->proxy;
+	dbi->inst = &bp->proxy_inst;
+	dbi->dbh = (smap_database_t) bp;
+	smap_error("%s: started %u brokers on %s", dbi->id, bp->size,
+		   bp->socket);
+}
+
+/* Record the termination of the process PID with STATUS, if it is a
+   broker of database DBI.  Return 1 if it is. */
+int
+broker_pool_exited(struct smap_database_instance *dbi, pid_t pid,
+		   int status)
+{
+	struct broker_pool *bp = dbi->broker_pool;
+	time_t now = time(NULL);
+	unsigned i;
+
+	if (bp->fd == -1)
+		return 0;
+	for (i = 0; i < bp->size; i++) {
+		if (bp->pidv[i] != pid)
+			continue;
+		if (WIFEXITED(status))
+			smap_error("%s: broker %lu exited with status %d",
+				   dbi->id, (unsigned long) pid,
+				   WEXITSTATUS(status));
+		else if (WIFSIGNALED(status))
+			smap_error("%s: broker %lu terminated on signal %d",
+				   dbi->id, (unsigned long) pid,
+				   WTERMSIG(status));
+		else
+			smap_error("%s: broker %lu terminated",
+				   dbi->id, (unsigned long) pid);
+		bp->pidv[i] = 0;
+		if (now - bp->timev[i] < BROKER_RESTART_DELAY)
+			bp->timev[i] = now + BROKER_RESTART_DELAY;
+		else
+			bp->timev[i] = now;
+		return 1;
+	}
+	return 0;
+}
+
+/* Restart brokers of database DBI that have terminated */
+void
+broker_pool_check(struct smap_database_instance *dbi)
+{
+	struct broker_pool *bp = dbi->broker_pool;
+	time_t now = time(NULL);
+	unsigned i;
+
+	if (bp->fd == -1)
+		return;
+	for (i = 0; i < bp->size; i++) {
+		if (bp->pidv[i] || now < bp->timev[i])
+			continue;
+		debug(DBG_DATABASE, 1, ("%s: restarting broker %u",
+					dbi->id, i));
+		broker_start(bp, i);
+	}
+}
+
+/* Terminate the brokers of database DBI and restore its module */
+void
+broker_pool_stop(struct smap_database_instance *dbi)
+{
+	struct broker_pool *bp = dbi->broker_pool;
+	unsigned i;
+
+	if (bp->fd == -1)
+		return;
+	for (i = 0; i < bp->size; i++) {
+		if (bp->pidv[i] > 0) {
+			kill(bp->pidv[i], SIGTERM);
+			waitpid(bp->pidv[i], NULL, 0);
+			bp->pidv[i] = 0;
+		}
+	}
+	close(bp->fd);
+	bp->fd = -1;
+	unlink(bp->socket);
+	proxy_close(dbi->dbh);
+	dbi->inst = bp->inst;
+	dbi->dbh = bp->dbh;
+	dbi->opened = 0;
+}
@@ -21,6 +21,7 @@ const char *cfg_file_name;
 unsigned cfg_line;
 unsigned cfg_cur_line;
 int cfg_errors;
+static const char *cfg_line_text;  /* Current line, as read */
 
 #define INITBUFSIZE 512
 #define MINBUFSIZE  8
@@ -84,6 +85,55 @@ find_cfg_kw(struct cfg_kw *kwtab, const char *word)
 	return NULL;
 }
 
+/* Return 1 if the last word of the current line, as read from the
+   file, is WORD written literally, i.e. neither quoted, nor escaped,
+   nor obtained by variable expansion.  The quoting rules are those of
+   parse_config_loop. */
+int
+cfg_last_word_is(const char *word)
+{
+	const char *p = cfg_line_text;
+	const char *start = NULL, *end = NULL;
+	int literal = 0;
+
+	if (!p)
+		return 0;
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == 0 || *p == '#')
+			break;
+		start = p;
+		literal = 1;
+		while (*p && *p != ' ' && *p != '\t' && *p != '#') {
+			if (*p == '\\') {
+				literal = 0;
+				if (*++p)
+					p++;
+			} else if (*p == '\'' || *p == '"') {
+				int q = *p++;
+
+				literal = 0;
+				while (*p && *p != q) {
+					if (q == '"' && *p == '\\' && p[1])
+						p++;
+					p++;
+				}
+				if (*p)
+					p++;
+			} else {
+				if (*p == '$')
+					literal = 0;
+				p++;
+			}
+		}
+		end = p;
+	}
+	return start && literal
+		&& (size_t) (end - start) == strlen(word)
+		&& memcmp(start, word, end - start) == 0;
+}
+
 int
 cfg_chkargc(int wordc, int min, int max)
 {
@@ -127,6 +177,41 @@ cfg_parse_bool(const char *str, int *res)
 	return 0;
 }
 
+/* Parse time interval STR.  It is either a number of seconds
+   (possibly fractional), or a number of milliseconds, if followed by
+   the "ms" suffix.  Store the value, in milliseconds, in RES. */
+int
+cfg_parse_msec(const char *str, unsigned *res)
+{
+	char *p;
+	unsigned long n, frac = 0, scale = 1000;
+
+	n = strtoul(str, &p, 10);
+	if (p == str)
+		goto err;
+	if (strcmp(p, "ms") == 0) {
+		scale = 1;
+	} else {
+		if (*p == '.') {
+			unsigned long m = 100;
+			for (p++; *p >= '0' && *p <= '9'; p++) {
+				frac += (*p - '0') * m;
+				m /= 10;
+			}
+		}
+		if (*p && strcmp(p, "s"))
+			goto err;
+	}
+	if ((*res = n * scale + frac) / scale != n)
+		goto err;
+	return 0;
+ err:
+	smap_error("%s:%u: invalid time interval: %s",
+		   cfg_file_name, cfg_line, str);
+	cfg_errors = 1;
+	return 1;
+}
+
 static void
 parse_int(const char *str, int base, int sign, int *res)
 {
@@ -393,7 +478,11 @@ parse_config_loop(struct cfg_kw *kwtab, void *data)
 			abort();
 		}
 		if (kwp->fun) {
-			int rc = kwp->fun(kwp, ws.ws_wordc, ws.ws_wordv, data);
+			int rc;
+
+			cfg_line_text = buf;
+			rc = kwp->fun(kwp, ws.ws_wordc, ws.ws_wordv, data);
+			cfg_line_text = NULL;
 			if (eof) {
 				if (rc < 0) {
 					cfg_errors = 1;
@@ -0,0 +1,374 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Coalescing of identical in-flight queries.
+
+   Each database that has coalescing enabled owns a table of slots in
+   the shared memory.  A process that is about to query the database
+   first looks up the (map, key) pair in the table.  If the replies of
+   the database may depend on the client addresses, these are part of
+   the looked up key as well.  If it is not
+   there, the process occupies a free slot (becoming the "leader"),
+   runs the query, capturing its output, and publishes the reply in
+   the slot.  A process that finds the pair already in flight becomes
+   a "follower": it waits for the leader to publish the reply and
+   sends the same bytes to its client.  The last process to leave
+   the slot frees it.
+
+   Followers fall back to querying the database themselves if the
+   leader dies, if the reply does not fit into the slot, or if it does
+   not arrive within the configured timeout.  They never wait past the
+   query deadline, though: when it expires, the TEMP reply is sent.
+   The leader does not publish that reply, should its own deadline
+   expire: the followers then query the database themselves. */
+
+#include "smapd.h"
+
+#define COALESCE_SLOTS      64
+#define COALESCE_KEY_MAX    256
+#define COALESCE_REPLY_MAX  4096
+#define COALESCE_DEFAULT_TIMEOUT 5000
+
+enum coalesce_state {
+	CF_FREE,               /* Slot is free */
+	CF_PENDING,            /* Query is in flight */
+	CF_DONE,               /* Reply is ready */
+	CF_FAILED              /* Reply could not be stored */
+};
+
+struct coalesce_slot {
+	enum coalesce_state state;
+	unsigned gen;               /* Generation number */
+	pid_t owner;                /* PID of the leader */
+	time_t done_time;           /* Time the reply was published */
+	unsigned waiters;           /* Number of followers */
+	smap_hash_t hash;           /* Hash of the key */
+	size_t keylen;              /* Length of the key */
+	char key[COALESCE_KEY_MAX]; /* Map and key, separated by \0 */
+	int rc;                     /* Return code from smap_query */
+	size_t replen;              /* Length of the reply */
+	char reply[COALESCE_REPLY_MAX];
+};
+
+struct coalesce_shm {
+	shm_lock_t lock;
+	struct coalesce_slot slot[COALESCE_SLOTS];
+};
+
+struct coalesce {
+	unsigned timeout;           /* Follower timeout, in milliseconds */
+	int conninfo;               /* Include client addresses in keys */
+	struct coalesce_shm *shm;
+};
+
+static smap_stream_t capture_str;
+
+struct coalesce *
+coalesce_create()
+{
+	struct coalesce *cf = ecalloc(1, sizeof(*cf));
+	cf->timeout = COALESCE_DEFAULT_TIMEOUT;
+	return cf;
+}
+
+void
+coalesce_free(struct coalesce *cf)
+{
+	if (!cf)
+		return;
+	shm_free(cf->shm, sizeof(*cf->shm));
+	free(cf);
+}
+
+void
+coalesce_set_timeout(struct coalesce *cf, unsigned timeout)
+{
+	cf->timeout = timeout;
+}
+
+/* Initialize coalescing.  CONNINFO is 1 if the replies of the
+   database may depend on the client addresses. */
+int
+coalesce_init(struct coalesce *cf, int conninfo)
+{
+	cf->conninfo = conninfo;
+	cf->shm = shm_alloc(sizeof(*cf->shm));
+	return cf->shm == NULL;
+}
+
+/* Append the address SA of length LEN to the key in BUF, which is
+   *PLEN bytes long.  Return 0 on success, 1 if it does not fit. */
+static int
+coalesce_key_addr(char *buf, size_t *plen,
+		  struct sockaddr const *sa, int len)
+{
+	if (!sa || len < 0)
+		len = 0;
+	if (*plen + sizeof(len) + len > COALESCE_KEY_MAX)
+		return 1;
+	memcpy(buf + *plen, &len, sizeof(len));
+	*plen += sizeof(len);
+	memcpy(buf + *plen, sa, len);
+	*plen += len;
+	return 0;
+}
+
+static size_t
+coalesce_key(struct coalesce *cf, char *buf, const char *map,
+	     const char *key, struct smap_conninfo const *conninfo)
+{
+	size_t mlen = strlen(map);
+	size_t klen = strlen(key);
+	size_t len;
+
+	if (mlen + klen + 1 > COALESCE_KEY_MAX)
+		return 0;
+	memcpy(buf, map, mlen);
+	buf[mlen++] = 0;
+	memcpy(buf + mlen, key, klen);
+	len = mlen + klen;
+	if (cf->conninfo && conninfo
+	    && (coalesce_key_addr(buf, &len, conninfo->src,
+				  conninfo->srclen)
+		|| coalesce_key_addr(buf, &len, conninfo->dst,
+				     conninfo->dstlen)))
+		return 0;
+	return len;
+}
+
+/* Return 1 if the reply BUF of SIZE bytes, obtained by the leader,
+   must not be passed to the followers */
+static int
+reply_private(struct smap_conninfo const *conninfo,
+	      const char *buf, size_t size)
+{
+	static char deadline_reply[] = DEADLINE_REPLY "\n";
+
+	/* The deadline of the followers may not have expired yet */
+	return smap_deadline_left(conninfo) == 0
+		|| (size == sizeof(deadline_reply) - 1
+		    && memcmp(buf, deadline_reply, size) == 0);
+}
+
+static void
+slot_release(struct coalesce_slot *sp)
+{
+	sp->state = CF_FREE;
+	sp->waiters = 0;
+	sp->owner = 0;
+	sp->gen++;
+}
+
+/* Return 1 if the slot SP can be reused, although it is not free.
+   This happens if its leader has died before publishing the reply,
+   or if a follower has died before collecting it. */
+static int
+slot_stale(struct coalesce *cf, struct coalesce_slot *sp, time_t now)
+{
+	switch (sp->state) {
+	case CF_PENDING:
+		return !shm_pid_alive(sp->owner);
+	case CF_DONE:
+	case CF_FAILED:
+		return now - sp->done_time > 2 * (cf->timeout / 1000 + 1);
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* Run FUN with CLOSURE and OSTR, unless an identical query is already
+   in flight, in which case wait for its reply, but not longer than the
+   query deadline from CONNINFO.  Return the value returned by the
+   query function. */
+int
+coalesce_run(struct coalesce *cf, const char *dbid,
+	     const char *map, const char *key,
+	     struct smap_conninfo const *conninfo, smap_stream_t ostr,
+	     int (*fun)(void *, smap_stream_t), void *closure)
+{
+	char keybuf[COALESCE_KEY_MAX];
+	size_t keylen;
+	smap_hash_t hash;
+	struct coalesce_shm *shm = cf->shm;
+	struct coalesce_slot *sp, *freeslot = NULL;
+	unsigned gen;
+	int i, rc;
+	time_t now;
+	const char *buf;
+	smap_off_t size;
+
+	if (!shm
+	    || (keylen = coalesce_key(cf, keybuf, map, key, conninfo)) == 0)
+		return fun(closure, ostr);
+	hash = smap_strhash(keybuf, keylen, 0);
+	now = time(NULL);
+
+	shm_lock(&shm->lock);
+	for (i = 0; i < COALESCE_SLOTS; i++) {
+		sp = &shm->slot[i];
+		if (sp->state == CF_PENDING
+		    && sp->hash == hash
+		    && sp->keylen == keylen
+		    && memcmp(sp->key, keybuf, keylen) == 0
+		    && sp->owner != getpid())
+			break;
+		if (!freeslot
+		    && (sp->state == CF_FREE || slot_stale(cf, sp, now)))
+			freeslot = sp;
+	}
+
+	if (i < COALESCE_SLOTS) {
+		/* Follower */
+		struct timeval start, tv;
+		unsigned delay = 500;
+
+		sp->waiters++;
+		gen = sp->gen;
+		shm_unlock(&shm->lock);
+
+		debug(DBG_QUERY, 2,
+		      ("%s: waiting for in-flight query %s %s",
+		       dbid, map, key));
+		gettimeofday(&start, NULL);
+		while (1) {
+			unsigned long elapsed;
+			long left = smap_deadline_left(conninfo);
+
+			if (left >= 0 && left * 1000 < delay)
+				usleep(left * 1000);
+			else {
+				usleep(delay);
+				if (delay < 10000)
+					delay *= 2;
+			}
+
+			shm_lock(&shm->lock);
+			if (sp->gen != gen) {
+				/* Slot was reclaimed */
+				shm_unlock(&shm->lock);
+				break;
+			}
+			if (sp->state == CF_DONE) {
+				char reply[COALESCE_REPLY_MAX];
+				size_t replen = sp->replen;
+
+				memcpy(reply, sp->reply, replen);
+				rc = sp->rc;
+				if (--sp->waiters == 0)
+					slot_release(sp);
+				shm_unlock(&shm->lock);
+				debug(DBG_QUERY, 1,
+				      ("%s: using reply of the coalesced "
+				       "query %s %s", dbid, map, key));
+				if (replen)
+					smap_stream_write(ostr, reply,
+							  replen, NULL);
+				return rc;
+			}
+			if (sp->state != CF_PENDING
+			    || !shm_pid_alive(sp->owner)) {
+				if (--sp->waiters == 0 && sp->state != CF_PENDING)
+					slot_release(sp);
+				shm_unlock(&shm->lock);
+				break;
+			}
+
+			if (smap_deadline_left(conninfo) == 0) {
+				sp->waiters--;
+				shm_unlock(&shm->lock);
+				debug(DBG_QUERY, 1,
+				      ("query %s %s: deadline expired",
+				       map, key));
+				smap_stream_printf(ostr, "%s\n",
+						   DEADLINE_REPLY);
+				return 0;
+			}
+
+			gettimeofday(&tv, NULL);
+			elapsed = (tv.tv_sec - start.tv_sec) * 1000
+				   + (tv.tv_usec - start.tv_usec) / 1000;
+			if (elapsed >= cf->timeout) {
+				sp->waiters--;
+				shm_unlock(&shm->lock);
+				debug(DBG_QUERY, 1,
+				      ("%s: timed out waiting for "
+				       "in-flight query %s %s",
+				       dbid, map, key));
+				break;
+			}
+			shm_unlock(&shm->lock);
+		}
+		/* Fall back to running the query */
+		return fun(closure, ostr);
+	}
+
+	if (!freeslot) {
+		/* No more slots: run the query without coalescing */
+		shm_unlock(&shm->lock);
+		return fun(closure, ostr);
+	}
+
+	/* Leader */
+	sp = freeslot;
+	if (sp->state != CF_FREE)
+		slot_release(sp);
+	sp->state = CF_PENDING;
+	sp->owner = getpid();
+	sp->hash = hash;
+	sp->keylen = keylen;
+	memcpy(sp->key, keybuf, keylen);
+	gen = sp->gen;
+	shm_unlock(&shm->lock);
+
+	if (!capture_str && smap_memory_stream_create(&capture_str)) {
+		smap_error("cannot create memory stream");
+		shm_lock(&shm->lock);
+		if (sp->gen == gen) {
+			sp->state = CF_FAILED;
+			sp->done_time = time(NULL);
+			if (sp->waiters == 0)
+				slot_release(sp);
+		}
+		shm_unlock(&shm->lock);
+		return fun(closure, ostr);
+	}
+	smap_stream_truncate(capture_str, 0);
+	rc = fun(closure, capture_str);
+	smap_stream_flush(capture_str);
+	smap_stream_size(capture_str, &size);
+	smap_stream_ioctl(capture_str, SMAP_IOCTL_GET_BUFFER, &buf);
+
+	shm_lock(&shm->lock);
+	if (sp->gen == gen) {
+		if (size <= COALESCE_REPLY_MAX
+		    && !reply_private(conninfo, buf, size)) {
+			memcpy(sp->reply, buf, size);
+			sp->replen = size;
+			sp->rc = rc;
+			sp->state = CF_DONE;
+		} else
+			sp->state = CF_FAILED;
+		sp->done_time = time(NULL);
+		if (sp->waiters == 0)
+			slot_release(sp);
+	}
+	shm_unlock(&shm->lock);
+
+	if (size)
+		smap_stream_write(ostr, buf, size, NULL);
+	return rc;
+}
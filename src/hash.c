@@ -0,0 +1,38 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "smapd.h"
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME        0x100000001b3ULL
+
+/* Compute 64-bit FNV-1a hash of the first LEN bytes of STR.  If FOLD
+   is not 0, ASCII letters are folded to lower case before hashing. */
+smap_hash_t
+smap_strhash(const char *str, size_t len, int fold)
+{
+	const unsigned char *p = (const unsigned char *) str;
+	smap_hash_t h = FNV64_OFFSET_BASIS;
+
+	while (len--) {
+		unsigned c = *p++;
+		if (fold && c < 128)
+			c = tolower(c);
+		h ^= c;
+		h *= FNV64_PRIME;
+	}
+	return h;
+}
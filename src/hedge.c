@@ -0,0 +1,238 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Hedged requests.
+
+   A database may have a group of replicas.  If the database does not
+   reply within the hedge delay, the query is repeated to the next
+   replica, and so on, and the first reply to arrive is used (see
+   parallel_hedge in parallel.c).
+
+   The hedge delay is derived from the distribution of the database
+   response times, which is kept in a histogram in the shared memory.
+   Histogram buckets are log-linear: values below 16 microseconds get
+   a bucket each, above that each power of two is split into 4
+   buckets.  When the total number of samples reaches HEDGE_DECAY,
+   all counts are halved, so that the histogram follows the recent
+   behavior of the database. */
+
+#include "smapd.h"
+
+#define HEDGE_BUCKETS 128
+#define HEDGE_DECAY 10000
+#define HEDGE_MIN_SAMPLES 20
+
+#define HEDGE_DEFAULT_PERCENTILE 95
+#define HEDGE_DEFAULT_MIN_DELAY  10
+#define HEDGE_DEFAULT_MAX_DELAY  1000
+
+struct hedge_shm {
+	shm_lock_t lock;
+	unsigned long total;
+	unsigned long count[HEDGE_BUCKETS];
+};
+
+struct hedge {
+	size_t namec;               /* Number of replica names */
+	char **namev;               /* Replica names */
+	size_t replc;               /* Number of resolved replicas */
+	struct smap_database_instance **replv; /* Replicas */
+	double percentile;          /* Percentile of the response time */
+	unsigned min_delay;         /* Minimal delay, ms */
+	unsigned max_delay;         /* Maximal delay, ms */
+	struct hedge_shm *shm;
+};
+
+struct hedge *
+hedge_create()
+{
+	struct hedge *hp = ecalloc(1, sizeof(*hp));
+	hp->percentile = HEDGE_DEFAULT_PERCENTILE;
+	hp->min_delay = HEDGE_DEFAULT_MIN_DELAY;
+	hp->max_delay = HEDGE_DEFAULT_MAX_DELAY;
+	return hp;
+}
+
+void
+hedge_free(struct hedge *hp)
+{
+	size_t i;
+
+	if (!hp)
+		return;
+	for (i = 0; i < hp->namec; i++)
+		free(hp->namev[i]);
+	free(hp->namev);
+	free(hp->replv);
+	shm_free(hp->shm, sizeof(*hp->shm));
+	free(hp);
+}
+
+void
+hedge_add_replica(struct hedge *hp, const char *name)
+{
+	hp->namev = erealloc(hp->namev,
+			     (hp->namec + 1) * sizeof(hp->namev[0]));
+	hp->namev[hp->namec++] = estrdup(name);
+}
+
+int
+hedge_set_percentile(struct hedge *hp, double p)
+{
+	if (p <= 0 || p > 100)
+		return 1;
+	hp->percentile = p;
+	return 0;
+}
+
+void
+hedge_set_delay(struct hedge *hp, unsigned min, unsigned max)
+{
+	hp->min_delay = min;
+	hp->max_delay = max;
+}
+
+static int
+usable_replica(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+	return mod->smap_version > 1
+		&& (mod->smap_capabilities & SMAP_CAPA_THREADSAFE)
+		&& (mod->smap_capabilities & SMAP_CAPA_QUERY);
+}
+
+/* Resolve replica names and allocate the histogram for database DBI.
+   Return 0 if hedging can be used. */
+int
+hedge_init(struct hedge *hp, struct smap_database_instance *dbi)
+{
+	size_t i;
+
+	if (!usable_replica(dbi)) {
+		smap_error("%s:%u: module %s does not allow hedged requests",
+			   dbi->file, dbi->line, dbi->modname);
+		return 1;
+	}
+	hp->replv = ecalloc(hp->namec, sizeof(hp->replv[0]));
+	hp->replc = 0;
+	for (i = 0; i < hp->namec; i++) {
+		struct smap_database_instance *rp =
+			database_locate(hp->namev[i]);
+		if (!rp)
+			smap_error("%s:%u: no such database: %s",
+				   dbi->file, dbi->line, hp->namev[i]);
+		else if (rp == dbi)
+			smap_error("%s:%u: database cannot be its own replica",
+				   dbi->file, dbi->line);
+		else if (!usable_replica(rp))
+			smap_error("%s:%u: module %s does not allow "
+				   "hedged requests",
+				   dbi->file, dbi->line, rp->modname);
+		else
+			hp->replv[hp->replc++] = rp;
+	}
+	if (hp->replc == 0)
+		return 1;
+	hp->shm = shm_alloc(sizeof(*hp->shm));
+	return hp->shm == NULL;
+}
+
+size_t
+hedge_replicas(struct hedge *hp, struct smap_database_instance ***pv)
+{
+	*pv = hp->replv;
+	return hp->replc;
+}
+
+static int
+bucket_index(unsigned long usec)
+{
+	int e, n;
+
+	if (usec < 16)
+		return usec;
+	for (e = 4; e < 31 && (usec >> (e + 1)); e++)
+		;
+	n = 16 + (e - 4) * 4 + ((usec >> (e - 2)) & 3);
+	return n < HEDGE_BUCKETS ? n : HEDGE_BUCKETS - 1;
+}
+
+/* Return the upper bound of the bucket N, in microseconds */
+static unsigned long
+bucket_limit(int n)
+{
+	int e, m;
+
+	if (n < 16)
+		return n;
+	e = (n - 16) / 4 + 4;
+	m = (n - 16) % 4;
+	return ((4UL + m + 1) << (e - 2)) - 1;
+}
+
+/* Record a response time of USEC microseconds */
+void
+hedge_record(struct hedge *hp, unsigned long usec)
+{
+	int i;
+
+	if (!hp->shm)
+		return;
+	shm_lock(&hp->shm->lock);
+	hp->shm->count[bucket_index(usec)]++;
+	if (++hp->shm->total >= HEDGE_DECAY) {
+		hp->shm->total = 0;
+		for (i = 0; i < HEDGE_BUCKETS; i++) {
+			hp->shm->count[i] /= 2;
+			hp->shm->total += hp->shm->count[i];
+		}
+	}
+	shm_unlock(&hp->shm->lock);
+}
+
+/* Return the current hedge delay, in milliseconds.  Until enough
+   samples are collected, the maximal delay is used. */
+unsigned
+hedge_delay(struct hedge *hp)
+{
+	unsigned long want, sum = 0;
+	unsigned delay = hp->max_delay;
+	int i;
+
+	if (!hp->shm)
+		return delay;
+	shm_lock(&hp->shm->lock);
+	if (hp->shm->total >= HEDGE_MIN_SAMPLES) {
+		want = (unsigned long)
+			(hp->shm->total * hp->percentile / 100 + 0.5);
+		if (want == 0)
+			want = 1;
+		for (i = 0; i < HEDGE_BUCKETS; i++) {
+			sum += hp->shm->count[i];
+			if (sum >= want)
+				break;
+		}
+		if (i == HEDGE_BUCKETS)
+			i--;
+		delay = (bucket_limit(i) + 999) / 1000;
+	}
+	shm_unlock(&hp->shm->lock);
+	if (delay < hp->min_delay)
+		delay = hp->min_delay;
+	else if (delay > hp->max_delay)
+		delay = hp->max_delay;
+	return delay;
+}
@@ -166,6 +166,21 @@ _load_module(struct smap_module_instance *inst)
 			MODULE_ASSERT(pmod->smap_query);
 		if (pmod->smap_capabilities & SMAP_CAPA_XFORM)
 			MODULE_ASSERT(pmod->smap_xform);
+		if (pmod->smap_version > 2
+		    && (pmod->smap_capabilities & SMAP_CAPA_ASYNC)) {
+			MODULE_ASSERT(pmod->smap_query_submit);
+			MODULE_ASSERT(pmod->smap_query_fd);
+			MODULE_ASSERT(pmod->smap_query_complete);
+			MODULE_ASSERT(pmod->smap_query_cancel);
+		}
+		if (pmod->smap_version > 2
+		    && (pmod->smap_capabilities & SMAP_CAPA_BATCH))
+			MODULE_ASSERT(pmod->smap_query_batch);
+		if (pmod->smap_version > 2
+		    && (pmod->smap_capabilities & SMAP_CAPA_NOTIFY)) {
+			MODULE_ASSERT(pmod->smap_notify_fd);
+			MODULE_ASSERT(pmod->smap_notify_read);
+		}
 	}
 	
 	if (pmod->smap_init && pmod->smap_init(inst->argc, inst->argv)) {
@@ -248,6 +263,7 @@ database_declare(const char *file, unsigned line,
 		db->argv[i] = estrdup(argv[i]);
 	db->argv[i] = NULL;
 	db->inst = NULL;
+	db->notify_fd = -1;
 	database_attach(db);
 	*pdb = db;
 	return 0;
@@ -263,6 +279,13 @@ database_free(struct smap_database_instance *db)
 	for (i = 0; i < db->argc; i++)
 		free(db->argv[i]);
 	free(db->argv);
+	negcache_free(db->negcache);
+	coalesce_free(db->coalesce);
+	xcache_free(db->xcache);
+	hedge_free(db->hedge);
+	breaker_free(db->breaker);
+	broker_pool_free(db->broker_pool);
+	free(db->onerror_reply);
 	free(db);
 }
 
@@ -282,6 +305,20 @@ remove_dependent_databases(const char *modname)
 	}
 }
 
+static int database_keep_open(struct smap_database_instance *dbi);
+
+/* Return 1 if replies of the database DBI may depend on the client
+   addresses */
+static int
+database_uses_conninfo(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+
+	return !(mod->smap_version > 2
+		 && mod->smap_uses_conninfo
+		 && mod->smap_uses_conninfo(dbi->dbh) == 0);
+}
+
 void
 init_databases()
 {
@@ -312,26 +349,428 @@ init_databases()
 			      ("removing database %s", p->id));
 			database_detach(p);
 			database_free(p);
+		} else {
+			p->inst = inst;
+			if (p->negcache) {
+				if (!negcache_get_file(p->negcache)) {
+					smap_error("%s:%u: negative cache "
+						   "file not specified",
+						   p->file, p->line);
+					negcache_free(p->negcache);
+					p->negcache = NULL;
+				} else
+					/* On failure, the cache remains
+					   empty and all queries are
+					   passed to the module. */
+					negcache_load(p->negcache, p->id);
+			}
+			if (p->coalesce
+			    && coalesce_init(p->coalesce,
+					     database_uses_conninfo(p))) {
+				smap_error("%s:%u: query coalescing disabled",
+					   p->file, p->line);
+				coalesce_free(p->coalesce);
+				p->coalesce = NULL;
+			}
+			if (p->xcache && database_uses_conninfo(p)) {
+				smap_error("%s:%u: transformation cache "
+					   "disabled: results of module %s "
+					   "may depend on the client address",
+					   p->file, p->line, p->modname);
+				xcache_free(p->xcache);
+				p->xcache = NULL;
+			}
+			if (p->xcache && xcache_init(p->xcache)) {
+				smap_error("%s:%u: transformation cache "
+					   "disabled",
+					   p->file, p->line);
+				xcache_free(p->xcache);
+				p->xcache = NULL;
+			}
+			if (p->breaker && breaker_init(p->breaker)) {
+				smap_error("%s:%u: circuit breaker disabled",
+					   p->file, p->line);
+				breaker_free(p->breaker);
+				p->breaker = NULL;
+			}
+			if (p->broker_pool
+			    && broker_pool_init(p->broker_pool, p)) {
+				smap_error("%s:%u: connection brokers "
+					   "disabled",
+					   p->file, p->line);
+				broker_pool_free(p->broker_pool);
+				p->broker_pool = NULL;
+			}
 		}
-		p->inst = inst;
 		p = next;
 	}
+
+	/* Replicas can be resolved only when all databases are
+	   initialized */
+	for (p = database_head; p; p = p->next) {
+		if (p->hedge && hedge_init(p->hedge, p)) {
+			smap_error("%s:%u: hedged requests disabled",
+				   p->file, p->line);
+			hedge_free(p->hedge);
+			p->hedge = NULL;
+		}
+		if (p->persistent && !p->broker_pool
+		    && !database_keep_open(p))
+			smap_error("%s:%u: persistent has no effect for "
+				   "database %s: module %s is not fork-safe "
+				   "and smapd does not run in single-process "
+				   "mode",
+				   p->file, p->line, p->id, p->modname);
+	}
+}
+
+/* Refresh auxiliary database data.  Called periodically by the master
+   process. */
+void
+refresh_databases()
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next) {
+		if (p->negcache)
+			negcache_refresh(p->negcache, p->id);
+	}
+}
+
+/* Start connection brokers.  Called by the master process before
+   accepting connections. */
+void
+start_brokers()
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next)
+		if (p->broker_pool)
+			broker_pool_start(p);
+}
+
+/* Restart terminated brokers.  Called by the master process. */
+void
+check_brokers()
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next)
+		if (p->broker_pool)
+			broker_pool_check(p);
+}
+
+/* Record the termination of the subprocess PID with STATUS, if it is
+   a broker.  Return 1 if it is. */
+int
+brokers_exited(pid_t pid, int status)
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next)
+		if (p->broker_pool
+		    && broker_pool_exited(p, pid, status))
+			return 1;
+	return 0;
+}
+
+void
+stop_brokers()
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next)
+		if (p->broker_pool)
+			broker_pool_stop(p);
+}
+
+/* Change notifications.  A database whose module reports changed keys
+   gets a listener in the master process.  Keys reported by it are added
+   to the negative cache, so that they are no longer answered with
+   NOTFOUND before the key dump is updated. */
+
+/* Interval between attempts to reestablish a lost listener, s */
+#define LISTENER_RETRY 10
+
+static int
+database_has_listener(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+	return dbi->negcache
+		&& mod->smap_version > 2
+		&& (mod->smap_capabilities & SMAP_CAPA_NOTIFY);
+}
+
+static void
+notify_key(const char *key, void *data)
+{
+	struct smap_database_instance *dbi = data;
+
+	debug(DBG_DATABASE, 1, ("%s: key %s changed", dbi->id, key));
+	negcache_add(dbi->negcache, key);
+}
+
+static void
+notify_handler(int fd, void *data)
+{
+	struct smap_database_instance *dbi = data;
+
+	if (dbi->inst->module->smap_notify_read(dbi->dbh,
+						notify_key, dbi)) {
+		smap_error("%s: lost change notification connection",
+			   dbi->id);
+		smap_srvman_remove_fd(fd);
+		dbi->notify_fd = -1;
+	}
+}
+
+static void
+listener_start(struct smap_database_instance *dbi)
+{
+	int fd;
+
+	dbi->notify_time = time(NULL);
+	fd = dbi->inst->module->smap_notify_fd(dbi->dbh);
+	if (fd == -1)
+		return;
+	debug(DBG_DATABASE, 1, ("%s: listening for changes", dbi->id));
+	dbi->notify_fd = fd;
+	smap_srvman_add_fd(fd, notify_handler, dbi);
+}
+
+/* Start change listeners.  Called by the master process before
+   accepting connections. */
+void
+start_listeners()
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next)
+		if (database_has_listener(p))
+			listener_start(p);
 }
 
+/* Restart lost listeners.  Called by the master process each time
+   it is about to wait for connections, therefore each listener is
+   restarted at most once in LISTENER_RETRY seconds. */
+void
+check_listeners()
+{
+	struct smap_database_instance *p;
+	time_t now = time(NULL);
+
+	for (p = database_head; p; p = p->next)
+		if (p->notify_fd == -1 && database_has_listener(p)
+		    && now - p->notify_time >= LISTENER_RETRY)
+			listener_start(p);
+}
+
+void
+stop_listeners()
+{
+	struct smap_database_instance *p;
+
+	for (p = database_head; p; p = p->next)
+		if (p->notify_fd != -1) {
+			smap_srvman_remove_fd(p->notify_fd);
+			p->notify_fd = -1;
+		}
+}
+
+/* Return the interval (in seconds) at which refresh_databases and
+   expire_databases should be called, or 0 if it is not needed. */
+unsigned
+databases_refresh_interval()
+{
+	struct smap_database_instance *p;
+	unsigned ival = 0;
+
+	for (p = database_head; p; p = p->next) {
+		if (p->negcache) {
+			unsigned n = negcache_get_refresh(p->negcache);
+			if (n && (ival == 0 || n < ival))
+				ival = n;
+		}
+		if (p->persistent && p->max_idle
+		    && (ival == 0 || p->max_idle < ival))
+			ival = p->max_idle;
+		if (database_has_listener(p)
+		    && (ival == 0 || LISTENER_RETRY < ival))
+			ival = LISTENER_RETRY;
+		if (p->broker_pool
+		    && (ival == 0 || BROKER_RESTART_DELAY < ival))
+			ival = BROKER_RESTART_DELAY;
+	}
+	return ival;
+}
+
+static void
+database_close(struct smap_database_instance *dbi)
+{
+	debug(DBG_DATABASE, 2, ("closing database %s", dbi->id));
+	if (dbi->inst->module->smap_close)
+		dbi->inst->module->smap_close(dbi->dbh);
+	dbi->opened = 0;
+}
+
+/* Return 1 if the persistent database DBI has been idle or open for
+   too long at time NOW. */
+static int
+database_expired(struct smap_database_instance *dbi, time_t now)
+{
+	if (dbi->max_idle && now - dbi->last_used >= dbi->max_idle) {
+		debug(DBG_DATABASE, 1,
+		      ("%s: connection idle for too long", dbi->id));
+		return 1;
+	}
+	if (dbi->max_lifetime && now - dbi->open_time >= dbi->max_lifetime) {
+		debug(DBG_DATABASE, 1,
+		      ("%s: connection reached its maximal lifetime",
+		       dbi->id));
+		return 1;
+	}
+	return 0;
+}
+
+/* Check if the persistent database DBI, which was left open by a
+   previous session, can be reused.  Close it if not. */
+static void
+database_verify(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+
+	dbi->verified = 1;
+	if (database_expired(dbi, time(NULL)))
+		database_close(dbi);
+	else if (mod->smap_version > 2 && mod->smap_ping
+		 && mod->smap_ping(dbi->dbh)) {
+		smap_error("%s: connection lost, reopening", dbi->id);
+		database_close(dbi);
+	}
+}
+
+/* Open database DBI, unless it is already open.  Return 0 on success. */
+int
+database_open(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+
+	if (dbi->opened && !dbi->verified)
+		database_verify(dbi);
+	if (!dbi->opened) {
+		int rc = 0;
+
+		if (dbi->breaker && !breaker_allow(dbi->breaker, dbi->id)) {
+			debug(DBG_DATABASE, 1,
+			      ("%s: database is disabled", dbi->id));
+			return 1;
+		}
+		debug(DBG_DATABASE, 2,
+		      ("opening database %s", dbi->id));
+		if (mod->smap_open)
+			rc = mod->smap_open(dbi->dbh);
+		if (dbi->breaker)
+			breaker_report(dbi->breaker, dbi->id, rc == 0);
+		if (rc) {
+			smap_error("cannot open database %s", dbi->id);
+			return 1;
+		}
+		dbi->opened = 1;
+		dbi->verified = 1;
+		dbi->open_time = dbi->last_used = time(NULL);
+	}
+	return 0;
+}
+
+/* Return 1 if database DBI may be kept open in the master process.
+   Subprocesses close all descriptors they inherit, so this is safe
+   only for fork-safe modules or if the master serves all sessions
+   itself. */
+static int
+database_keep_open(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+
+	return srvman_param.single_process
+		|| (mod->smap_version > 2
+		    && (mod->smap_capabilities & SMAP_CAPA_FORKSAFE));
+}
+
+/* Open databases in the master process, before accepting connections.
+   Databases that may not be kept open are closed right away: opening
+   them verifies the settings and warms up the module. */
+void
+preopen_databases()
+{
+	struct smap_database_instance *p;
+
+	debug(DBG_DATABASE, 1, ("pre-opening databases"));
+	for (p = database_head; p; p = p->next) {
+		if (database_open(p))
+			continue;
+		if (!database_keep_open(p))
+			database_close(p);
+	}
+}
+
+static void
+open_reachable(struct smap_database_instance *dbi)
+{
+	if (dbi->hedge) {
+		struct smap_database_instance **replv;
+		size_t i, n = hedge_replicas(dbi->hedge, &replv);
+
+		for (i = 0; i < n; i++)
+			database_open(replv[i]);
+	}
+	database_open(dbi);
+}
+
+/* Open the databases the rules of server ID may query, unless
+   inherited from the master.  Called by subprocesses if preopen is
+   set.  Databases no rule of the server refers to are not opened. */
+void
+open_databases(const char *id)
+{
+	dispatch_iterate_databases(id, open_reachable);
+}
+
+/* Close databases at the end of a session.  Persistent databases are
+   left open for use by subsequent sessions, as well as databases still
+   used by a parallel query that has missed its deadline. */
 void
 close_databases()
 {
 	struct smap_database_instance *p;
+	time_t now = time(NULL);
 
 	debug(DBG_DATABASE, 1, ("closing databases"));
 	for (p = database_head; p; p = p->next) {
-		if (p->opened) {
+		if (parallel_wait(p) || !p->opened)
+			continue;
+		p->last_used = now;
+		if (p->persistent && database_keep_open(p)
+		    && !database_expired(p, now)) {
 			debug(DBG_DATABASE, 2,
-			      ("closing database %s", p->id));
-			if (p->inst->module->smap_close)
-				p->inst->module->smap_close(p->dbh);
-			p->opened = 0;
-		}
+			      ("keeping database %s open", p->id));
+			p->verified = 0;
+		} else
+			database_close(p);
+	}
+}
+
+/* Close persistent databases that have been idle for too long.
+   Called periodically by the master process. */
+void
+expire_databases()
+{
+	struct smap_database_instance *p;
+	time_t now = time(NULL);
+
+	for (p = database_head; p; p = p->next) {
+		if (p->opened && p->persistent && database_expired(p, now)
+		    && !parallel_busy(p))
+			database_close(p);
 	}
 }
 
@@ -343,8 +782,18 @@ free_databases()
 	debug(DBG_DATABASE, 1, ("freeing databases"));
 	for (p = database_head; p; p = p->next) {
 		struct smap_module *mod = p->inst->module;
+		if (p->opened)
+			database_close(p);
 		debug(DBG_DATABASE, 2,
 		      ("freeing database %s", p->id));
+		if (p->xcache) {
+			unsigned long hits, misses;
+			xcache_stat(p->xcache, &hits, &misses);
+			debug(DBG_DATABASE, 1,
+			      ("%s: transformation cache: %lu hits, "
+			       "%lu misses",
+			       p->id, hits, misses));
+		}
 		if (mod->smap_free_db)
 			mod->smap_free_db(p->dbh);
 		p->dbh = NULL;
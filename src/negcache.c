@@ -0,0 +1,330 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Negative lookup cache.
+
+   The cache is a Bloom filter built from a dump of all keys present
+   in the database (one key per line).  A key that is not in the filter
+   is definitely absent from the database, so the query can be answered
+   with the negative reply (NOTFOUND by default, see negcache_set_reply)
+   without consulting the module.  A key that is in the
+   filter is either present or a false positive, in which case the
+   query proceeds as usual.  Thus, the filter never causes a wrong
+   answer, provided that the dump is up to date.
+
+   The filter is kept in the shared memory, so that keys added to it by
+   the master process (see negcache_add) become visible to the running
+   subprocesses as well. */
+
+#include "smapd.h"
+
+#define NEGCACHE_DEFAULT_FP_RATE 0.01
+
+/* 1/ln(2), used to compute the optimal number of bits per key */
+#define M_1_LN2 1.4426950408889634
+
+struct negcache {
+	char *file;             /* Key dump file */
+	double fp_rate;         /* Desired false positive rate */
+	unsigned refresh;       /* Refresh interval, 0 - never */
+	int fold;               /* Fold key case */
+	char *reply;            /* Reply for absent keys */
+
+	time_t mtime;           /* Modification time of the file */
+	ino_t ino;              /* Its inode number */
+	off_t size;             /* and size */
+	time_t checked;         /* Time of the last check */
+
+	size_t nkeys;           /* Number of keys in the filter */
+	size_t nbits;           /* Number of bits in the filter */
+	unsigned nhash;         /* Number of hash functions */
+	unsigned char *bits;    /* The filter itself */
+};
+
+struct negcache *
+negcache_create()
+{
+	struct negcache *nc = ecalloc(1, sizeof(*nc));
+	nc->fp_rate = NEGCACHE_DEFAULT_FP_RATE;
+	return nc;
+}
+
+void
+negcache_free(struct negcache *nc)
+{
+	if (!nc)
+		return;
+	free(nc->file);
+	free(nc->reply);
+	shm_free(nc->bits, nc->nbits / 8);
+	free(nc);
+}
+
+void
+negcache_set_file(struct negcache *nc, const char *file)
+{
+	free(nc->file);
+	nc->file = estrdup(file);
+}
+
+int
+negcache_set_fp_rate(struct negcache *nc, double rate)
+{
+	if (rate <= 0.0 || rate >= 1.0)
+		return 1;
+	nc->fp_rate = rate;
+	return 0;
+}
+
+void
+negcache_set_refresh(struct negcache *nc, unsigned refresh)
+{
+	nc->refresh = refresh;
+}
+
+void
+negcache_set_fold(struct negcache *nc, int fold)
+{
+	nc->fold = fold;
+}
+
+void
+negcache_set_reply(struct negcache *nc, const char *reply)
+{
+	free(nc->reply);
+	nc->reply = estrdup(reply);
+}
+
+const char *
+negcache_get_file(struct negcache *nc)
+{
+	return nc->file;
+}
+
+unsigned
+negcache_get_refresh(struct negcache *nc)
+{
+	return nc->refresh;
+}
+
+const char *
+negcache_get_reply(struct negcache *nc)
+{
+	return nc->reply ? nc->reply : "NOTFOUND";
+}
+
+/* Compute filter geometry for NKEYS keys: the optimal number of hash
+   functions is k = log2(1/p), and the optimal number of bits is
+   m = n * k / ln(2). */
+static void
+negcache_geometry(struct negcache *nc, size_t nkeys,
+		  size_t *pnbits, unsigned *pnhash)
+{
+	unsigned k;
+	double p;
+	size_t nbits;
+
+	for (k = 0, p = 1.0; p > nc->fp_rate; k++)
+		p /= 2;
+	if (k == 0)
+		k = 1;
+	if (nkeys == 0)
+		nkeys = 1;
+	nbits = (size_t) (nkeys * k * M_1_LN2) + 1;
+	/* Round up to a full byte */
+	nbits = (nbits + 7) & ~(size_t)7;
+	*pnbits = nbits;
+	*pnhash = k;
+}
+
+/* Use double hashing to derive nhash indices from a single 64-bit
+   hash value: g(i) = h1 + i * h2. */
+#define NEGCACHE_HASH_INIT(h, h1, h2)			\
+	do {						\
+		h1 = (h) & 0xffffffff;			\
+		h2 = ((h) >> 32) | 1;			\
+	} while (0)
+
+static void
+bloom_add(unsigned char *bits, size_t nbits, unsigned nhash, smap_hash_t h)
+{
+	smap_hash_t h1, h2;
+	unsigned i;
+
+	NEGCACHE_HASH_INIT(h, h1, h2);
+	for (i = 0; i < nhash; i++) {
+		size_t n = (h1 + i * h2) % nbits;
+		bits[n >> 3] |= 1 << (n & 7);
+	}
+}
+
+static int
+bloom_test(unsigned char *bits, size_t nbits, unsigned nhash, smap_hash_t h)
+{
+	smap_hash_t h1, h2;
+	unsigned i;
+
+	NEGCACHE_HASH_INIT(h, h1, h2);
+	for (i = 0; i < nhash; i++) {
+		size_t n = (h1 + i * h2) % nbits;
+		if (!(bits[n >> 3] & (1 << (n & 7))))
+			return 0;
+	}
+	return 1;
+}
+
+/* Read keys from FP into the filter.  Return the number of keys read. */
+static size_t
+negcache_scan(struct negcache *nc, FILE *fp,
+	      unsigned char *bits, size_t nbits, unsigned nhash)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t len;
+	size_t count = 0;
+
+	while ((len = getline(&buf, &size, fp)) > 0) {
+		if (buf[len-1] == '\n')
+			buf[--len] = 0;
+		if (len == 0)
+			continue;
+		if (bits)
+			bloom_add(bits, nbits, nhash,
+				  smap_strhash(buf, len, nc->fold));
+		count++;
+	}
+	free(buf);
+	return count;
+}
+
+/* (Re)build the filter from the key dump.  On error, the old filter
+   (if any) is retained.  Return 0 on success. */
+int
+negcache_load(struct negcache *nc, const char *dbid)
+{
+	FILE *fp;
+	struct stat st;
+	size_t nkeys, nbits;
+	unsigned nhash;
+	unsigned char *bits;
+
+	nc->checked = time(NULL);
+	fp = fopen(nc->file, "r");
+	if (!fp) {
+		smap_error("%s: cannot open negative cache file %s: %s",
+			   dbid, nc->file, strerror(errno));
+		return 1;
+	}
+	if (fstat(fileno(fp), &st)) {
+		smap_error("%s: cannot stat %s: %s",
+			   dbid, nc->file, strerror(errno));
+		fclose(fp);
+		return 1;
+	}
+
+	/* First pass: count keys */
+	nkeys = negcache_scan(nc, fp, NULL, 0, 0);
+	if (nkeys == 0) {
+		/* An empty dump would turn every lookup into NOTFOUND.
+		   Most probably it is being rewritten, so keep the
+		   previous state. */
+		smap_error("%s: negative cache file %s contains no keys; "
+			   "ignored", dbid, nc->file);
+		fclose(fp);
+		return 1;
+	}
+
+	/* Second pass: fill in the filter */
+	negcache_geometry(nc, nkeys, &nbits, &nhash);
+	bits = shm_alloc(nbits / 8);
+	if (!bits) {
+		fclose(fp);
+		return 1;
+	}
+	rewind(fp);
+	if (negcache_scan(nc, fp, bits, nbits, nhash) != nkeys) {
+		smap_error("%s: negative cache file %s changed while "
+			   "reading; ignored", dbid, nc->file);
+		shm_free(bits, nbits / 8);
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	/* Subprocesses started earlier keep their mapping of the old
+	   filter */
+	shm_free(nc->bits, nc->nbits / 8);
+	nc->bits = bits;
+	nc->nbits = nbits;
+	nc->nhash = nhash;
+	nc->nkeys = nkeys;
+	nc->mtime = st.st_mtime;
+	nc->ino = st.st_ino;
+	nc->size = st.st_size;
+	debug(DBG_DATABASE, 1,
+	      ("%s: negative cache loaded from %s: %lu keys, %lu bits, "
+	       "%u hashes",
+	       dbid, nc->file, (unsigned long) nkeys,
+	       (unsigned long) nbits, nhash));
+	return 0;
+}
+
+/* Reload the filter if the refresh interval has expired and the key
+   dump has been modified since it was last read. */
+void
+negcache_refresh(struct negcache *nc, const char *dbid)
+{
+	struct stat st;
+	time_t now;
+
+	if (!nc->refresh)
+		return;
+	now = time(NULL);
+	if (now - nc->checked < nc->refresh)
+		return;
+	nc->checked = now;
+	if (stat(nc->file, &st)) {
+		smap_error("%s: cannot stat %s: %s",
+			   dbid, nc->file, strerror(errno));
+		return;
+	}
+	if (st.st_mtime == nc->mtime && st.st_ino == nc->ino
+	    && st.st_size == nc->size)
+		return;
+	debug(DBG_DATABASE, 1, ("%s: reloading negative cache", dbid));
+	negcache_load(nc, dbid);
+}
+
+/* Return 1 if KEY is definitely absent from the database, 0 otherwise. */
+int
+negcache_absent(struct negcache *nc, const char *key)
+{
+	if (!nc->bits)
+		return 0;
+	return !bloom_test(nc->bits, nc->nbits, nc->nhash,
+			   smap_strhash(key, strlen(key), nc->fold));
+}
+
+/* Add KEY to the filter, e.g. when it has been reported as added to
+   the database.  Called by the master process. */
+void
+negcache_add(struct negcache *nc, const char *key)
+{
+	if (!nc->bits)
+		return;
+	bloom_add(nc->bits, nc->nbits, nc->nhash,
+		  smap_strhash(key, strlen(key), nc->fold));
+}
@@ -0,0 +1,860 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Parallel queries.
+
+   A parallel query is sent to several databases at once.  Each
+   database whose module declares SMAP_CAPA_THREADSAFE is queried in a
+   thread of its own, the rest are queried in turn by the calling
+   thread.  Each query writes its reply to a private memory stream.
+   The first reply beginning with "OK" is returned to the client.  If
+   no database replies positively, the most significant of the negative
+   replies is returned, TEMP being the most significant, followed by
+   TIMEOUT, PERM and NOTFOUND.  If the replies do not arrive within the
+   timeout, TIMEOUT is returned.  If the query deadline (see
+   query-timeout) expires first, TEMP is returned.
+
+   Hedged queries (see hedge.c) use the same machinery, except that
+   the jobs are started one by one, each one after the hedge delay
+   has expired with no reply, and that any reply other than TEMP is
+   accepted.
+
+   A thread that misses the deadline keeps running in the background.
+   Its database remains busy until the thread terminates.  Meanwhile,
+   queries to it are handled as if the database could not be opened
+   (see database_failure), rather than waiting for the thread.  At the
+   end of the session, the thread is waited for at most
+   PARALLEL_WAIT_TIMEOUT milliseconds.  If it is still running then,
+   its database is left open.
+
+   A database that cannot be used gives its error reply, which is never
+   accepted as the final one while other databases can still reply.  If
+   it is configured to pass the query to the next rule, it gives no
+   reply at all.  If none of the databases can be used, the query is
+   passed to the next rule.
+
+   Databases whose modules declare SMAP_CAPA_ASYNC are not given a
+   thread.  Instead, their queries are submitted at once and driven
+   by the calling thread, which polls their descriptors until the
+   batch is finished.  Threads wake it up by writing to a pipe.
+   Asynchronous queries that are still in progress when the batch
+   ends are cancelled. */
+
+#include "smapd.h"
+#include <pthread.h>
+#include <poll.h>
+
+/* Time to wait for an outstanding thread at the end of a session, ms */
+#define PARALLEL_WAIT_TIMEOUT 2000
+
+struct parallel_thread {
+	pthread_t tid;
+	volatile int done;          /* Set when the query is finished */
+};
+
+struct parallel_batch;
+
+struct parallel_job {
+	struct parallel_batch *batch;
+	struct smap_database_instance *dbi;
+	struct parallel_thread *thr; /* Thread running the job */
+	smap_query_t aq;            /* Asynchronous query */
+	int started;                /* Job is started */
+	int failed;                 /* Database could not be used */
+	smap_stream_t str;          /* Reply stream */
+	int rc;                     /* Return code from smap_query */
+};
+
+struct parallel_batch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned refcnt;            /* Reference count */
+	char *map;
+	char *key;
+	struct smap_conninfo conninfo;
+	struct timeval deadline;    /* Query deadline */
+	int hedge;                  /* Hedged query */
+	int expired;                /* Query deadline has expired */
+	int wakeup[2];              /* Pipe for waking up the event loop */
+	size_t njobs;               /* Number of jobs */
+	size_t ndone;               /* Number of finished jobs */
+	struct parallel_job *winner; /* First accepted reply */
+	struct parallel_job job[1];
+};
+
+static pthread_mutex_t diag_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+parallel_diag_lock()
+{
+	pthread_mutex_lock(&diag_mutex);
+}
+
+static void
+parallel_diag_unlock()
+{
+	pthread_mutex_unlock(&diag_mutex);
+}
+
+static struct sockaddr *
+sockaddr_dup(struct sockaddr const *sa, int len)
+{
+	struct sockaddr *p;
+
+	if (!sa)
+		return NULL;
+	p = emalloc(len);
+	memcpy(p, sa, len);
+	return p;
+}
+
+static void batch_unref(struct parallel_batch *bp);
+
+static struct parallel_batch *
+batch_create(size_t njobs, struct smap_database_instance **dbv,
+	     const char *map, const char *key,
+	     struct smap_conninfo const *conninfo)
+{
+	struct parallel_batch *bp;
+	size_t i;
+
+	bp = ecalloc(1, sizeof(*bp) + (njobs - 1) * sizeof(bp->job[0]));
+	pthread_mutex_init(&bp->mutex, NULL);
+	pthread_cond_init(&bp->cond, NULL);
+	bp->refcnt = 1;
+	bp->wakeup[0] = bp->wakeup[1] = -1;
+	bp->map = estrdup(map);
+	bp->key = estrdup(key);
+	bp->conninfo.src = sockaddr_dup(conninfo->src, conninfo->srclen);
+	bp->conninfo.srclen = conninfo->srclen;
+	bp->conninfo.dst = sockaddr_dup(conninfo->dst, conninfo->dstlen);
+	bp->conninfo.dstlen = conninfo->dstlen;
+	if (conninfo->deadline) {
+		bp->deadline = *conninfo->deadline;
+		bp->conninfo.deadline = &bp->deadline;
+	}
+	bp->njobs = njobs;
+	for (i = 0; i < njobs; i++) {
+		bp->job[i].batch = bp;
+		bp->job[i].dbi = dbv[i];
+		if (smap_memory_stream_create(&bp->job[i].str)) {
+			smap_error("cannot create memory stream");
+			pthread_mutex_lock(&bp->mutex);
+			batch_unref(bp);
+			return NULL;
+		}
+	}
+	return bp;
+}
+
+/* Drop a reference to the batch.  Must be called with the batch
+   mutex locked.  Unlocks the mutex. */
+static void
+batch_unref(struct parallel_batch *bp)
+{
+	size_t i;
+
+	if (--bp->refcnt) {
+		pthread_mutex_unlock(&bp->mutex);
+		return;
+	}
+	pthread_mutex_unlock(&bp->mutex);
+	pthread_mutex_destroy(&bp->mutex);
+	pthread_cond_destroy(&bp->cond);
+	for (i = 0; i < bp->njobs; i++)
+		smap_stream_destroy(&bp->job[i].str);
+	if (bp->wakeup[0] != -1) {
+		close(bp->wakeup[0]);
+		close(bp->wakeup[1]);
+	}
+	free(bp->map);
+	free(bp->key);
+	free((void*) bp->conninfo.src);
+	free((void*) bp->conninfo.dst);
+	free(bp);
+}
+
+static const char *
+job_reply(struct parallel_job *job)
+{
+	const char *buf;
+
+	smap_stream_flush(job->str);
+	if (smap_stream_ioctl(job->str, SMAP_IOCTL_GET_BUFFER, &buf))
+		return "";
+	return buf;
+}
+
+static int
+reply_is(const char *reply, const char *word)
+{
+	size_t len = strlen(word);
+	return strncmp(reply, word, len) == 0
+		&& (reply[len] == 0 || isspace(reply[len]));
+}
+
+/* Return the significance of a negative reply */
+static int
+reply_rank(const char *reply)
+{
+	if (reply_is(reply, "TEMP"))
+		return 3;
+	if (reply_is(reply, "TIMEOUT"))
+		return 2;
+	if (reply_is(reply, "PERM"))
+		return 1;
+	return 0;
+}
+
+/* Initialize TS to MSEC milliseconds from now, but not later than the
+   query deadline from CONNINFO.  MSEC 0 means no limit.  Return 0 if
+   there is no limit at all, 1 if TS is set from MSEC and 2 if it is
+   set from the query deadline. */
+static int
+deadline_init(struct timespec *ts, unsigned msec,
+	      struct smap_conninfo const *conninfo)
+{
+	struct timeval tv;
+	long left = smap_deadline_left(conninfo);
+	int rc = msec ? 1 : 0;
+
+	if (left >= 0 && (msec == 0 || left <= msec)) {
+		msec = left;
+		rc = 2;
+	}
+	if (rc == 0)
+		return 0;
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec + msec / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000 + (msec % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+	return rc;
+}
+
+/* Return 1 if the finished job can end the batch */
+static int
+job_accepted(struct parallel_job *job)
+{
+	const char *reply;
+
+	if (job->rc || job->failed)
+		return 0;
+	reply = job_reply(job);
+	if (job->batch->hedge)
+		return !reply_is(reply, "TEMP");
+	return reply_is(reply, "OK");
+}
+
+/* Handle the failure of the database of JOB, storing the result in *RC */
+static void
+job_fail(struct parallel_job *job, int *rc)
+{
+	job->failed = 1;
+	*rc = database_failure(job->dbi, job->str);
+}
+
+/* Check whether JOB needs to query the database.  If not, store the
+   result in *RC and return 1. */
+static int
+job_check(struct parallel_job *job, int *rc)
+{
+	struct parallel_batch *bp = job->batch;
+	struct smap_database_instance *dbi = job->dbi;
+
+	if (dbi->negcache && negcache_absent(dbi->negcache, bp->key)) {
+		debug(DBG_QUERY, 1,
+		      ("%s: key %s is not in the database",
+		       dbi->id, bp->key));
+		smap_stream_printf(job->str, "%s\n",
+				   negcache_get_reply(dbi->negcache));
+		*rc = 0;
+	} else if (smap_deadline_left(&bp->conninfo) == 0) {
+		smap_stream_printf(job->str, "%s\n", DEADLINE_REPLY);
+		*rc = 0;
+	} else if (database_open(dbi))
+		job_fail(job, rc);
+	else
+		return 0;
+	return 1;
+}
+
+/* Store the result RC of JOB and drop its reference to the batch */
+static void
+job_finish(struct parallel_job *job, int rc)
+{
+	struct parallel_batch *bp = job->batch;
+
+	pthread_mutex_lock(&bp->mutex);
+	job->rc = rc;
+	if (!bp->winner && job_accepted(job))
+		bp->winner = job;
+	bp->ndone++;
+	pthread_cond_broadcast(&bp->cond);
+	if (bp->wakeup[1] != -1)
+		while (write(bp->wakeup[1], "", 1) < 0 && errno == EINTR)
+			;
+	batch_unref(bp);
+}
+
+static void
+job_run(struct parallel_job *job)
+{
+	struct parallel_batch *bp = job->batch;
+	struct smap_database_instance *dbi = job->dbi;
+	struct timeval start, end;
+	int rc;
+
+	if (!job_check(job, &rc)) {
+		gettimeofday(&start, NULL);
+		rc = dbi->inst->module->smap_query(dbi->dbh, job->str,
+						   bp->map, bp->key,
+						   &bp->conninfo);
+		if (rc == QUERY_NEXT_RULE) {
+			/* A broker could not be reached */
+			job->failed = 1;
+			rc = 1;
+		} else if (rc == 0 && dbi->hedge) {
+			gettimeofday(&end, NULL);
+			hedge_record(dbi->hedge,
+				     (end.tv_sec - start.tv_sec) * 1000000
+				     + end.tv_usec - start.tv_usec);
+		}
+	}
+	if (job->thr)
+		/* The database is free, the thread is about to exit */
+		__sync_lock_test_and_set(&job->thr->done, 1);
+	job_finish(job, rc);
+}
+
+static void *
+job_thread(void *data)
+{
+	struct parallel_job *job = data;
+	struct smap_module *mod = job->dbi->inst->module;
+
+	if (mod->smap_version > 2 && mod->smap_thread_init)
+		mod->smap_thread_init();
+	job_run(job);
+	/* JOB may be freed at this point */
+	if (mod->smap_version > 2 && mod->smap_thread_end)
+		mod->smap_thread_end();
+	return NULL;
+}
+
+static int
+job_create_thread(struct parallel_job *job)
+{
+	struct smap_database_instance *dbi = job->dbi;
+	struct parallel_thread *thr = ecalloc(1, sizeof(*thr));
+	sigset_t sigs, osigs;
+	int rc;
+
+	job->thr = thr;
+	/* Signals are handled by the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	rc = pthread_create(&thr->tid, NULL, job_thread, job);
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (rc) {
+		smap_error("%s: cannot create thread: %s",
+			   dbi->id, strerror(rc));
+		free(thr);
+		return 1;
+	}
+	dbi->thread = thr;
+	return 0;
+}
+
+/* If the database of JOB is still busy with a query from a previous
+   batch, finish JOB as failed and return 1. */
+static int
+job_busy(struct parallel_job *job)
+{
+	struct parallel_batch *bp = job->batch;
+	int rc;
+
+	if (!parallel_busy(job->dbi))
+		return 0;
+	debug(DBG_QUERY, 1, ("%s: busy with a previous query",
+			     job->dbi->id));
+	job_fail(job, &rc);
+	pthread_mutex_lock(&bp->mutex);
+	bp->refcnt++;
+	pthread_mutex_unlock(&bp->mutex);
+	job_finish(job, rc);
+	return 1;
+}
+
+/* Start JOB in a new thread.  If the thread cannot be created, mark
+   the job as failed. */
+static void
+job_start(struct parallel_job *job)
+{
+	struct parallel_batch *bp = job->batch;
+
+	if (job_busy(job))
+		return;
+	debug(DBG_QUERY, 2, ("%s: starting query", job->dbi->id));
+	pthread_mutex_lock(&bp->mutex);
+	bp->refcnt++;
+	pthread_mutex_unlock(&bp->mutex);
+	if (job_create_thread(job)) {
+		pthread_mutex_lock(&bp->mutex);
+		bp->refcnt--;
+		job->rc = 1;
+		bp->ndone++;
+		pthread_mutex_unlock(&bp->mutex);
+	}
+}
+
+/* Return 1 if the database DBI is in use by a query left over from a
+   previous parallel query.  If that query has finished, collect its
+   thread. */
+int
+parallel_busy(struct smap_database_instance *dbi)
+{
+	if (!dbi->thread)
+		return 0;
+	if (!dbi->thread->done)
+		return 1;
+	parallel_join(dbi);
+	return 0;
+}
+
+/* Wait for the outstanding parallel query to the database DBI to
+   terminate. */
+void
+parallel_join(struct smap_database_instance *dbi)
+{
+	if (dbi->thread) {
+		debug(DBG_QUERY, 2,
+		      ("%s: waiting for outstanding query", dbi->id));
+		pthread_join(dbi->thread->tid, NULL);
+		free(dbi->thread);
+		dbi->thread = NULL;
+	}
+}
+
+/* Wait at most PARALLEL_WAIT_TIMEOUT milliseconds for the outstanding
+   parallel query to the database DBI to terminate.  Return 0 if there
+   is no such query any more, and 1 if it is still running. */
+int
+parallel_wait(struct smap_database_instance *dbi)
+{
+	unsigned delay = 1000, elapsed = 0;
+
+	while (parallel_busy(dbi)) {
+		if (elapsed >= PARALLEL_WAIT_TIMEOUT * 1000) {
+			debug(DBG_QUERY, 1,
+			      ("%s: outstanding query still running",
+			       dbi->id));
+			return 1;
+		}
+		usleep(delay);
+		elapsed += delay;
+		if (delay < 100000)
+			delay *= 2;
+	}
+	return 0;
+}
+
+static int
+threadsafe(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+	return mod->smap_version > 1
+		&& (mod->smap_capabilities & SMAP_CAPA_THREADSAFE);
+}
+
+static int
+async_capable(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+	return mod->smap_version > 2
+		&& (mod->smap_capabilities & SMAP_CAPA_ASYNC);
+}
+
+/* Submit the query of JOB to its database asynchronously.  Return 0
+   on success and non-zero if the query must be run synchronously. */
+static int
+job_submit(struct parallel_job *job)
+{
+	struct parallel_batch *bp = job->batch;
+	struct smap_database_instance *dbi = job->dbi;
+	int rc;
+
+	if (!async_capable(dbi))
+		return 1;
+	if (bp->wakeup[0] == -1) {
+		int fd[2];
+
+		if (pipe(fd)) {
+			smap_error("cannot create pipe: %s", strerror(errno));
+			return 1;
+		}
+		fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+		pthread_mutex_lock(&bp->mutex);
+		bp->wakeup[0] = fd[0];
+		bp->wakeup[1] = fd[1];
+		pthread_mutex_unlock(&bp->mutex);
+	}
+
+	if (job_busy(job))
+		return 0;
+	pthread_mutex_lock(&bp->mutex);
+	bp->refcnt++;
+	pthread_mutex_unlock(&bp->mutex);
+	if (job_check(job, &rc)) {
+		job_finish(job, rc);
+		return 0;
+	}
+	job->aq = dbi->inst->module->smap_query_submit(dbi->dbh,
+						       bp->map, bp->key,
+						       &bp->conninfo);
+	if (!job->aq) {
+		debug(DBG_QUERY, 2, ("%s: cannot submit query", dbi->id));
+		pthread_mutex_lock(&bp->mutex);
+		bp->refcnt--;
+		pthread_mutex_unlock(&bp->mutex);
+		return 1;
+	}
+	debug(DBG_QUERY, 2, ("%s: query submitted", dbi->id));
+	return 0;
+}
+
+/* Advance the asynchronous query of JOB after events REVENTS */
+static void
+job_advance(struct parallel_job *job, int revents)
+{
+	struct smap_module *mod = job->dbi->inst->module;
+	int rc;
+
+	rc = mod->smap_query_complete(job->aq, revents, job->str);
+	if (rc == SMAP_QUERY_PENDING)
+		return;
+	job->aq = NULL;
+	debug(DBG_QUERY, 2, ("%s: query completed", job->dbi->id));
+	job_finish(job, rc);
+}
+
+/* Cancel asynchronous queries that are still in progress.  Must be
+   called with the batch mutex locked. */
+static void
+batch_cancel(struct parallel_batch *bp)
+{
+	size_t i;
+
+	for (i = 0; i < bp->njobs; i++) {
+		struct parallel_job *job = &bp->job[i];
+		if (job->aq) {
+			debug(DBG_QUERY, 2, ("%s: cancelling query",
+					     job->dbi->id));
+			job->dbi->inst->module->smap_query_cancel(job->aq);
+			job->aq = NULL;
+			bp->refcnt--;
+		}
+	}
+}
+
+/* Return the number of milliseconds left until TS */
+static int
+timespec_left(struct timespec const *ts)
+{
+	struct timeval now;
+	long ms;
+
+	gettimeofday(&now, NULL);
+	ms = (ts->tv_sec - now.tv_sec) * 1000
+		+ (ts->tv_nsec / 1000 - now.tv_usec) / 1000;
+	return ms > 0 ? ms : 0;
+}
+
+/* Wait until the batch BP is finished or the DEADLINE expires.  LIMIT
+   is the value returned by deadline_init.  Asynchronous queries are
+   driven meanwhile.  Must be called with the batch mutex locked. */
+static void
+batch_wait(struct parallel_batch *bp, int limit,
+	   struct timespec const *deadline)
+{
+	struct pollfd *pfd;
+	struct parallel_job **pjob;
+
+	pfd = ecalloc(bp->njobs + 1, sizeof(pfd[0]));
+	pjob = ecalloc(bp->njobs, sizeof(pjob[0]));
+	while (!bp->winner && bp->ndone < bp->njobs) {
+		size_t i, n = 0;
+		int ready = 0;
+		int rc;
+
+		for (i = 0; i < bp->njobs; i++) {
+			struct parallel_job *job = &bp->job[i];
+			struct smap_module *mod = job->dbi->inst->module;
+			int events = 0;
+
+			if (!job->aq)
+				continue;
+			pfd[n+1].fd = mod->smap_query_fd(job->aq, &events);
+			pfd[n+1].events = events;
+			pfd[n+1].revents = 0;
+			pjob[n++] = job;
+			if (!events)
+				ready = 1;
+		}
+
+		if (n == 0) {
+			/* Only threads are left */
+			if (!limit)
+				pthread_cond_wait(&bp->cond, &bp->mutex);
+			else if (pthread_cond_timedwait(&bp->cond, &bp->mutex,
+							deadline)
+				 == ETIMEDOUT) {
+				bp->expired = limit == 2;
+				break;
+			}
+			continue;
+		}
+
+		pfd[0].fd = bp->wakeup[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pthread_mutex_unlock(&bp->mutex);
+		rc = poll(pfd, n + 1,
+			  ready ? 0 : limit ? timespec_left(deadline) : -1);
+		if ((rc == 0 && !ready) || (rc < 0 && errno != EINTR)) {
+			if (rc < 0)
+				smap_error("poll: %s", strerror(errno));
+			pthread_mutex_lock(&bp->mutex);
+			bp->expired = rc == 0 && limit == 2;
+			break;
+		}
+		if (rc >= 0) {
+			if (pfd[0].revents) {
+				char c;
+				while (read(bp->wakeup[0], &c, 1) > 0)
+					;
+			}
+			for (i = 0; i < n; i++)
+				if (pfd[i+1].revents || !pfd[i+1].events)
+					job_advance(pjob[i],
+						    pfd[i+1].revents);
+		}
+		pthread_mutex_lock(&bp->mutex);
+	}
+	free(pfd);
+	free(pjob);
+}
+
+static void
+diag_init()
+{
+	static int initialized;
+
+	if (!initialized) {
+		smap_diag_set_lock(parallel_diag_lock, parallel_diag_unlock);
+		initialized = 1;
+	}
+}
+
+/* Send the reply resulting from the first N jobs of the batch BP to
+   OSTR.  Return 1 if none of the databases could be used and the query
+   should be passed to the next rule, without replying.  Must be called
+   with the batch mutex locked. */
+static int
+batch_reply(struct parallel_batch *bp, size_t n, smap_stream_t ostr)
+{
+	struct parallel_job *best = NULL;
+	int best_rank = -1;
+	size_t i, nskip = 0;
+
+	if (bp->winner) {
+		debug(DBG_QUERY, 1, ("%s: reply accepted",
+				     bp->winner->dbi->id));
+		smap_stream_printf(ostr, "%s", job_reply(bp->winner));
+		return 0;
+	}
+	if (bp->ndone < n) {
+		if (bp->expired) {
+			debug(DBG_QUERY, 1, ("query %s %s: deadline expired",
+					     bp->map, bp->key));
+			smap_stream_printf(ostr, "%s\n", DEADLINE_REPLY);
+		} else {
+			debug(DBG_QUERY, 1, ("query %s %s timed out",
+					     bp->map, bp->key));
+			smap_stream_printf(ostr, "TIMEOUT\n");
+		}
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct parallel_job *job = &bp->job[i];
+		int rank;
+
+		if (job->rc) {
+			if (job->failed)
+				nskip++;
+			continue;
+		}
+		rank = reply_rank(job_reply(job));
+		if (rank > best_rank) {
+			best = job;
+			best_rank = rank;
+		}
+	}
+	if (best)
+		smap_stream_printf(ostr, "%s", job_reply(best));
+	else if (nskip == n) {
+		debug(DBG_QUERY, 1, ("query %s %s: no usable database",
+				     bp->map, bp->key));
+		return 1;
+	} else
+		smap_stream_printf(ostr, "NOTFOUND\n");
+	return 0;
+}
+
+/* Collect the threads that have already finished */
+static void
+collect_threads(size_t dbc, struct smap_database_instance **dbv)
+{
+	size_t i;
+
+	for (i = 0; i < dbc; i++)
+		if (dbv[i]->thread && dbv[i]->thread->done)
+			parallel_join(dbv[i]);
+}
+
+/* Query databases DBV[0..DBC-1] in parallel and send the resulting
+   reply to OSTR.  TIMEOUT is the deadline in milliseconds, 0 meaning
+   no deadline.  Return 0 on success, 1 if none of the databases could
+   be used and the query should be passed to the next rule, and -1 if
+   the query could not be started. */
+int
+parallel_query(size_t dbc, struct smap_database_instance **dbv,
+	       unsigned timeout, const char *map, const char *key,
+	       struct smap_conninfo const *conninfo, smap_stream_t ostr)
+{
+	struct parallel_batch *bp;
+	struct parallel_job *job;
+	struct timespec deadline;
+	int limit, rc;
+	size_t i;
+
+	diag_init();
+	bp = batch_create(dbc, dbv, map, key, conninfo);
+	if (!bp)
+		return -1;
+	limit = deadline_init(&deadline, timeout, &bp->conninfo);
+
+	/* Submit asynchronous queries and start threaded jobs first,
+	   then run the rest in turn */
+	for (i = 0; i < dbc; i++) {
+		job = &bp->job[i];
+		if (job_submit(job) == 0)
+			job->started = 1;
+		else if (threadsafe(job->dbi)) {
+			job_start(job);
+			job->started = 1;
+		}
+	}
+	for (i = 0; i < dbc; i++) {
+		job = &bp->job[i];
+		if (job->started || job_busy(job))
+			continue;
+		pthread_mutex_lock(&bp->mutex);
+		if (bp->winner) {
+			pthread_mutex_unlock(&bp->mutex);
+			break;
+		}
+		bp->refcnt++;
+		pthread_mutex_unlock(&bp->mutex);
+		job_run(job);
+	}
+
+	pthread_mutex_lock(&bp->mutex);
+	batch_wait(bp, limit, &deadline);
+	rc = batch_reply(bp, bp->njobs, ostr);
+	batch_cancel(bp);
+	batch_unref(bp);
+	collect_threads(dbc, dbv);
+	return rc;
+}
+
+/* Send a hedged query to the database DBI and its replicas and send
+   the first accepted reply to OSTR.  Return value as for
+   parallel_query. */
+int
+parallel_hedge(struct smap_database_instance *dbi,
+	       const char *map, const char *key,
+	       struct smap_conninfo const *conninfo, smap_stream_t ostr)
+{
+	struct smap_database_instance **replv, **dbv;
+	size_t dbc, started = 0;
+	struct parallel_batch *bp;
+	struct timespec deadline;
+	unsigned delay = 0;
+	int limit = 0, rc;
+
+	diag_init();
+	dbc = hedge_replicas(dbi->hedge, &replv) + 1;
+	dbv = ecalloc(dbc, sizeof(dbv[0]));
+	dbv[0] = dbi;
+	memcpy(dbv + 1, replv, (dbc - 1) * sizeof(dbv[0]));
+	bp = batch_create(dbc, dbv, map, key, conninfo);
+	if (!bp) {
+		free(dbv);
+		return -1;
+	}
+	bp->hedge = 1;
+
+	pthread_mutex_lock(&bp->mutex);
+	while (!bp->winner) {
+		if (started > 0 && bp->ndone < started) {
+			if (!limit) {
+				pthread_cond_wait(&bp->cond, &bp->mutex);
+				continue;
+			}
+			if (pthread_cond_timedwait(&bp->cond, &bp->mutex,
+						   &deadline) != ETIMEDOUT)
+				continue;
+			if (limit == 2) {
+				bp->expired = 1;
+				break;
+			}
+		}
+		/* Either nothing is started yet, or all started jobs
+		   have failed, or the hedge delay has expired */
+		if (started == dbc)
+			break;
+		if (started)
+			debug(DBG_QUERY, 1,
+			      ("%s: no reply in %u ms, hedging to %s",
+			       dbi->id, delay, dbv[started]->id));
+		pthread_mutex_unlock(&bp->mutex);
+		job_start(&bp->job[started++]);
+		delay = hedge_delay(dbi->hedge);
+		limit = deadline_init(&deadline, started < dbc ? delay : 0,
+				      &bp->conninfo);
+		pthread_mutex_lock(&bp->mutex);
+	}
+	rc = batch_reply(bp, started, ostr);
+	batch_unref(bp);
+	collect_threads(dbc, dbv);
+	free(dbv);
+	return rc;
+}
@@ -68,6 +68,13 @@ struct dispatch_rule {
 	char *dbname;
 	struct smap_database_instance *dbi;
 	int xform;
+	int parallel;               /* Query databases in parallel */
+	unsigned timeout;           /* Parallel query deadline, ms */
+	size_t dbc;                 /* Number of databases */
+	struct smap_database_instance **dbv; /* Databases to query */
+	size_t index;               /* Index in the hit counter table */
+	unsigned long last_hits;    /* Hit count at the last reordering */
+	unsigned long score;        /* Decaying hit frequency */
 };
 
 
@@ -137,7 +144,9 @@ enum query_tok {
 	T_DB,
 	T_NOT,
 	T_TRANSFORM,
-	T_KEY
+	T_KEY,
+	T_PARALLEL,
+	T_TIMEOUT
 };
 
 static struct smap_kwtab query_kwtab[] = {
@@ -153,6 +162,8 @@ static struct smap_kwtab query_kwtab[] = {
 	{ "not", T_NOT },
 	{ "transform", T_TRANSFORM },
 	{ "key", T_KEY },
+	{ "parallel", T_PARALLEL },
+	{ "timeout", T_TIMEOUT },
 	{ NULL }
 };
 
@@ -439,6 +450,8 @@ parse_complex_dispatch()
 	char *dbname = NULL;
 	struct dispatch_rule *rp;
 	int xform = XFORM_NONE;
+	int parallel = 0;
+	unsigned timeout = 0;
 	
 	while (*input && rc == 0) {
 		char *s = *input++;
@@ -508,6 +521,19 @@ parse_complex_dispatch()
 					rc = 1;
 				}
 			}
+			break;
+
+		case T_PARALLEL:
+			parallel = 1;
+			break;
+
+		case T_TIMEOUT:
+			s = nextarg();
+			if (!s)
+				rc = 1;
+			else if (cfg_parse_msec(s, &timeout))
+				rc = 1;
+			break;
 		}
 		if (rc == 1)
 			break;
@@ -526,12 +552,24 @@ parse_complex_dispatch()
 		/* FIXME: Free collected data */
 		return 1;
 	}
+	if (timeout && !parallel) {
+		smap_error("%s:%u: timeout is valid only for parallel queries",
+			   cfg_file_name, cfg_line);
+		return 1;
+	}
+	if (parallel && xform) {
+		smap_error("%s:%u: transformations cannot be parallel",
+			   cfg_file_name, cfg_line);
+		return 1;
+	}
 	rp = ecalloc(1, sizeof(*rp));
 	rp->file = estrdup(cfg_file_name);
 	rp->line = cfg_line;
 	rp->cond = head;
 	rp->dbname = dbname;
 	rp->xform = xform;
+	rp->parallel = parallel;
+	rp->timeout = timeout;
 	dispatch_attach(rp);
 	return 0;
 }
@@ -578,16 +616,17 @@ parse_dispatch(char **wordv)
 	return parse_complex_dispatch();
 }
 
-int
-rule_fixup(struct dispatch_rule *p)
+static int
+db_fixup(struct dispatch_rule *p, const char *dbname,
+	 struct smap_database_instance **pdbi)
 {
 	struct smap_database_instance *dbi;
 	struct smap_module *mod;
 
-	dbi = database_locate(p->dbname);
+	dbi = database_locate(dbname);
 	if (!dbi) {
 		smap_error("%s:%u: no such database: %s",
-			   p->file, p->line, p->dbname);
+			   p->file, p->line, dbname);
 		return 1;
 	}
 
@@ -611,20 +650,195 @@ rule_fixup(struct dispatch_rule *p)
 			if (!(mod->smap_capabilities & SMAP_CAPA_QUERY)) {
 				smap_error("%s:%u: database %s does not "
 					   "handle queries: %x",
-					   p->file, p->line, p->dbname,
+					   p->file, p->line, dbname,
 					mod->smap_capabilities);
 				return 1;
 			}
 		}
 	}
-	p->dbi = dbi;
+	*pdbi = dbi;
+	return 0;
+}
+
+int
+rule_fixup(struct dispatch_rule *p)
+{
+	struct wordsplit ws;
+	size_t i, j;
+	int rc = 0;
+
+	ws.ws_delim = ",";
+	if (wordsplit(p->dbname, &ws,
+		      WRDSF_NOVAR | WRDSF_NOCMD | WRDSF_DELIM |
+		      WRDSF_SQUEEZE_DELIMS)) {
+		smap_error("%s:%u: cannot split database list: %s",
+			   p->file, p->line, wordsplit_strerror(&ws));
+		return 1;
+	}
+	if (ws.ws_wordc == 0) {
+		smap_error("%s:%u: database not specified",
+			   p->file, p->line);
+		wordsplit_free(&ws);
+		return 1;
+	}
+	if (ws.ws_wordc > 1 && !p->parallel) {
+		smap_error("%s:%u: several databases can be used only "
+			   "in parallel queries",
+			   p->file, p->line);
+		wordsplit_free(&ws);
+		return 1;
+	}
+
+	p->dbv = ecalloc(ws.ws_wordc, sizeof(p->dbv[0]));
+	for (i = 0; i < ws.ws_wordc; i++) {
+		if (db_fixup(p, ws.ws_wordv[i], &p->dbv[i])) {
+			rc = 1;
+			break;
+		}
+		for (j = 0; j < i; j++)
+			if (p->dbv[j] == p->dbv[i]) {
+				smap_error("%s:%u: database %s listed twice",
+					   p->file, p->line, p->dbv[i]->id);
+				rc = 1;
+				break;
+			}
+		if (rc)
+			break;
+	}
+	wordsplit_free(&ws);
+	if (rc) {
+		free(p->dbv);
+		p->dbv = NULL;
+		return 1;
+	}
+	p->dbc = i;
+	p->dbi = p->dbv[0];
+	return 0;
+}
+
+/* Adaptive rule ordering.
+
+   Each rule has a hit counter in the shared memory, which is
+   incremented by the subprocesses each time the rule matches.
+
+   If dispatch-optimize is set, link_dispatch_rules looks for runs of
+   consecutive rules which are mutually exclusive, i.e. no query can
+   match more than one rule from the run.  The order of rules within
+   such a run does not affect the dispatching.  The master
+   periodically sorts each run by decreasing hit frequency, so that
+   the subprocesses it forks try the frequently used rules first. */
+
+int dispatch_optimize_option;
+unsigned dispatch_optimize_interval = 60;
+
+struct dispatch_run {
+	size_t start;               /* Index of the first rule */
+	size_t count;               /* Number of rules */
+};
+
+static struct dispatch_rule **rule_tab; /* Rules in current order */
+static size_t rule_count;
+static unsigned long *rule_hits;        /* Hit counters (shared) */
+static struct dispatch_run *run_tab;    /* Reorderable runs */
+static size_t run_count;
+static time_t last_reorder;
+static unsigned rule_gen;               /* Incremented on reordering */
+
+static int
+eq_cond(struct query_cond *cond)
+{
+	return (cond->type == query_cond_map || cond->type == query_cond_key)
+		&& cond->v.comp.op == comp_eq;
+}
+
+/* Return 1 if no query can match both rules A and B.  This is so if
+   both require equality of the map (or key) to different strings. */
+static int
+rules_exclusive(struct dispatch_rule *a, struct dispatch_rule *b)
+{
+	struct query_cond *ca, *cb;
+
+	for (ca = a->cond; ca; ca = ca->next) {
+		if (!eq_cond(ca))
+			continue;
+		for (cb = b->cond; cb; cb = cb->next)
+			if (eq_cond(cb) && cb->type == ca->type
+			    && strcmp(ca->v.comp.str, cb->v.comp.str))
+				return 1;
+	}
 	return 0;
 }
 
+/* Return 1 if rule P may be moved within a run.  Transformations
+   cannot, because they affect the rules that follow them. */
+static int
+rule_movable(struct dispatch_rule *p)
+{
+	struct query_cond *cond;
+
+	if (p->xform)
+		return 0;
+	for (cond = p->cond; cond; cond = cond->next)
+		if (eq_cond(cond))
+			return 1;
+	return 0;
+}
+
+static void
+log_run(struct dispatch_run *run, const char *what, int scores)
+{
+	smap_stream_t str;
+	const char *buf;
+	size_t i;
+
+	if (smap_memory_stream_create(&str))
+		return;
+	for (i = 0; i < run->count; i++) {
+		struct dispatch_rule *p = rule_tab[run->start + i];
+		smap_stream_printf(str, "%s%s:%u", i ? ", " : "",
+				   p->file, p->line);
+		if (scores)
+			smap_stream_printf(str, " (%lu)", p->score);
+	}
+	smap_stream_flush(str);
+	if (smap_stream_ioctl(str, SMAP_IOCTL_GET_BUFFER, &buf) == 0)
+		smap_error("%s: %s", what, buf);
+	smap_stream_destroy(&str);
+}
+
+static void
+find_runs()
+{
+	size_t i, j, k;
+
+	for (i = 0; i < rule_count; ) {
+		for (j = i; j < rule_count && rule_movable(rule_tab[j]); j++) {
+			for (k = i; k < j; k++)
+				if (!rules_exclusive(rule_tab[k], rule_tab[j]))
+					break;
+			if (k < j)
+				break;
+		}
+		if (j - i > 1) {
+			run_tab = erealloc(run_tab,
+					   (run_count + 1) * sizeof(run_tab[0]));
+			run_tab[run_count].start = i;
+			run_tab[run_count].count = j - i;
+			log_run(&run_tab[run_count], "independent rules", 0);
+			run_count++;
+		}
+		i = j > i ? j : i + 1;
+	}
+}
+
+static void dispatch_tables_build(void);
+static void dispatch_tables_rebuild(void);
+
 void
 link_dispatch_rules()
 {
 	struct dispatch_rule *p;
+	size_t i;
 
 	for (p = dispatch_head; p; ) {
 		struct dispatch_rule *next = p->next;
@@ -636,6 +850,255 @@ link_dispatch_rules()
 		}
 		p = next;
 	}
+
+	for (p = dispatch_head, rule_count = 0; p; p = p->next)
+		rule_count++;
+	if (rule_count == 0)
+		return;
+	rule_tab = ecalloc(rule_count, sizeof(rule_tab[0]));
+	for (p = dispatch_head, i = 0; p; p = p->next, i++) {
+		p->index = i;
+		rule_tab[i] = p;
+	}
+	rule_hits = shm_alloc(rule_count * sizeof(rule_hits[0]));
+	if (rule_hits && dispatch_optimize_option)
+		find_runs();
+	last_reorder = time(NULL);
+	dispatch_tables_build();
+}
+
+/* Return the interval (in seconds) at which dispatch_reorder should
+   be called, or 0 if it is not needed. */
+unsigned
+dispatch_reorder_interval()
+{
+	return run_count ? dispatch_optimize_interval : 0;
+}
+
+/* Sort the run RUN by decreasing score.  Rules with equal scores
+   retain their relative order.  Return 1 if the order has changed. */
+static int
+sort_run(struct dispatch_run *run)
+{
+	struct dispatch_rule **tab = rule_tab + run->start;
+	size_t i, j;
+	int changed = 0;
+
+	for (i = 1; i < run->count; i++) {
+		struct dispatch_rule *p = tab[i];
+		for (j = i; j > 0 && tab[j-1]->score < p->score; j--)
+			tab[j] = tab[j-1];
+		if (j != i) {
+			tab[j] = p;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* Reorder the runs of independent rules according to their hit
+   frequency.  Called periodically by the master process. */
+void
+dispatch_reorder()
+{
+	time_t now;
+	size_t i;
+	int changed = 0;
+
+	if (run_count == 0)
+		return;
+	now = time(NULL);
+	if (now - last_reorder < dispatch_optimize_interval)
+		return;
+	last_reorder = now;
+
+	for (i = 0; i < rule_count; i++) {
+		struct dispatch_rule *p = rule_tab[i];
+		unsigned long hits = rule_hits[p->index];
+
+		p->score = p->score / 2 + (hits - p->last_hits);
+		p->last_hits = hits;
+		debug(DBG_QUERY, 2, ("rule at %s:%u: %lu hits, score %lu",
+				     p->file, p->line, hits, p->score));
+	}
+
+	for (i = 0; i < run_count; i++)
+		if (sort_run(&run_tab[i])) {
+			log_run(&run_tab[i], "new rule order", 1);
+			changed = 1;
+		}
+
+	if (changed) {
+		for (i = 0; i < rule_count; i++) {
+			rule_tab[i]->prev = i ? rule_tab[i-1] : NULL;
+			rule_tab[i]->next =
+				i + 1 < rule_count ? rule_tab[i+1] : NULL;
+		}
+		dispatch_head = rule_tab[0];
+		dispatch_tail = rule_tab[rule_count - 1];
+		rule_gen++;
+		dispatch_tables_rebuild();
+	}
+}
+
+/* Per-server dispatch tables.
+
+   The server a session is served by does not change during the
+   session.  So, the rules are evaluated in advance against the ID of
+   each server: the rules whose server condition fails are dropped,
+   and the server conditions of the remaining ones are folded away.
+   Queries are then dispatched using the resulting table.  The master
+   builds the tables once the rules are linked, and rebuilds them when
+   the rules are reordered, so that the subprocesses inherit them
+   ready to use. */
+
+struct dispatch_entry {
+	struct dispatch_rule *rule;
+	struct query_cond **condv;  /* Conditions, NULL-terminated */
+};
+
+struct dispatch_table {
+	struct dispatch_table *next;
+	char *server_id;
+	unsigned gen;               /* Value of rule_gen it is built for */
+	size_t count;               /* Number of entries */
+	struct dispatch_entry *entv;
+};
+
+static struct dispatch_table *dispatch_tables;
+static struct dispatch_table *current_table;
+static const char *current_id;
+
+static void
+dispatch_table_fill(struct dispatch_table *tab)
+{
+	struct query_cond *cond;
+	size_t i, n;
+
+	tab->count = 0;
+	tab->entv = rule_count ? ecalloc(rule_count, sizeof(tab->entv[0]))
+		               : NULL;
+	for (i = 0; i < rule_count; i++) {
+		struct dispatch_rule *p = rule_tab[i];
+		struct dispatch_entry *ent;
+
+		n = 0;
+		for (cond = p->cond; cond; cond = cond->next) {
+			if (cond->type != query_cond_server)
+				n++;
+			else if (strcmp(cond->v.id, tab->server_id))
+				break;
+		}
+		if (cond)
+			continue;
+
+		ent = &tab->entv[tab->count++];
+		ent->rule = p;
+		ent->condv = ecalloc(n + 1, sizeof(ent->condv[0]));
+		n = 0;
+		for (cond = p->cond; cond; cond = cond->next)
+			if (cond->type != query_cond_server)
+				ent->condv[n++] = cond;
+	}
+	tab->gen = rule_gen;
+	debug(DBG_QUERY, 1, ("server %s: using %lu of %lu dispatch rules",
+			     tab->server_id, (unsigned long) tab->count,
+			     (unsigned long) rule_count));
+}
+
+static void
+dispatch_table_clear(struct dispatch_table *tab)
+{
+	size_t i;
+
+	for (i = 0; i < tab->count; i++)
+		free(tab->entv[i].condv);
+	free(tab->entv);
+	tab->entv = NULL;
+	tab->count = 0;
+}
+
+/* Return the dispatch table for server ID */
+static struct dispatch_table *
+dispatch_table_get(const char *id)
+{
+	struct dispatch_table *tab;
+
+	if (current_table && id == current_id
+	    && current_table->gen == rule_gen)
+		return current_table;
+
+	for (tab = dispatch_tables; tab; tab = tab->next)
+		if (strcmp(tab->server_id, id) == 0)
+			break;
+	if (!tab) {
+		tab = ecalloc(1, sizeof(*tab));
+		tab->server_id = estrdup(id);
+		dispatch_table_fill(tab);
+		tab->next = dispatch_tables;
+		dispatch_tables = tab;
+	} else if (tab->gen != rule_gen) {
+		dispatch_table_clear(tab);
+		dispatch_table_fill(tab);
+	}
+	current_table = tab;
+	current_id = id;
+	return tab;
+}
+
+static int
+build_server_table(smap_server_t srv, void *data)
+{
+	dispatch_table_get(smap_server_get_id(srv));
+	return 0;
+}
+
+/* Build the dispatch tables of all servers */
+static void
+dispatch_tables_build()
+{
+	smap_srvman_iterate_data(build_server_table);
+	if (inetd_mode)
+		dispatch_table_get(smap_progname);
+	current_table = NULL;
+	current_id = NULL;
+}
+
+/* Rebuild the existing dispatch tables after the rules have been
+   reordered */
+static void
+dispatch_tables_rebuild()
+{
+	struct dispatch_table *tab;
+
+	for (tab = dispatch_tables; tab; tab = tab->next) {
+		dispatch_table_clear(tab);
+		dispatch_table_fill(tab);
+	}
+}
+
+/* Call FUN for each database the rules of server ID refer to.  A
+   database may be passed more than once. */
+void
+dispatch_iterate_databases(const char *id,
+			   void (*fun)(struct smap_database_instance *))
+{
+	struct dispatch_table *tab = dispatch_table_get(id);
+	size_t i, j;
+
+	for (i = 0; i < tab->count; i++) {
+		struct dispatch_rule *p = tab->entv[i].rule;
+
+		for (j = 0; j < p->dbc; j++)
+			fun(p->dbv[j]);
+	}
+}
+
+/* Prepare for dispatching queries received by server ID */
+void
+dispatch_set_server(const char *id)
+{
+	dispatch_table_get(id);
 }
 
 struct query_pack {
@@ -687,34 +1150,145 @@ match_cond(struct query_cond *cond, struct query_pack *qp)
 }
 
 static int
-match_cond_list(struct query_cond *cond, struct query_pack *qp)
+match_condv(struct query_cond **condv, struct query_pack *qp)
 {
-	for (; cond; cond = cond->next)
-		if (!match_cond(cond, qp))
+	for (; *condv; condv++)
+		if (!match_cond(*condv, qp))
 			return 0;
 	return 1;
 }
 
+/* Find the first rule from table TAB that matches QP, starting from
+   the entry *PNEXT.  Store the index of the entry following it in
+   *PNEXT. */
 static struct dispatch_rule *
-find_dispatch_rule(struct query_pack *qp, struct dispatch_rule *start)
+find_dispatch_rule(struct query_pack *qp, struct dispatch_table *tab,
+		   size_t *pnext)
 {
-	struct dispatch_rule *p;
+	size_t i;
+
+	for (i = *pnext; i < tab->count; i++) {
+		struct dispatch_entry *ent = &tab->entv[i];
+
+		debug(DBG_QUERY, 2, ("trying %s:%u",
+				     ent->rule->file, ent->rule->line));
+		if (match_condv(ent->condv, qp)) {
+			*pnext = i + 1;
+			if (rule_hits)
+				shm_counter_inc(&rule_hits[ent->rule->index]);
+			return ent->rule;
+		}
+	}
+	*pnext = tab->count;
+	return NULL;
+}
 
-	if (!start)
-		start = dispatch_head;
-	for (p = start; p; p = p->next) {
-		debug(DBG_QUERY, 2, ("trying %s:%u", p->file, p->line));
-		if (match_cond_list(p->cond, qp))
-			break;
+/* Reply to the query, if the database DBI cannot be used.  Return 1
+   if the query should be passed to the next rule instead. */
+int
+database_failure(struct smap_database_instance *dbi, smap_stream_t ostr)
+{
+	if (dbi->onerror_continue) {
+		debug(DBG_QUERY, 1, ("%s: trying next rule", dbi->id));
+		return 1;
 	}
-	return p;
+	smap_stream_printf(ostr, "%s\n",
+			   dbi->onerror_reply ? dbi->onerror_reply
+			                      : "NOTFOUND");
+	return 0;
+}
+
+/* If the query deadline has expired, send the TEMP reply and return 1 */
+static int
+deadline_expired(struct query_pack *qp, smap_stream_t ostr)
+{
+	if (smap_deadline_left(qp->conninfo) != 0)
+		return 0;
+	debug(DBG_QUERY, 1, ("query %s %s: deadline expired",
+			     qp->map, qp->key));
+	smap_stream_printf(ostr, "%s\n", DEADLINE_REPLY);
+	return 1;
+}
+
+struct query_closure {
+	struct smap_database_instance *dbi;
+	struct query_pack *qp;
+	struct smap_conninfo const *conninfo;
+};
+
+/* Query the database.  Return 0 if the reply has been sent,
+   QUERY_NEXT_RULE if the database could not be used and the query
+   should be passed to the next rule, and any other non-zero value if
+   the query should be replied with the default NOTFOUND. */
+static int
+run_query(void *data, smap_stream_t ostr)
+{
+	struct query_closure *qc = data;
+	struct smap_database_instance *dbi = qc->dbi;
+
+	/* The deadline may have expired while waiting for a coalesced
+	   query */
+	if (deadline_expired(qc->qp, ostr))
+		return 0;
+	if (dbi->hedge) {
+		switch (parallel_hedge(dbi, qc->qp->map, qc->qp->key,
+				       qc->conninfo, ostr)) {
+		case 0:
+			return 0;
+		case 1:
+			return QUERY_NEXT_RULE;
+		}
+	}
+	if (database_open(dbi))
+		return database_failure(dbi, ostr) ? QUERY_NEXT_RULE : 0;
+	return dbi->inst->module->smap_query(dbi->dbh, ostr,
+					     qc->qp->map, qc->qp->key,
+					     qc->conninfo);
 }
 
+/* Return 1 if the database DBI can be used in batch queries */
+static int
+batch_capable(struct smap_database_instance *dbi)
+{
+	struct smap_module *mod = dbi->inst->module;
+	return mod->smap_version > 2
+		&& (mod->smap_capabilities & SMAP_CAPA_BATCH)
+		&& !dbi->hedge
+		&& !dbi->coalesce;
+}
+
+/* Query the database DBI, coalescing the query if so configured.
+   Return value as for run_query. */
+static int
+query_database(struct smap_database_instance *dbi, struct query_pack *qp,
+	       struct smap_conninfo const *conninfo, smap_stream_t ostr)
+{
+	struct query_closure qc;
+
+	qc.dbi = dbi;
+	qc.qp = qp;
+	qc.conninfo = conninfo;
+	if (dbi->coalesce)
+		return coalesce_run(dbi->coalesce, dbi->id,
+				    qp->map, qp->key, conninfo, ostr,
+				    run_query, &qc);
+	return run_query(&qc, ostr);
+}
+
+/* Dispatch the query QP, trying the rules starting from the entry
+   *PNEXT of the dispatch table.  If BATCH is not NULL and the query is
+   to be sent to a database that supports batch queries, store that
+   database in *BATCH, the index of the entry following its rule in
+   *PNEXT, and return without replying.  The caller is then
+   responsible for querying it, and for resuming the dispatch from
+   *PNEXT if the database cannot be used. */
 static void
 dispatch_query_pack(struct query_pack *qp,
-		    struct smap_conninfo const *conninfo, smap_stream_t ostr)
+		    struct smap_conninfo const *conninfo, smap_stream_t ostr,
+		    struct smap_database_instance **batch, size_t *pnext)
 {
-	struct dispatch_rule *next = NULL;
+	struct dispatch_table *tab = dispatch_table_get(qp->server_id);
+	size_t next = *pnext;
 	struct smap_database_instance *dbi;
 	struct smap_module *mod;
 
@@ -722,42 +1296,62 @@ dispatch_query_pack(struct query_pack *qp,
 	do {
 		struct dispatch_rule *qr;
 		
-		qr = find_dispatch_rule(qp, next);
+		qr = find_dispatch_rule(qp, tab, &next);
 		if (qr)
 			debug(DBG_QUERY, 1, ("rule at %s:%u, database %s",
 					     qr->file, qr->line, qr->dbname));
 		else
 			break;
 
+		if (deadline_expired(qp, ostr))
+			return;
+
 		dbi = qr->dbi;
 		mod = dbi->inst->module;
-		if (!dbi->opened) {
-			int rc = 0;
-			
-			debug(DBG_DATABASE, 2,
-			      ("opening database %s", dbi->id));
-			if (mod->smap_open)
-				rc = mod->smap_open(dbi->dbh);
-			if (rc) {
-				smap_error("cannot open database %s", dbi->id);
-				/* FIXME: mark database unusable */
-				smap_stream_printf(ostr, "NOTFOUND\n");
-				return;
-			}
-			dbi->opened = 1;
+		if (qr->parallel) {
+			int rc = parallel_query(qr->dbc, qr->dbv, qr->timeout,
+						qp->map, qp->key, conninfo,
+						ostr);
+			if (rc < 0)
+				break;
+			if (rc > 0)
+				continue;
+			return;
+		}
+		if (!dbi->hedge && parallel_busy(dbi)) {
+			debug(DBG_QUERY, 1, ("%s: busy with a previous query",
+					     dbi->id));
+			if (database_failure(dbi, ostr))
+				continue;
+			return;
 		}
-
 		if (qr->xform) {
 			const char **parg;
 			char *narg = NULL;
 			static const char *what[]= { "map", "key" };
-	
+			int rc;
+
 			if (qr->xform == XFORM_KEY)
 				parg = &qp->key;
 			else
 				parg = &qp->map;
-			if (mod->smap_xform(dbi->dbh,
-					    conninfo, *parg, &narg) == 0) {
+			if (dbi->xcache
+			    && xcache_lookup(dbi->xcache, *parg, &narg) == 0) {
+				debug(DBG_QUERY, 2,
+				      ("%s: transformation cache hit",
+				       dbi->id));
+				rc = 0;
+			} else if (database_open(dbi)) {
+				if (database_failure(dbi, ostr))
+					continue;
+				return;
+			} else {
+				rc = mod->smap_xform(dbi->dbh,
+						     conninfo, *parg, &narg);
+				if (rc == 0 && dbi->xcache)
+					xcache_store(dbi->xcache, *parg, narg);
+			}
+			if (rc == 0) {
 				if (narg) {
 					debug(DBG_QUERY, 1,
 					      ("rule at %s:%u, transformed %s: %s => %s",
@@ -771,31 +1365,238 @@ dispatch_query_pack(struct query_pack *qp,
 			} else
 				smap_error("%s:%u: transformation failed",
 					   qr->file, qr->line);
-			next = qr->next;
-		} else {		 
-			if (mod->smap_query(dbi->dbh, ostr,
-					    qp->map, qp->key,
-					    conninfo))
-				break;
-			return;
+		} else {
+			if (dbi->negcache
+			    && negcache_absent(dbi->negcache, qp->key)) {
+				debug(DBG_QUERY, 1,
+				      ("%s: key %s is not in the database",
+				       dbi->id, qp->key));
+				smap_stream_printf(ostr, "%s\n",
+					  negcache_get_reply(dbi->negcache));
+				return;
+			}
+
+			if (!dbi->hedge && database_open(dbi)) {
+				if (database_failure(dbi, ostr))
+					continue;
+				return;
+			}
+
+			if (batch && batch_capable(dbi)) {
+				*batch = dbi;
+				*pnext = next;
+				return;
+			}
+			switch (query_database(dbi, qp, conninfo, ostr)) {
+			case 0:
+				return;
+			case QUERY_NEXT_RULE:
+				continue;
+			}
+			break;
 		}
-	} while (next);
+	} while (next < tab->count);
 	smap_error("no database matches %s %s", qp->map, qp->key);
 	smap_stream_printf(ostr, "NOTFOUND\n");
 }
 
+/* Set the query deadline in CI, using TV as storage */
+static void
+query_deadline(struct smap_conninfo *ci, struct timeval *tv)
+{
+	if (!smap_timeout)
+		return;
+	gettimeofday(tv, NULL);
+	tv->tv_sec += smap_timeout / 1000;
+	tv->tv_usec += (smap_timeout % 1000) * 1000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+	ci->deadline = tv;
+}
+
 void
 dispatch_query(const char *id, struct smap_conninfo const *conninfo,
 	       smap_stream_t ostr, const char *map, const char *key)
 {
 	struct query_pack query;
-	
+	struct smap_conninfo ci = *conninfo;
+	struct timeval deadline;
+	size_t next = 0;
+
+	query_deadline(&ci, &deadline);
 	query.server_id = id;
-	query.conninfo = conninfo;
+	query.conninfo = &ci;
 	query.map = map;
 	query.key = key;
 	query.storage[0] = query.storage[1] = NULL;
-	dispatch_query_pack(&query, conninfo, ostr);
+	dispatch_query_pack(&query, &ci, ostr, NULL, &next);
 	free(query.storage[0]);
 	free(query.storage[1]);
 }
+
+struct batch_entry {
+	struct query_pack qp;
+	struct smap_database_instance *dbi; /* Database to query, if
+					       the query is deferred */
+	size_t next;                /* Dispatch table entry to resume
+				       from, if it cannot be used */
+	char *reply;                /* Reply text */
+};
+
+/* Return the contents of the memory stream STR */
+static const char *
+stream_text(smap_stream_t str)
+{
+	const char *buf;
+
+	smap_stream_flush(str);
+	if (smap_stream_ioctl(str, SMAP_IOCTL_GET_BUFFER, &buf))
+		return "";
+	return buf;
+}
+
+/* Query the database DBI for the keys of entries SELV[0..N-1], which
+   have the same map, in a single batch.  Return 0 on success. */
+static int
+batch_query(struct smap_database_instance *dbi, struct batch_entry *bv,
+	    size_t *selv, size_t n, const char **keys,
+	    struct smap_conninfo const *conninfo, smap_stream_t str)
+{
+	struct smap_module *mod = dbi->inst->module;
+	const char *p, *q;
+	size_t i;
+
+	if (smap_deadline_left(conninfo) == 0)
+		return 1;
+	for (i = 0; i < n; i++)
+		keys[i] = bv[selv[i]].qp.key;
+	debug(DBG_QUERY, 1, ("%s: batch query of %lu keys in map %s",
+			     dbi->id, (unsigned long) n,
+			     bv[selv[0]].qp.map));
+	smap_stream_truncate(str, 0);
+	if (mod->smap_query_batch(dbi->dbh, str, bv[selv[0]].qp.map,
+				  keys, n, conninfo)) {
+		debug(DBG_QUERY, 1, ("%s: batch query failed", dbi->id));
+		return 1;
+	}
+
+	p = stream_text(str);
+	for (i = 0; i < n && *p; i++) {
+		q = strchr(p, '\n');
+		if (!q)
+			break;
+		q++;
+		bv[selv[i]].reply = emalloc(q - p + 1);
+		memcpy(bv[selv[i]].reply, p, q - p);
+		bv[selv[i]].reply[q - p] = 0;
+		p = q;
+	}
+	if (i < n || *p) {
+		smap_error("%s: module returned malformed batch reply",
+			   dbi->id);
+		for (i = 0; i < n; i++) {
+			free(bv[selv[i]].reply);
+			bv[selv[i]].reply = NULL;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Dispatch N queries received at once.  Queries that go to the same
+   database and map are sent to it in a single batch, if the module
+   supports it.  Replies are sent to OSTR in the order of queries. */
+void
+dispatch_batch(const char *id, struct smap_conninfo const *conninfo,
+	       smap_stream_t ostr, size_t n,
+	       const char **mapv, const char **keyv)
+{
+	struct smap_conninfo ci = *conninfo;
+	struct timeval deadline;
+	struct batch_entry *bv;
+	size_t *selv;
+	const char **keys;
+	smap_stream_t str;
+	size_t i, j, cnt;
+
+	if (smap_memory_stream_create(&str)) {
+		smap_error("cannot create memory stream");
+		for (i = 0; i < n; i++)
+			dispatch_query(id, conninfo, ostr, mapv[i], keyv[i]);
+		return;
+	}
+
+	bv = ecalloc(n, sizeof(bv[0]));
+	selv = ecalloc(n, sizeof(selv[0]));
+	keys = ecalloc(n, sizeof(keys[0]));
+
+	/* Dispatch each query up to the point where the database is
+	   queried.  Each query and each batch gets its own deadline,
+	   so that the queries handled late are not penalized. */
+	for (i = 0; i < n; i++) {
+		struct query_pack *qp = &bv[i].qp;
+
+		qp->server_id = id;
+		qp->conninfo = &ci;
+		qp->map = mapv[i];
+		qp->key = keyv[i];
+		query_deadline(&ci, &deadline);
+		smap_stream_truncate(str, 0);
+		dispatch_query_pack(qp, &ci, str, &bv[i].dbi, &bv[i].next);
+		if (!bv[i].dbi)
+			bv[i].reply = estrdup(stream_text(str));
+	}
+
+	/* Query the databases */
+	for (i = 0; i < n; i++) {
+		struct smap_database_instance *dbi = bv[i].dbi;
+
+		if (bv[i].reply)
+			continue;
+		cnt = 0;
+		for (j = i; j < n; j++)
+			if (!bv[j].reply && bv[j].dbi == dbi
+			    && strcmp(bv[j].qp.map, bv[i].qp.map) == 0)
+				selv[cnt++] = j;
+		query_deadline(&ci, &deadline);
+		if (cnt > 1
+		    && batch_query(dbi, bv, selv, cnt, keys, &ci, str) == 0)
+			continue;
+		for (j = 0; j < cnt; j++) {
+			struct query_pack *qp = &bv[selv[j]].qp;
+
+			if (j > 0)
+				query_deadline(&ci, &deadline);
+			smap_stream_truncate(str, 0);
+			switch (query_database(dbi, qp, &ci, str)) {
+			case 0:
+				break;
+			case QUERY_NEXT_RULE:
+				/* Continue as dispatch_query_pack would */
+				smap_stream_truncate(str, 0);
+				dispatch_query_pack(qp, &ci, str, NULL,
+						    &bv[selv[j]].next);
+				break;
+			default:
+				smap_error("no database matches %s %s",
+					   qp->map, qp->key);
+				smap_stream_printf(str, "NOTFOUND\n");
+			}
+			bv[selv[j]].reply = estrdup(stream_text(str));
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		smap_stream_write(ostr, bv[i].reply, strlen(bv[i].reply),
+				  NULL);
+		free(bv[i].reply);
+		free(bv[i].qp.storage[0]);
+		free(bv[i].qp.storage[1]);
+	}
+	free(bv);
+	free(selv);
+	free(keys);
+	smap_stream_destroy(&str);
+}
@@ -0,0 +1,98 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Memory shared between the master and its subprocesses.  It must be
+   allocated by the master before the subprocesses are forked. */
+
+#include "smapd.h"
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+void *
+shm_alloc(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		smap_error("cannot allocate %lu bytes of shared memory: %s",
+			   (unsigned long) size, strerror(errno));
+		return NULL;
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+void
+shm_free(void *ptr, size_t size)
+{
+	if (ptr)
+		munmap(ptr, size);
+}
+
+/* Shared memory locks are simple spinlocks.  They are only held for
+   a few memory accesses, so contention is negligible.  The lock word
+   keeps the PID of the holder, so that a lock held by a process that
+   died before releasing it (e.g. killed by a signal) can be broken
+   instead of blocking all other processes forever. */
+
+/* Check the holder each that many spins */
+#define SHM_LOCK_CHECK 1000
+
+void
+shm_lock(shm_lock_t *lock)
+{
+	pid_t pid = getpid();
+	unsigned n = 0;
+
+	while (!__sync_bool_compare_and_swap(lock, 0, pid)) {
+		struct timespec ts = { 0, 1000 };
+		pid_t holder = *lock;
+
+		if (holder == 0)
+			continue;
+		if (++n % SHM_LOCK_CHECK == 0 && !shm_pid_alive(holder)
+		    && __sync_bool_compare_and_swap(lock, holder, pid)) {
+			smap_error("breaking shared memory lock held by "
+				   "dead process %lu",
+				   (unsigned long) holder);
+			return;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+void
+shm_unlock(shm_lock_t *lock)
+{
+	__sync_lock_release(lock);
+}
+
+/* Atomically increment the shared counter *P */
+void
+shm_counter_inc(unsigned long *p)
+{
+	__sync_fetch_and_add(p, 1);
+}
+
+/* Return 1 if process PID is alive */
+int
+shm_pid_alive(pid_t pid)
+{
+	return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
@@ -26,10 +26,15 @@
 char *config_file = SYSCONFDIR "/smapd.conf";
 int foreground;
 unsigned idle_timeout = 600;
+unsigned smap_timeout;       /* Query deadline, ms; 0 means no deadline */
+unsigned batch_size = 1;     /* Maximal number of pipelined queries
+				handled at once */
 int inetd_mode;
 int lint_mode;
+int preopen_option;          /* Open databases before forking */
 char *pidfile;
 struct privinfo global_privs;
+static pid_t master_pid;
 
 #define OPT_INT 0
 #define OPT_STR 1
@@ -105,40 +110,95 @@ smap_trimnl(char *buf)
 		buf[--len] = 0;
 }
 
+/* Read next request from STREAM.  On success, store the map name in
+   *PBUF and return 0, setting *PKEY to point to the key. */
+static int
+read_request(smap_stream_t stream, char **pbuf, size_t *psize, char **pkey)
+{
+	size_t len;
+	char *key;
+	int rc;
+
+	alarm(idle_timeout);
+	rc = smap_stream_getline(stream, pbuf, psize, &len);
+	alarm(0);
+
+	if (rc) {
+		smap_error("read error: %s",
+			   smap_stream_strerror(stream, rc));
+		return 1;
+	}
+	if (len == 0)
+		return 1;
+	smap_trimnl(*pbuf);
+	key = strchr(*pbuf, ' ');
+	if (!key) {
+		smap_error("protocol error: missing map name");
+		exit(1);
+	}
+	*key++ = 0;
+	*pkey = key;
+	return 0;
+}
+
+/* Return 1 if more input is available without blocking */
+static int
+input_pending(smap_stream_t stream)
+{
+	struct timeval tv = { 0, 0 };
+	int flags = SMAP_STREAM_READY_RD;
+
+	return smap_stream_wait(stream, &flags, &tv) == 0
+		&& (flags & SMAP_STREAM_READY_RD);
+}
+
 int
 smap_loop(smap_stream_t stream, const char *id, struct smap_conninfo *conninfo)
 {
 	char *buf = NULL;
 	size_t bufsize = 0;
-	size_t len;
 	char *key;
+	char **reqv = NULL;
+	const char **mapv = NULL, **keyv = NULL;
+	size_t i, reqc;
+
+	if (batch_size > 1) {
+		reqv = ecalloc(batch_size, sizeof(reqv[0]));
+		mapv = ecalloc(batch_size, sizeof(mapv[0]));
+		keyv = ecalloc(batch_size, sizeof(keyv[0]));
+	}
+	dispatch_set_server(id);
 
 	/* Read input: */
-	while (1) {
-		int rc;
-
-		alarm(idle_timeout);
-		rc = smap_stream_getline(stream, &buf, &bufsize, &len);
-		alarm(0);
-
-		if (rc) {
-			smap_error("read error: %s",
-				   smap_stream_strerror(stream, rc));
-			break;
-		}
-		if (len == 0)
-			break;
-		smap_trimnl(buf);
-		key = strchr(buf, ' ');
-		if (!key) {
-			smap_error("protocol error: missing map name");
-			exit(1);
+	while (read_request(stream, &buf, &bufsize, &key) == 0) {
+		if (!reqv || !input_pending(stream)) {
+			dispatch_query(id, conninfo, stream, buf, key);
+			continue;
 		}
-		*key++ = 0;
 
-		dispatch_query(id, conninfo, stream, buf, key);
+		/* The client has sent more queries without waiting for
+		   the reply.  Collect them and handle all at once. */
+		reqc = 0;
+		do {
+			size_t len = key - buf + strlen(key) + 1;
+			reqv[reqc] = emalloc(len);
+			memcpy(reqv[reqc], buf, len);
+			mapv[reqc] = reqv[reqc];
+			keyv[reqc] = reqv[reqc] + (key - buf);
+			reqc++;
+		} while (reqc < batch_size
+			 && input_pending(stream)
+			 && read_request(stream, &buf, &bufsize, &key) == 0);
+		debug(DBG_QUERY, 1, ("%lu pipelined queries",
+				     (unsigned long) reqc));
+		dispatch_batch(id, conninfo, stream, reqc, mapv, keyv);
+		for (i = 0; i < reqc; i++)
+			free(reqv[i]);
 	}
 	/* Cleanup and exit */
+	free(reqv);
+	free(mapv);
+	free(keyv);
 	free(buf);
 	close_databases();
 	return 0;
@@ -157,6 +217,7 @@ smap_session_server(const char *id, int fd,
 	ci.src = sa;
 	ci.srclen = salen;
 	smap_srvman_get_sockaddr(id, &ci.dst, &ci.dstlen);
+	ci.deadline = NULL;
 
 	if (pi) {
 		if (getgid() == 0) {
@@ -166,6 +227,9 @@ smap_session_server(const char *id, int fd,
 			debug(DBG_SMAP, 1,
 			      ("%s: ignoring server privilege settings", id));
 	}
+	if (preopen_option && getpid() != master_pid)
+		open_databases(id);
+
 	rc = smap_sockmap_stream_create(&stream, fd, SMAP_STREAM_NO_CLOSE);
 	if (rc) {
 		smap_error("cannot create socket stream: %s",
@@ -188,6 +252,23 @@ smap_session_server(const char *id, int fd,
 
 static int restart;         /* Set to 1 if restart is requested */
 
+static int
+smap_idle_hook(void *data)
+{
+	refresh_databases();
+	expire_databases();
+	check_brokers();
+	check_listeners();
+	dispatch_reorder();
+	return 0;
+}
+
+static int
+smap_exit_hook(pid_t pid, int status, void *data)
+{
+	return brokers_exited(pid, status);
+}
+
 static RETSIGTYPE
 sig_stop(int sig)
 {
@@ -271,8 +352,15 @@ smap_daemon(int argc, char **argv)
 		smap_error("no servers configured; exiting");
 		exit(EX_CONFIG);
 	}
+	master_pid = getpid();
+	start_brokers();
+	if (preopen_option)
+		preopen_databases();
+	start_listeners();
 	smap_srvman_run(NULL);
+	stop_listeners();
 	smap_srvman_shutdown();
+	stop_brokers();
 	smap_srvman_free();
 	if (pidfile && unlink(pidfile))
 		smap_error("failed to remove pidfile %s: %s",
@@ -297,6 +385,7 @@ smap_inet_server()
 	int rc;
 	smap_stream_t stream;
 
+	memset(&ci, 0, sizeof(ci));
 	slen = sizeof(srv_addr);
 	if (getsockname(0, &srv_addr.sa, &slen) == -1)
 		smap_error("gethostname: %s", strerror(errno));
@@ -692,13 +781,420 @@ cfg_module(struct cfg_kw *kw, int wordc, char **wordv, void *data)
 	return 0;
 }
 
+/* Return the WORDC words from WORDV joined with single spaces */
+static char *
+cfg_join_args(int wordc, char **wordv)
+{
+	size_t len;
+	int i;
+	char *buf, *p;
+
+	for (i = 0, len = 0; i < wordc; i++)
+		len += strlen(wordv[i]) + 1;
+	buf = p = emalloc(len);
+	for (i = 0; i < wordc; i++) {
+		if (i > 0)
+			*p++ = ' ';
+		strcpy(p, wordv[i]);
+		p += strlen(p);
+	}
+	return buf;
+}
+
+static struct negcache *
+get_db_negcache(struct smap_database_instance *db)
+{
+	if (!db->negcache)
+		db->negcache = negcache_create();
+	return db->negcache;
+}
+
+static int
+cfg_db_negcache(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	negcache_set_file(get_db_negcache(db), wordv[1]);
+	return 0;
+}
+
+static int
+cfg_db_negcache_fp_rate(struct cfg_kw *kw, int wordc, char **wordv,
+			void *data)
+{
+	struct smap_database_instance *db = data;
+	double rate;
+	char *p;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	rate = strtod(wordv[1], &p);
+	if (*p || negcache_set_fp_rate(get_db_negcache(db), rate)) {
+		smap_error("%s:%u: invalid false positive rate: %s",
+			   cfg_file_name, cfg_line, wordv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+cfg_db_negcache_refresh(struct cfg_kw *kw, int wordc, char **wordv,
+			void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], n);
+	negcache_set_refresh(get_db_negcache(db), n);
+	return 0;
+}
+
+static int
+cfg_db_negcache_fold(struct cfg_kw *kw, int wordc, char **wordv,
+		     void *data)
+{
+	struct smap_database_instance *db = data;
+	int n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	if (cfg_parse_bool(wordv[1], &n))
+		return 1;
+	negcache_set_fold(get_db_negcache(db), n);
+	return 0;
+}
+
+static int
+cfg_db_negcache_reply(struct cfg_kw *kw, int wordc, char **wordv,
+		      void *data)
+{
+	struct smap_database_instance *db = data;
+	char *reply;
+
+	if (cfg_chkargc(wordc, 2, 0))
+		return 1;
+	reply = cfg_join_args(wordc - 1, wordv + 1);
+	negcache_set_reply(get_db_negcache(db), reply);
+	free(reply);
+	return 0;
+}
+
+static struct coalesce *
+get_db_coalesce(struct smap_database_instance *db)
+{
+	if (!db->coalesce)
+		db->coalesce = coalesce_create();
+	return db->coalesce;
+}
+
+static int
+cfg_db_coalesce(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	int n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	if (cfg_parse_bool(wordv[1], &n))
+		return 1;
+	if (n)
+		get_db_coalesce(db);
+	else {
+		coalesce_free(db->coalesce);
+		db->coalesce = NULL;
+	}
+	return 0;
+}
+
+static int
+cfg_db_coalesce_timeout(struct cfg_kw *kw, int wordc, char **wordv,
+			void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	if (cfg_parse_msec(wordv[1], &n))
+		return 1;
+	coalesce_set_timeout(get_db_coalesce(db), n);
+	return 0;
+}
+
+static int
+cfg_db_xcache(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	size_t n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], n);
+	xcache_free(db->xcache);
+	db->xcache = n ? xcache_create(n) : NULL;
+	return 0;
+}
+
+static struct hedge *
+get_db_hedge(struct smap_database_instance *db)
+{
+	if (!db->hedge)
+		db->hedge = hedge_create();
+	return db->hedge;
+}
+
+static int
+cfg_db_replica(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	struct hedge *hp;
+	int i;
+
+	if (cfg_chkargc(wordc, 2, 0))
+		return 1;
+	hp = get_db_hedge(db);
+	for (i = 1; i < wordc; i++)
+		hedge_add_replica(hp, wordv[i]);
+	return 0;
+}
+
+static int
+cfg_db_hedge_percentile(struct cfg_kw *kw, int wordc, char **wordv,
+			void *data)
+{
+	struct smap_database_instance *db = data;
+	char *p;
+	double d;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	d = strtod(wordv[1], &p);
+	if (*p || hedge_set_percentile(get_db_hedge(db), d)) {
+		smap_error("%s:%u: invalid percentile: %s",
+			   cfg_file_name, cfg_line, wordv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+cfg_db_hedge_delay(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned min, max;
+
+	if (cfg_chkargc(wordc, 3, 3))
+		return 1;
+	if (cfg_parse_msec(wordv[1], &min) || cfg_parse_msec(wordv[2], &max))
+		return 1;
+	if (min > max) {
+		smap_error("%s:%u: minimal delay exceeds maximal delay",
+			   cfg_file_name, cfg_line);
+		return 1;
+	}
+	hedge_set_delay(get_db_hedge(db), min, max);
+	return 0;
+}
+
+static struct breaker *
+get_db_breaker(struct smap_database_instance *db)
+{
+	if (!db->breaker)
+		db->breaker = breaker_create();
+	return db->breaker;
+}
+
+static int
+cfg_db_breaker(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], n);
+	if (n)
+		breaker_set_threshold(get_db_breaker(db), n);
+	else {
+		breaker_free(db->breaker);
+		db->breaker = NULL;
+	}
+	return 0;
+}
+
+static int
+cfg_db_breaker_backoff(struct cfg_kw *kw, int wordc, char **wordv,
+		       void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned min, max;
+
+	if (cfg_chkargc(wordc, 3, 3))
+		return 1;
+	if (cfg_parse_msec(wordv[1], &min) || cfg_parse_msec(wordv[2], &max))
+		return 1;
+	if (min > max) {
+		smap_error("%s:%u: minimal backoff exceeds maximal backoff",
+			   cfg_file_name, cfg_line);
+		return 1;
+	}
+	breaker_set_backoff(get_db_breaker(db), min, max);
+	return 0;
+}
+
+static int
+cfg_db_onerror_reply(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 0))
+		return 1;
+	free(db->onerror_reply);
+	db->onerror_reply = cfg_join_args(wordc - 1, wordv + 1);
+	return 0;
+}
+
+static int
+cfg_db_onerror_continue(struct cfg_kw *kw, int wordc, char **wordv,
+			void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	return cfg_parse_bool(wordv[1], &db->onerror_continue);
+}
+
+static int
+cfg_db_persistent(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	return cfg_parse_bool(wordv[1], &db->persistent);
+}
+
+static int
+cfg_db_max_idle(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], db->max_idle);
+	return 0;
+}
+
+static int
+cfg_db_max_lifetime(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], db->max_lifetime);
+	return 0;
+}
+
+static struct broker_pool *
+get_db_broker_pool(struct smap_database_instance *db)
+{
+	if (!db->broker_pool)
+		db->broker_pool = broker_pool_create();
+	return db->broker_pool;
+}
+
+static int
+cfg_db_broker_pool(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], n);
+	broker_pool_set_size(get_db_broker_pool(db), n);
+	return 0;
+}
+
+static int
+cfg_db_broker_queue(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+	unsigned n;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	CFG_GETNUM(wordv[1], n);
+	broker_pool_set_queue(get_db_broker_pool(db), n);
+	return 0;
+}
+
+static int
+cfg_db_broker_socket(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	struct smap_database_instance *db = data;
+
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	broker_pool_set_socket(get_db_broker_pool(db), wordv[1]);
+	return 0;
+}
+
+static struct cfg_kw database_kwtab[] = {
+	{ "end", KWT_EOF },
+	{ "negative-cache", KWT_FUN, NULL, NULL, NULL, cfg_db_negcache },
+	{ "negative-cache-fp-rate", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_negcache_fp_rate },
+	{ "negative-cache-refresh", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_negcache_refresh },
+	{ "negative-cache-ignore-case", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_negcache_fold },
+	{ "negative-cache-reply", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_negcache_reply },
+	{ "coalesce", KWT_FUN, NULL, NULL, NULL, cfg_db_coalesce },
+	{ "coalesce-timeout", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_coalesce_timeout },
+	{ "transform-cache", KWT_FUN, NULL, NULL, NULL, cfg_db_xcache },
+	{ "replica", KWT_FUN, NULL, NULL, NULL, cfg_db_replica },
+	{ "hedge-percentile", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_hedge_percentile },
+	{ "hedge-delay", KWT_FUN, NULL, NULL, NULL, cfg_db_hedge_delay },
+	{ "circuit-breaker", KWT_FUN, NULL, NULL, NULL, cfg_db_breaker },
+	{ "circuit-backoff", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_breaker_backoff },
+	{ "onerror-reply", KWT_FUN, NULL, NULL, NULL, cfg_db_onerror_reply },
+	{ "onerror-continue", KWT_FUN, NULL, NULL, NULL,
+	  cfg_db_onerror_continue },
+	{ "persistent", KWT_FUN, NULL, NULL, NULL, cfg_db_persistent },
+	{ "max-idle", KWT_FUN, NULL, NULL, NULL, cfg_db_max_idle },
+	{ "max-lifetime", KWT_FUN, NULL, NULL, NULL, cfg_db_max_lifetime },
+	{ "broker-pool", KWT_FUN, NULL, NULL, NULL, cfg_db_broker_pool },
+	{ "broker-queue", KWT_FUN, NULL, NULL, NULL, cfg_db_broker_queue },
+	{ "broker-socket", KWT_FUN, NULL, NULL, NULL, cfg_db_broker_socket },
+	{ NULL }
+};
+
 static int
 cfg_database(struct cfg_kw *kw, int wordc, char **wordv, void *data)
 {
 	struct smap_database_instance *p;
+	int block = 0;
 
 	if (cfg_chkargc(wordc, 3, 0))
 		return 1;
+	/* Only a literal `begin' opens the block.  A quoted one is an
+	   argument to the module. */
+	if (wordc > 3 && strcmp(wordv[wordc-1], "begin") == 0
+	    && cfg_last_word_is("begin")) {
+		block = 1;
+		wordc--;
+	}
 	if (database_declare(cfg_file_name, cfg_line,
 			     wordv[1], wordv[2], wordc - 2, wordv + 2, &p)) {
 		smap_error("%s:%u: database `%s' has already been declared",
@@ -707,6 +1203,8 @@ cfg_database(struct cfg_kw *kw, int wordc, char **wordv, void *data)
 			   p->file, p->line);
 		return 1;
 	}
+	if (block)
+		parse_config_loop(database_kwtab, p);
 	return 0;
 }
 
@@ -778,12 +1276,26 @@ cfg_socket_mode(struct cfg_kw *kw, int wordc, char **wordv, void *data)
 	return 0;
 }
 
+static int
+cfg_query_timeout(struct cfg_kw *kw, int wordc, char **wordv, void *data)
+{
+	if (cfg_chkargc(wordc, 2, 2))
+		return 1;
+	return cfg_parse_msec(wordv[1], &smap_timeout);
+}
+
 static struct cfg_kw smap_kwtab[] = {
 	/*   kw        type       ival   sval  aval  fun */
 	{ "inetd-mode", KWT_BOOL,  &inetd_mode },
 	{ "pidfile", KWT_STRING, NULL, &pidfile, NULL, NULL },
 	{ "foreground", KWT_BOOL, &foreground, },
 	{ "idle-timeout", KWT_UINT, (int*) &idle_timeout },
+	{ "query-timeout", KWT_FUN, NULL, NULL, NULL, cfg_query_timeout },
+	{ "batch-size", KWT_UINT, (int*) &batch_size },
+	{ "preopen", KWT_BOOL, &preopen_option },
+	{ "dispatch-optimize", KWT_BOOL, &dispatch_optimize_option },
+	{ "dispatch-optimize-interval", KWT_UINT,
+	  (int*) &dispatch_optimize_interval },
 	{ "log-to-stderr", KWT_BOOL, &log_to_stderr, },
 	{ "log-to-syslog", KWT_BOOL, &log_to_stderr, NULL, NULL, bool_invert },
 	{ "log-tag", KWT_STRING, NULL, &log_tag },
@@ -842,6 +1354,8 @@ debug_init()
 int
 main(int argc, char **argv)
 {
+	unsigned n;
+
 	smap_set_program_name(argv[0]);
 	debug_init();
 	/* Logging is configured in two stages. Initial setup is based on
@@ -869,11 +1383,20 @@ main(int argc, char **argv)
 	smap_log_init();
 
 	/* Initialize module subsystem */
+	smap_set_single_process(srvman_param.single_process && !inetd_mode);
 	smap_modules_init();
 	smap_modules_load();
 	init_databases();
 	link_dispatch_rules();
 
+	srvman_param.idle_hook = smap_idle_hook;
+	srvman_param.exit_hook = smap_exit_hook;
+	srvman_param.idle_interval = databases_refresh_interval();
+	n = dispatch_reorder_interval();
+	if (n && (srvman_param.idle_interval == 0
+		  || n < srvman_param.idle_interval))
+		srvman_param.idle_interval = n;
+
 	if (inetd_mode)
 		smap_inet_server();
 	else
@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <ltdl.h>
 
@@ -142,8 +143,12 @@ int syslog_fname_to_n (const char *str, int *pint);
 /* smap.c */
 extern int foreground;
 extern unsigned smap_timeout;
+/* Reply sent when the query deadline expires */
+#define DEADLINE_REPLY "TEMP query deadline expired"
+extern unsigned batch_size;
 extern int inetd_mode;
 extern int lint_mode;
+extern int preopen_option;
 extern char *pidfile;
 
 /* cfg.c */
@@ -177,7 +182,9 @@ int parse_config(const char *filename, struct cfg_kw *, void *);
 void parse_config_loop(struct cfg_kw *kwtab, void *);
 
 int cfg_chkargc(int wordc, int min, int max);
+int cfg_last_word_is(const char *word);
 int cfg_parse_bool(const char *str, int *res);
+int cfg_parse_msec(const char *str, unsigned *res);
 
 /* module.c */
 struct smap_module_instance {
@@ -202,6 +209,23 @@ struct smap_database_instance {
 	struct smap_module_instance *inst;
 	smap_database_t dbh;
 	int opened;
+	struct negcache *negcache;     /* Negative lookup cache */
+	struct coalesce *coalesce;     /* In-flight query coalescing */
+	struct xcache *xcache;         /* Transformation cache */
+	struct hedge *hedge;           /* Replicas for hedged requests */
+	struct breaker *breaker;       /* Circuit breaker */
+	struct broker_pool *broker_pool; /* Connection brokers */
+	int notify_fd;                 /* Change notification descriptor */
+	time_t notify_time;            /* Time of the last attempt to listen */
+	char *onerror_reply;           /* Reply if the database is unusable */
+	int onerror_continue;          /* Try next rule if it is unusable */
+	int persistent;                /* Keep open across sessions */
+	unsigned max_idle;             /* Close if unused that long, s */
+	unsigned max_lifetime;         /* Close if open that long, s */
+	time_t open_time;              /* Time the database was opened */
+	time_t last_used;              /* End of the last session */
+	int verified;                  /* Checked in the current session */
+	struct parallel_thread *thread; /* Outstanding parallel query */
 };
 
 #define PATH_PREPEND 0
@@ -217,16 +241,158 @@ int database_declare(const char *file, unsigned line,
 		     int argc, char **argv,
 		     struct smap_database_instance **pdb);
 struct smap_database_instance *database_locate(const char *id);
+int database_open(struct smap_database_instance *dbi);
 
 void init_databases(void);
 void free_databases(void);
 void close_databases(void);
+void preopen_databases(void);
+void open_databases(const char *id);
+void refresh_databases(void);
+void expire_databases(void);
+void start_brokers(void);
+void check_brokers(void);
+int brokers_exited(pid_t pid, int status);
+void stop_brokers(void);
+void start_listeners(void);
+void check_listeners(void);
+void stop_listeners(void);
+unsigned databases_refresh_interval(void);
+
+/* hash.c */
+typedef unsigned long long smap_hash_t;
+smap_hash_t smap_strhash(const char *str, size_t len, int fold);
+
+/* negcache.c */
+struct negcache;
+
+struct negcache *negcache_create(void);
+void negcache_free(struct negcache *nc);
+void negcache_set_file(struct negcache *nc, const char *file);
+int negcache_set_fp_rate(struct negcache *nc, double rate);
+void negcache_set_refresh(struct negcache *nc, unsigned refresh);
+void negcache_set_fold(struct negcache *nc, int fold);
+void negcache_set_reply(struct negcache *nc, const char *reply);
+const char *negcache_get_file(struct negcache *nc);
+unsigned negcache_get_refresh(struct negcache *nc);
+const char *negcache_get_reply(struct negcache *nc);
+int negcache_load(struct negcache *nc, const char *dbid);
+void negcache_refresh(struct negcache *nc, const char *dbid);
+int negcache_absent(struct negcache *nc, const char *key);
+void negcache_add(struct negcache *nc, const char *key);
+
+/* shm.c */
+typedef volatile int shm_lock_t;
+
+void *shm_alloc(size_t size);
+void shm_free(void *ptr, size_t size);
+void shm_lock(shm_lock_t *lock);
+void shm_unlock(shm_lock_t *lock);
+int shm_pid_alive(pid_t pid);
+void shm_counter_inc(unsigned long *p);
+
+/* coalesce.c */
+struct coalesce;
+
+struct coalesce *coalesce_create(void);
+void coalesce_free(struct coalesce *cf);
+void coalesce_set_timeout(struct coalesce *cf, unsigned timeout);
+int coalesce_init(struct coalesce *cf, int conninfo);
+int coalesce_run(struct coalesce *cf, const char *dbid,
+		 const char *map, const char *key,
+		 struct smap_conninfo const *conninfo, smap_stream_t ostr,
+		 int (*fun)(void *, smap_stream_t), void *closure);
+
+/* xcache.c */
+struct xcache;
+
+struct xcache *xcache_create(size_t size);
+void xcache_free(struct xcache *xc);
+int xcache_init(struct xcache *xc);
+int xcache_lookup(struct xcache *xc, const char *input, char **output);
+void xcache_store(struct xcache *xc, const char *input, const char *output);
+void xcache_stat(struct xcache *xc, unsigned long *hits,
+		 unsigned long *misses);
+
+/* parallel.c */
+struct parallel_thread;
+
+int parallel_query(size_t dbc, struct smap_database_instance **dbv,
+		   unsigned timeout, const char *map, const char *key,
+		   struct smap_conninfo const *conninfo, smap_stream_t ostr);
+int parallel_hedge(struct smap_database_instance *dbi,
+		   const char *map, const char *key,
+		   struct smap_conninfo const *conninfo, smap_stream_t ostr);
+void parallel_join(struct smap_database_instance *dbi);
+int parallel_wait(struct smap_database_instance *dbi);
+int parallel_busy(struct smap_database_instance *dbi);
+
+/* hedge.c */
+struct hedge;
+
+struct hedge *hedge_create(void);
+void hedge_free(struct hedge *hp);
+void hedge_add_replica(struct hedge *hp, const char *name);
+int hedge_set_percentile(struct hedge *hp, double p);
+void hedge_set_delay(struct hedge *hp, unsigned min, unsigned max);
+int hedge_init(struct hedge *hp, struct smap_database_instance *dbi);
+size_t hedge_replicas(struct hedge *hp,
+		      struct smap_database_instance ***pv);
+void hedge_record(struct hedge *hp, unsigned long usec);
+unsigned hedge_delay(struct hedge *hp);
+
+/* breaker.c */
+struct breaker;
+
+struct breaker *breaker_create(void);
+void breaker_free(struct breaker *br);
+void breaker_set_threshold(struct breaker *br, unsigned threshold);
+void breaker_set_backoff(struct breaker *br, unsigned min, unsigned max);
+int breaker_init(struct breaker *br);
+int breaker_allow(struct breaker *br, const char *dbid);
+void breaker_report(struct breaker *br, const char *dbid, int success);
+
+/* broker.c */
+struct broker_pool;
+
+/* Minimal lifetime of a broker, s.  A broker that terminates earlier
+   is restarted after that many seconds. */
+#define BROKER_RESTART_DELAY 5
+
+struct broker_pool *broker_pool_create(void);
+void broker_pool_free(struct broker_pool *bp);
+void broker_pool_set_size(struct broker_pool *bp, unsigned size);
+void broker_pool_set_queue(struct broker_pool *bp, unsigned queue);
+void broker_pool_set_socket(struct broker_pool *bp, const char *file);
+int broker_pool_init(struct broker_pool *bp,
+		     struct smap_database_instance *dbi);
+void broker_pool_start(struct smap_database_instance *dbi);
+void broker_pool_check(struct smap_database_instance *dbi);
+int broker_pool_exited(struct smap_database_instance *dbi, pid_t pid,
+		       int status);
+void broker_pool_stop(struct smap_database_instance *dbi);
 
 /* query.c */
 int parse_dispatch(char **wordv);
 void link_dispatch_rules(void);
+extern int dispatch_optimize_option;
+extern unsigned dispatch_optimize_interval;
+unsigned dispatch_reorder_interval(void);
+void dispatch_reorder(void);
+void dispatch_set_server(const char *id);
+void dispatch_iterate_databases(const char *id,
+				void (*fun)(struct smap_database_instance *));
 void dispatch_query(const char *id, struct smap_conninfo const *conninfo,
 		    smap_stream_t ostr, const char *map, const char *key);
+void dispatch_batch(const char *id, struct smap_conninfo const *conninfo,
+		    smap_stream_t ostr, size_t n,
+		    const char **mapv, const char **keyv);
+int database_failure(struct smap_database_instance *dbi, smap_stream_t ostr);
+
+/* Return value of the query functions of smapd's own modules: the
+   database could not be used and the query should be passed to the
+   next rule */
+#define QUERY_NEXT_RULE (-2)
 
 /* close-fds.c */
 void close_fds_above(int fd);
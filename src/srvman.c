@@ -57,8 +57,18 @@ union srvman_sockaddr {
 	struct sockaddr_un s_un;
 };
 
+/* Auxiliary descriptor watched by the server manager */
+struct aux_fd {
+	struct aux_fd *next;
+	int fd;
+	smap_srvman_fd_handler_t handler;
+	void *data;
+};
+
 struct srvman {
 	struct smap_server *head, *tail; /* List of servers */
+	struct aux_fd *aux_head;    /* List of auxiliary descriptors */
+	int aux_changed;            /* The list has changed */
 	size_t num_children;        /* Current number of running
 				       sub-processes. */
 	sigset_t sigmask;           /* A set of signals to handle by the
@@ -220,6 +230,9 @@ unregister_child(pid_t pid, int status)
 				return rc;
 			}
 	}
+	if (srvman_param.exit_hook
+	    && srvman_param.exit_hook(pid, status, srvman_param.data))
+		return 0;
 	/* FIXME */
 	return 0;
 }
@@ -341,6 +354,12 @@ smap_server_get_data_ptr(struct smap_server *srv)
 	return srv->data;
 }
 
+const char *
+smap_server_get_id(struct smap_server *srv)
+{
+	return srv->id;
+}
+
 void
 smap_server_set_max_children(struct smap_server *srv, size_t n)
 {
@@ -562,10 +581,58 @@ connection_loop(fd_set *fdset)
 	return rc;
 }
 
+/* Call handlers of the auxiliary descriptors ready in FDSET */
+static void
+aux_loop(fd_set *fdset)
+{
+	struct aux_fd *p, *next;
+
+	for (p = srvman.aux_head; p; p = next) {
+		next = p->next;
+		if (FD_ISSET(p->fd, fdset))
+			p->handler(p->fd, p->data);
+	}
+}
+
+/* Watch the descriptor FD in the main loop and call HANDLER when it
+   becomes readable.  This is used by the master process to receive
+   events other than incoming connections. */
+void
+smap_srvman_add_fd(int fd, smap_srvman_fd_handler_t handler, void *data)
+{
+	struct aux_fd *p = emalloc(sizeof(*p));
+	p->fd = fd;
+	p->handler = handler;
+	p->data = data;
+	p->next = srvman.aux_head;
+	srvman.aux_head = p;
+	srvman.aux_changed = 1;
+}
+
+/* Stop watching FD.  A handler may remove its own descriptor. */
+void
+smap_srvman_remove_fd(int fd)
+{
+	struct aux_fd *p, *prev = NULL;
+
+	for (p = srvman.aux_head; p; prev = p, p = p->next) {
+		if (p->fd == fd) {
+			if (prev)
+				prev->next = p->next;
+			else
+				srvman.aux_head = p->next;
+			free(p);
+			srvman.aux_changed = 1;
+			return;
+		}
+	}
+}
+
 int
 compute_fdset(fd_set *fdset)
 {
 	struct smap_server *p;
+	struct aux_fd *ap;
 	int maxfd = 0;
 	FD_ZERO(fdset);
 	for (p = srvman.head; p; p = p->next) {
@@ -575,6 +642,12 @@ compute_fdset(fd_set *fdset)
 		if (p->fd > maxfd)
 			maxfd = p->fd;
 	}
+	for (ap = srvman.aux_head; ap; ap = ap->next) {
+		FD_SET(ap->fd, fdset);
+		if (ap->fd > maxfd)
+			maxfd = ap->fd;
+	}
+	srvman.aux_changed = 0;
 	debug(DBG_SRVMAN, 10, ("recomputed fdset: %d fds", maxfd));
 	return maxfd;
 }
@@ -603,7 +676,7 @@ smap_srvman_run(sigset_t *set)
 
 	for (stop = 0; srvman.head && !stop;) {
 		int rc;
-		struct timeval *to;
+		struct timeval *to, tv;
 		fd_set rdset;
 
 		if (need_cleanup) {
@@ -611,7 +684,7 @@ smap_srvman_run(sigset_t *set)
 			recompute_fd = children_cleanup();
 		}
 
-		if (recompute_fd) {
+		if (recompute_fd || srvman.aux_changed) {
 			maxfd = compute_fdset(&fdset);
 			recompute_fd = 0;
 		}
@@ -636,9 +709,17 @@ smap_srvman_run(sigset_t *set)
 			debug(DBG_SRVMAN, 2, ("break requested by idle hook"));
 			break;
 		}
+		/* The idle hook may have changed auxiliary descriptors */
+		if (srvman.aux_changed)
+			maxfd = compute_fdset(&fdset);
 
 		rdset = fdset;
-		to = NULL; /* FIXME */
+		if (srvman_param.idle_hook && srvman_param.idle_interval) {
+			tv.tv_sec = srvman_param.idle_interval;
+			tv.tv_usec = 0;
+			to = &tv;
+		} else
+			to = NULL;
 		rc = select(maxfd + 1, &rdset, NULL, NULL, to);
 		if (rc == -1 && errno == EINTR)
 			continue;
@@ -647,6 +728,7 @@ smap_srvman_run(sigset_t *set)
 			break;
 		}
 		recompute_fd = connection_loop(&rdset);
+		aux_loop(&rdset);
 	}
 
 	restore_signal_handlers();
@@ -29,6 +29,8 @@ typedef	int (*smap_server_prefork_hook_t) (const char *id,
 					  void *server_data,
 					  void *srvman_data);
 typedef	int (*smap_srvman_hook_t) (void *data);
+typedef int (*smap_srvman_exit_hook_t) (pid_t pid, int status, void *data);
+typedef void (*smap_srvman_fd_handler_t) (int fd, void *data);
 typedef int (*smap_srvman_prefork_hook_t) (struct sockaddr const *sa,
 					  socklen_t len,
 					  void *data);
@@ -46,8 +48,14 @@ struct srvman_param {
 	int reuseaddr;
 	unsigned shutdown_timeout;
 	smap_srvman_hook_t idle_hook;             /* Idle function */
+	unsigned idle_interval;     /* Call idle_hook at least once in that
+				       many seconds (0 - only when woken up
+				       by an event) */
 	smap_srvman_prefork_hook_t prefork_hook;  /* Pre-fork function */
 	smap_srvman_hook_t free_hook;             /* Free function */
+	smap_srvman_exit_hook_t exit_hook;        /* Called for terminated
+						     subprocesses that do
+						     not serve sessions */
 	size_t max_children;        /* Maximum number of sub-processes
 				       to run. */
 	int backlog;
@@ -71,6 +79,7 @@ void smap_server_free(smap_server_t srv);
 void smap_server_set_prefork_hook(smap_server_t srv,
 				 smap_server_prefork_hook_t hook);
 void *smap_server_get_data_ptr(struct smap_server *srv);
+const char *smap_server_get_id(struct smap_server *srv);
 void smap_server_set_data(smap_server_t srv,
 			 void *data,
 			 smap_srvman_hook_t free_hook);
@@ -95,4 +104,8 @@ void smap_srvman_stop(void);
 
 void smap_srvman_iterate_data(int (*fun)(struct smap_server *, void *));
 
+void smap_srvman_add_fd(int fd, smap_srvman_fd_handler_t handler,
+			void *data);
+void smap_srvman_remove_fd(int fd);
+
 #endif
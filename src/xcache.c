@@ -0,0 +1,163 @@
+/* This file is part of Smap.
+   Copyright (C) 2015 Sergey Poznyakoff
+
+   Smap is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Smap is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Smap.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Transformation cache.
+
+   Results of smap_xform calls are memoized in a direct-mapped table
+   in the shared memory, keyed by the input string, so that they are
+   reused by all subprocesses.  A new entry simply replaces the one
+   occupying its slot.  Each entry has a lock of its own, so that
+   lookups of different inputs do not contend with each other.
+
+   Since the client addresses are not part of the key, the cache is
+   used only for databases whose results do not depend on them. */
+
+#include "smapd.h"
+
+/* Maximum total length of input and output strings */
+#define XCACHE_DATA_MAX 512
+
+struct xcache_entry {
+	shm_lock_t lock;
+	unsigned long hits;         /* Lookups that found the input here */
+	unsigned long misses;       /* Lookups that did not */
+	smap_hash_t hash;           /* Hash of the input string */
+	unsigned short inlen;       /* Length of the input, 0 - unused */
+	short outlen;               /* Length of the output, -1 - no
+				       transformation */
+	char data[XCACHE_DATA_MAX]; /* Input followed by output */
+};
+
+struct xcache_shm {
+	struct xcache_entry ent[1];
+};
+
+struct xcache {
+	size_t size;                /* Number of entries */
+	struct xcache_shm *shm;
+};
+
+#define XCACHE_SHM_SIZE(n) \
+	(sizeof(struct xcache_shm) + ((n) - 1) * sizeof(struct xcache_entry))
+
+struct xcache *
+xcache_create(size_t size)
+{
+	struct xcache *xc = ecalloc(1, sizeof(*xc));
+	xc->size = size;
+	return xc;
+}
+
+void
+xcache_free(struct xcache *xc)
+{
+	if (!xc)
+		return;
+	shm_free(xc->shm, XCACHE_SHM_SIZE(xc->size));
+	free(xc);
+}
+
+int
+xcache_init(struct xcache *xc)
+{
+	xc->shm = shm_alloc(XCACHE_SHM_SIZE(xc->size));
+	return xc->shm == NULL;
+}
+
+/* Look up INPUT in the cache.  On success, store a copy of the cached
+   result (or NULL, if the transformation left the input unchanged) in
+   *OUTPUT and return 0.  Return 1 if INPUT is not in the cache. */
+int
+xcache_lookup(struct xcache *xc, const char *input, char **output)
+{
+	size_t len = strlen(input);
+	smap_hash_t hash;
+	struct xcache_entry *ep;
+	char buf[XCACHE_DATA_MAX];
+	int outlen = 0;
+	int rc = 1;
+
+	if (len == 0 || len >= XCACHE_DATA_MAX)
+		return 1;
+	hash = smap_strhash(input, len, 0);
+	ep = &xc->shm->ent[hash % xc->size];
+
+	shm_lock(&ep->lock);
+	if (ep->inlen == len && ep->hash == hash
+	    && memcmp(ep->data, input, len) == 0) {
+		outlen = ep->outlen;
+		if (outlen > 0)
+			memcpy(buf, ep->data + len, outlen);
+		ep->hits++;
+		rc = 0;
+	} else
+		ep->misses++;
+	shm_unlock(&ep->lock);
+
+	if (rc == 0) {
+		if (outlen < 0)
+			*output = NULL;
+		else {
+			*output = emalloc(outlen + 1);
+			memcpy(*output, buf, outlen);
+			(*output)[outlen] = 0;
+		}
+	}
+	return rc;
+}
+
+/* Store the result of transforming INPUT into OUTPUT.  A NULL OUTPUT
+   means the transformation left the input unchanged. */
+void
+xcache_store(struct xcache *xc, const char *input, const char *output)
+{
+	size_t inlen = strlen(input);
+	size_t outlen = output ? strlen(output) : 0;
+	smap_hash_t hash;
+	struct xcache_entry *ep;
+
+	if (inlen == 0 || inlen + outlen > XCACHE_DATA_MAX)
+		return;
+	hash = smap_strhash(input, inlen, 0);
+	ep = &xc->shm->ent[hash % xc->size];
+
+	shm_lock(&ep->lock);
+	ep->hash = hash;
+	ep->inlen = inlen;
+	memcpy(ep->data, input, inlen);
+	if (output) {
+		ep->outlen = outlen;
+		memcpy(ep->data + inlen, output, outlen);
+	} else
+		ep->outlen = -1;
+	shm_unlock(&ep->lock);
+}
+
+void
+xcache_stat(struct xcache *xc, unsigned long *hits, unsigned long *misses)
+{
+	size_t i;
+
+	*hits = *misses = 0;
+	for (i = 0; i < xc->size; i++) {
+		struct xcache_entry *ep = &xc->shm->ent[i];
+
+		shm_lock(&ep->lock);
+		*hits += ep->hits;
+		*misses += ep->misses;
+		shm_unlock(&ep->lock);
+	}
+}